@@ -13,10 +13,6 @@ lang_cb                         P_lang;
 
 static char                     g_log_name[64];                     // 系统日志名称（从可执行文件名提取）
 static bool                     g_log_sys;
-static FILE*                    g_log_fp = NULL;                    // 日志文件指针（默认为 stderr）
-static void*                    g_cache_head, *g_cache_rear;
-static uint32_t                 g_line_count;
-static P_mutex_t                g_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 //-----------------------------------------------------------------------------
 #ifdef LOG_INSTRUMENT
@@ -30,29 +26,37 @@ typedef enum {
 static inst_mode_e              g_inst_mode   = INST_MODE_HOST;     // 默认主机模式
 static uint32_t                 g_inst_keep_chn[8] = {0};           // 保留通道 bitset (256位)，作为本地模式的过滤选项
                                                                     // + 即只对特定通道进行数据广播
+static uint32_t                 g_inst_gate[8] = { ~0u, ~0u, ~0u, ~0u, ~0u, ~0u, ~0u, ~0u };
+                                                                    // 需要格式化发送的通道 bitset，instrument_slot 入口检查
+                                                                    // + 未开启 instrument_interest 时全部为 1
 static uint16_t                 g_inst_port   = INSTRUMENT_PORT;    // 可通过 instrument_port() 修改
 static uint8_t                  g_inst_ctrl   = INSTRUMENT_CTRL;    // 可通过 instrument_ctrl() 修改
 
 // 本地回调和监听
 static instrument_cb            g_inst_cb     = NULL;
+static instrument_ex_cb         g_inst_cb_ex  = NULL;               // instrument_listen_ex 注册的回调（优先于 g_inst_cb）
 static TLS int                  g_inst_in_cb  = 0;                  // 防止回调递归
 static log_cb                   g_inst_log_cb = NULL;               // instrument 内部日志回调
 
-// 本地选项 bitset
-static volatile uint8_t*        g_inst_bits     = NULL;             // 动态分配
-static volatile uint16_t        g_inst_bits_len = 0;                // 已分配字节数
+// 选项 bitset：固定容量（覆盖全部 uint16_t 索引），读取无锁；按字节修改时用 CAS 更新所在的字
+uint32_t                        instrument_bits[INSTRUMENT_OPT_WORDS];
+uint32_t                        instrument_gen = 0;                 // 选项变化计数
 
 // instrument tick 机制，用于 P_tick_xxx() 相关操作
 int64_t                         instrument_tick = 0;               // <=0: 累计等待时长(us)取反; >0: 冻结tick_us
 
 // 本地端口和通讯
 static uint16_t                 g_inst_rid    = 0;                  // 本节点随机 ID
-static uint16_t                 g_inst_seq    = 0;
+static uint32_t                 g_inst_seq    = 0;                  // 低 16 位为下一个数据包的 seq，整体为经 UDP 发送的数据包数
+static uint32_t                 g_inst_shm_sent = 0;                // 经共享内存发送的数据包数（独立 seq 空间）
 static sock_t                   g_inst_sock   = P_INVALID_SOCKET;
 static struct sockaddr_in       g_inst_dest;
 
 // 运行和状态
 static volatile bool            g_inst_running = false;
+static P_mutex_t                g_inst_rx_mutex;                    // 串行化接收线程与共享内存读取线程的回调
+static P_mutex_t                g_inst_opt_mutex;                   // 选项版本戳及快照状态（不在持有期间调用回调）
+static P_mutex_t                g_inst_mreg_mutex;                  // 指标登记表（不在持有期间调用回调）
 static thd_t                    g_inst_thread  = 0;
 
 // 组播地址：239.255.77.77 (自定义本地管理组播地址)
@@ -67,22 +71,122 @@ static thd_t                    g_inst_thread  = 0;
 #define INST_PAYLOAD_MAX        (INST_UDP_MAX - INST_HDR_SIZE)      // 可用数据区 (tag + text)
 #define INST_WINDOW_SIZE        64                                  // 接收端滑动窗口大小（必须为 2 的幂）
 #define INST_WINDOW_MASK        (INST_WINDOW_SIZE - 1)
-
-// 窗口槽位
-typedef struct {
+#define INST_LOG_SLOTS          64                                  // 远程日志级别槽数（每槽 4 位）
+#define INST_LOG_BYTE(i)        ((i) >= INSTRUMENT_LOG_BASE / 8 && (i) < INSTRUMENT_LOG_BASE / 8 + INST_LOG_SLOTS / 2)
+#define INST_BATCH_SHARDS       8                                   // 批量发送缓冲区数（线程按序分配）
+#define INST_BATCH_REC_HDR      4                                   // 批量包内记录头：chn(1)+tag_len(1)+text_len(2)
+#ifndef INST_RECV_BATCH
+#define INST_RECV_BATCH         32                                  // recvmmsg 单次最多接收的包数（1 相当于逐包接收）
+#endif
+#define INST_RECV_CTRL          64                                  // 每个接收包的辅助数据缓冲区（SO_RXQ_OVFL 计数、SO_TIMESTAMPNS）
+#define INST_SEND_BATCH         16                                  // sendmmsg 单次最多发送的包数
+#define INST_ASYNC_HIGH         64                                  // 异步发送高优先级环的深度
+
+#define INST_SLAB_SLOTS         32                                  // 每个 slab 的窗口槽位数
+#define INST_TYPE_MASK          0x3F                                // type 低 6 位为包类型
+#define INST_TYPE_RELIABLE      0x40                                // 数据包标志：发送方保留了重传环，接收方可以 NACK
+#define INST_TYPE_STAMP         0x80                                // 数据包标志：包末尾附带发送时间（墙钟 us）
+#define INST_STAMP_SIZE         8
+#define INST_NACK_MS            5                                   // 同一 sender 两次 NACK 的最小间隔
+#define INST_NACK_GIVEUP_MS     200                                 // 空洞等待重传的最长时间，超时后跳过
+#define INST_NACK_SIZE          (INST_HDR_SIZE + 12)                // header + target_rid(2) + base_seq(2) + bitmap(8)
+#define INST_FRAG_HDR           (INST_HDR_SIZE + 6)                 // header + msg_id(2) + idx(2) + cnt(2)
+#define INST_FRAG_CHUNK         (INST_UDP_MAX - INST_FRAG_HDR)      // 每个分片携带的数据量
+#define INST_FRAG_SLOTS         16                                  // 同时重组中的消息数上限
+#define INST_FRAG_TIMEOUT_MS    2000                                // 重组超时（两个分片间隔）
+#define INST_MSG_MAX            (16 << 20)                          // 单条消息（分片前的完整包）上限
+#define INST_RCVBUF_MAX         (16 << 20)                          // 自动增大接收缓冲区的上限
+#define INST_REQ_MAX            256                                 // 同时未完成的请求数上限（必须为 2 的幂）
+#define INST_REQ_RESEND_MS      500                                 // REQ 重发间隔
+#define INST_SENDER_TTL         60000                               // 默认 sender 老化时间 (ms)
+#define INST_SNAP_MS            5000                                // 设置过选项的节点广播选项快照的周期
+#define INST_SNAP_REC           11                                  // 快照记录：byte_idx(2) + byte(1) + stamp(8)
+#define INST_INTEREST_MS        1000                                // 监听方广播订阅的周期
+#define INST_INTEREST_TTL       3500                                // 发送方保留订阅的时间（超时视为监听方已退出）
+#define INST_INTEREST_SIZE      (INST_HDR_SIZE + 32)                // header + 通道 bitset(32)
+#define INST_METRIC_MAX         256                                 // 可注册的指标数上限
+#define INST_METRIC_SHARDS      8                                   // 指标累计分片数（线程按序分配）
+#define INST_METRIC_CELLS       4096                                // 每个分片的累计单元数
+#define INST_METRIC_HIST_CELLS  (2 + INSTRUMENT_METRIC_BUCKETS)     // 直方图占用的单元：count + sum + 各桶
+#define INST_METRIC_DEF         0x80                                // 指标记录 kind 标志：定义记录（携带名称）
+#define INST_METRIC_DEF_MS      5000                                // 定义重发周期，供后加入的监听方解析名称
+#define INST_STAT_BUCKETS       10                                  // 接收速率的滑动桶数
+#define INST_STAT_BUCKET_MS     100                                 // 每桶时长，速率为最近 1 秒（100ms 粒度滑动）
+
+// 窗口槽位（仅乱序缓存时从共享 slab 池分配）
+typedef struct inst_slot_s {
+    struct inst_slot_s*     next;                   // 空闲链表
+    int len;
+    uint64_t                rx_us;                  // 到达时间（交付时作为 recv_us）
     uint8_t data[INST_UDP_MAX + 1];                  // +1 供交付时追加 '\0'
-    int len;                                         // 0 = 空槽
 } inst_slot_t;
 
-// RID (sender) 分组，每个 sender 独立滑动窗口（单向链表，动态分配）
-typedef struct inst_sender_s {
-    struct inst_sender_s*   next;
+typedef struct inst_slab_s {
+    struct inst_slab_s*     next;
+    inst_slot_t             slots[INST_SLAB_SLOTS];
+} inst_slab_t;
+
+// 接收统计（每个 sender 一份，另有一份聚合），只由持有 g_inst_rx_mutex 的线程访问
+typedef struct {
+    uint64_t                received;               // 收到的数据包数（含重复）
+    uint64_t                bytes;
+    uint64_t                in_order;               // 按序到达直接交付
+    uint64_t                reordered;              // 提前到达，缓存到窗口
+    uint64_t                dropped;                // 窗口滑过或放弃重传而跳过的 seq 数
+    uint64_t                duplicated;             // 重复或早于 next_seq 的包
+    uint32_t                window_max;             // 窗口占用峰值
+    uint64_t                rate_epoch;             // 当前速率桶序号 (ms / INST_STAT_BUCKET_MS)
+    uint32_t                rate_pkts[INST_STAT_BUCKETS];
+    uint32_t                rate_bytes[INST_STAT_BUCKETS];
+} inst_stat_t;
+
+// RID (sender) 分组，每个 sender 独立滑动窗口（开放寻址哈希表，窗口槽位按需分配）
+typedef struct {
     uint16_t                rid;
     uint16_t                next_seq;
     bool                    synced;
-    inst_slot_t             win[INST_WINDOW_SIZE];
+    uint16_t                held;                   // 已缓存的乱序包数
+    uint16_t                max_seq;                // 已收到的最大 seq
+    uint16_t                gap_seq;                // 空洞计时开始时的 next_seq
+    bool                    reliable;               // 发送方开启了可靠模式（数据包带 INST_TYPE_RELIABLE）
+    bool                    gap;                    // 可靠模式下 next_seq 之后有已收到但未交付的包
+    uint64_t                last_ms;                // 最近收到包的时间，用于老化
+    uint64_t                gap_ms;                 // next_seq 开始阻塞的时间
+    uint64_t                nack_ms;                // 上次发送 NACK 的时间
+    inst_stat_t             stat;
+    inst_slot_t*            win[INST_WINDOW_SIZE];  // NULL = 空槽
 } inst_sender_t;
-static inst_sender_t           *g_inst_senders = NULL;
+
+// 以下状态只由接收线程访问
+static inst_sender_t**          g_inst_senders = NULL;              // 哈希表（线性探测），NULL = 空位
+static uint32_t                 g_inst_senders_cap = 0;             // 容量（2 的幂）
+static uint32_t                 g_inst_senders_n = 0;
+static inst_slab_t*             g_inst_slabs = NULL;
+static inst_slot_t*             g_inst_slot_free = NULL;
+static uint64_t                 g_inst_senders_aged = 0;            // 上次老化扫描时间 (ms)
+static uint32_t                 g_inst_sender_ttl = INST_SENDER_TTL;
+static uint32_t                 g_inst_gaps = 0;                    // 等待重传的 sender 数（gap 为 true）
+static volatile bool            g_inst_senders_reset = false;       // instrument_listen 请求清空（由接收线程执行）
+static inst_stat_t              g_inst_stat;                        // 聚合统计（sender 被移除后仍保留）
+static uint32_t                 g_inst_rx_ovfl = 0;                 // 内核接收队列溢出累计（SO_RXQ_OVFL）
+
+// 统计快照：接收线程 / 共享内存读取线程每批处理后发布（不在回调中），instrument_stats 只读快照，
+// 因此回调中也可以查询统计（回调运行时持有 g_inst_rx_mutex）
+typedef struct {
+    uint16_t                    rid;
+    uint16_t                    held;
+    uint64_t                    last_ms;
+    inst_stat_t                 stat;
+} inst_stat_pub_t;
+
+static struct {
+    P_mutex_t                   mutex;
+    inst_stat_t                 total;
+    uint32_t                    window;             // 各 sender 窗口占用之和
+    uint64_t                    updated_ms;
+    inst_stat_pub_t*            senders;
+    uint32_t                    n, cap;
+}                               g_inst_stat_pub;
 
 // wait/continue 握手状态
 static char                     g_inst_wait_from[INST_PORT_MAX]; // 期望的 from（空串=任意方）
@@ -90,13 +194,62 @@ static volatile bool            g_inst_wait_done  = false;          // continue
 static char                     g_inst_id[INST_PORT_MAX];      // instrument_listen 注册的 id
 static bool                     g_inst_id_set = false;              // id 是否已设置（false=不接受 req）
 
-// req/resp 握手状态
-static volatile bool            g_inst_req_done   = false;          // resp 已收到
-static char*                    g_inst_req_buf    = NULL;           // 请求方 buffer 指针
-static size_t                   g_inst_req_bufsz  = 0;              // buffer 大小
+// req/resp 握手状态：每个未完成的请求占一个槽位，req_id 写在 REQ/RESP header 的 seq 字段
+// 槽位由 g_inst_sig.mutex 保护；重发和超时由接收线程处理
+typedef struct {
+    uint16_t                    id;                 // req_id（非 0），0 表示空槽
+    volatile bool               done;               // 已完成（收到 resp 或超时）
+    ret_t                       ret;                // 完成结果：E_NONE / E_TIMEOUT
+    char*                       buf;                // 请求方 buffer（出参：响应内容）
+    size_t                      bufsz;
+    instrument_req_cb           cb;                 // 非 NULL：完成时在接收线程回调并释放槽位
+    void*                       ctx;
+    uint8_t*                    pkt;                // REQ 包（重发用）
+    int                         pkt_len;
+    uint64_t                    sent_ms;            // 上次发送时间
+    uint64_t                    deadline_ms;        // 超时时刻，0 表示无限等待
+} inst_req_t;
+
+static inst_req_t               g_inst_reqs[INST_REQ_MAX];
+static uint32_t                 g_inst_reqs_n = 0;                  // 未完成的请求数
+static uint16_t                 g_inst_req_next = 0;                // 下一个分配的 req_id
+static TLS uint16_t             g_inst_req_cur_rid = 0;             // 回调中的 REQ：请求方 rid
+static TLS uint16_t             g_inst_req_cur_id  = 0;             // 回调中的 REQ：req_id
+
+// 分片重组：按 (rid, msg_id) 查找，由 g_inst_rx_mutex 保护
+typedef struct {
+    uint16_t                    rid;
+    uint16_t                    id;                 // msg_id
+    uint16_t                    next;               // 期望的下一个分片序号
+    uint16_t                    cnt;                // 分片总数，0 表示空槽
+    int                         len, cap;
+    uint8_t*                    buf;                // 重组中的完整包（+1 余量供 \0）
+    uint64_t                    ms;                 // 最近收到分片的时间
+} inst_frag_t;
+
+static inst_frag_t              g_inst_frags[INST_FRAG_SLOTS];
+static uint32_t                 g_inst_frag_id = 0;                 // 下一个发送的 msg_id
+static int                      g_inst_rcvbuf  = 1024 * 1024;       // 当前接收缓冲区大小
+
+// 握手完成通知：接收线程在 g_inst_sig.mutex 下置位 done 标志并唤醒等待方
+static struct {
+    P_mutex_t                   mutex;
+    P_cond_t                    cond;
+} g_inst_sig;
 
 // 前向声明
 static void inst_send_buf(uint8_t chn, char* buf, int tag_len, int text_len);
+static bool inst_batch_put(uint8_t chn, const char* tag, int tag_len, const char* text, int text_len);
+static void inst_batch_flush_own(void);
+static void inst_metrics_flush(void);
+static void inst_mreg_drop(uint16_t rid);
+static void inst_mreg_clear(void);
+static void inst_interest_send(bool query);
+static void inst_interest_update(uint64_t now_ms);
+static void inst_stat_rx(inst_stat_t* st, int n, uint64_t now_ms);
+static void inst_stats_publish(void);
+static volatile int             g_inst_stamp = 0;                   // 数据包附带发送时间戳
+static volatile uint32_t        g_inst_batch_us = 0;               // 批量发送 deadline (us)，0 表示关闭批量模式
 
 #define LOG_HDR_RESERVE         INST_HDR_SIZE                       // g_line 预留的 header+tag 空间
 
@@ -444,6 +597,94 @@ int ARGS_print(const char* arg0) {
     return 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// 有界无锁队列（内部使用）
+///////////////////////////////////////////////////////////////////////////////
+
+// 基于 Vyukov 的有界 MPMC 队列：每个槽位带序号，入队/出队各自只需一次 CAS
+// + 槽位定长（头部 + data_size 字节数据区），数据区由使用方自行解释
+// + 生产者：lfq_claim() 占位 -> 写入数据 -> lfq_commit() 发布
+// + 消费者：lfq_take() 占位 -> 读取数据 -> lfq_release() 归还
+// + 由于支持多消费者，生产者也可以通过 lfq_take() 丢弃最旧的数据（drop-oldest）
+typedef struct {
+    volatile size_t             seq;                // 槽位序号（Vyukov 状态）
+    int                         len;                // 数据长度（使用方自定义）
+} lfq_slot_t;
+
+typedef struct {
+    uint8_t*                    slots;
+    size_t                      mask;
+    size_t                      slot_size;          // 单个槽位字节数（含 lfq_slot_t 头部）
+    char                        pad0[64];
+    volatile size_t             head;               // 入队位置
+    char                        pad1[64];
+    volatile size_t             tail;               // 出队位置
+    char                        pad2[64];
+} lfq_t;
+
+#define LFQ_SLOT(q, pos)        ((lfq_slot_t*)((q)->slots + ((pos) & (q)->mask) * (q)->slot_size))
+#define LFQ_DATA(slot)          ((uint8_t*)(slot) + sizeof(lfq_slot_t))
+
+static bool lfq_init(lfq_t* q, uint32_t capacity, size_t data_size) {
+
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+
+    q->slot_size = (sizeof(lfq_slot_t) + data_size + MAX_ALIGN - 1) & ~(size_t)(MAX_ALIGN - 1);
+    q->slots = (uint8_t*)malloc(cap * q->slot_size);
+    if (!q->slots) return false;
+
+    q->mask = cap - 1;
+    for (size_t i = 0; i < cap; i++) {
+        lfq_slot_t* slot = LFQ_SLOT(q, i);
+        slot->seq = i;
+        slot->len = 0;
+    }
+    q->head = q->tail = 0;
+    return true;
+}
+
+static void lfq_final(lfq_t* q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+// 生产者占位，队列满时返回 NULL
+static lfq_slot_t* lfq_claim(lfq_t* q, size_t* r_pos) {
+    size_t pos = P_get(&q->head);
+    for (;;) {
+        lfq_slot_t* slot = LFQ_SLOT(q, pos);
+        intptr_t diff = (intptr_t)P_get_acq(&slot->seq) - (intptr_t)pos;
+        if (diff == 0) {
+            if (P_test_and_set(&q->head, &pos, pos + 1)) { *r_pos = pos; return slot; }
+        }
+        else if (diff < 0) return NULL;
+        else pos = P_get(&q->head);
+    }
+}
+
+static void lfq_commit(lfq_slot_t* slot, size_t pos) {
+    P_set_rel(&slot->seq, pos + 1);
+}
+
+// 消费者占位，队列空（或最旧的槽位尚未提交）时返回 NULL
+static lfq_slot_t* lfq_take(lfq_t* q, size_t* r_pos) {
+    size_t pos = P_get(&q->tail);
+    for (;;) {
+        lfq_slot_t* slot = LFQ_SLOT(q, pos);
+        intptr_t diff = (intptr_t)P_get_acq(&slot->seq) - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (P_test_and_set(&q->tail, &pos, pos + 1)) { *r_pos = pos; return slot; }
+        }
+        else if (diff < 0) return NULL;
+        else pos = P_get(&q->tail);
+    }
+}
+
+static void lfq_release(lfq_t* q, lfq_slot_t* slot, size_t pos) {
+    P_set_rel(&slot->seq, pos + q->mask + 1);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // 系统日志（平台适配层）
 ///////////////////////////////////////////////////////////////////////////////
@@ -630,272 +871,1924 @@ static void log_write(log_level_e level, const char* tag, char* text, int len) {
 
 //-----------------------------------------------------------------------------
 
-void log_output(cstr_t filename, uint32_t sz_max) {
+//-----------------------------------------------------------------------------
+// 日志文件：用户态大缓冲 + write()/writev() 直写，支持按大小/时间轮转和可配置的落盘策略
+
+#if P_WIN
+#include <fcntl.h>
+#include <sys/stat.h>
+#define log_fd_open(path)       _open(path, _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE)
+#define log_fd_write(fd, p, n)  _write(fd, p, (unsigned)(n))
+#define log_fd_sync(fd)         _commit(fd)
+#define log_fd_close(fd)        _close(fd)
+#else
+#include <sys/uio.h>
+#define log_fd_open(path)       open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)
+#define log_fd_write(fd, p, n)  write(fd, p, n)
+#if P_LINUX
+#define log_fd_sync(fd)         fdatasync(fd)
+#else
+#define log_fd_sync(fd)         fsync(fd)
+#endif
+#define log_fd_close(fd)        close(fd)
+#endif
+
+#define LOG_FILE_BUF            (64 * 1024)         // 用户态写缓冲大小
+#define LOG_FILE_FLUSH_MS       1000                // 缓冲数据最长滞留时间
+#define LOG_FILE_KEEP           5                   // 默认保留的轮转文件数
+
+static struct {
+    int                         fd;                 // -1 表示未开启文件输出
+    char*                       path;
+    uint64_t                    size;               // 当前文件大小
+    uint32_t                    sz_max;             // 单个文件最大字节数，0 表示不限制
+    uint32_t                    rotate_s;           // 按时间轮转的周期（秒），0 表示不按时间轮转
+    uint8_t                     keep;               // 保留的轮转文件数
+    int64_t                     period;             // 当前文件所属的时间周期
+    int                         sync;               // log_sync_e 组合
+    uint32_t                    sync_ms;            // LOG_SYNC_INTERVAL 的周期
+    uint64_t                    last_flush;         // 最近一次 write 的时间（ms）
+    uint64_t                    last_sync;          // 最近一次 fsync 的时间（ms）
+    bool                        dirty;              // 自上次 fsync 以来有新写入
+    bool                        binary;             // 二进制日志模式（见 log_binary）
+    uint32_t                    gen;                // 文件会话代数，每次打开/轮转递增，用于重新输出格式字典
+    int                         buf_len;
+    char*                       buf;
+    P_mutex_t                   mutex;
+} g_log_file = { .fd = -1, .keep = LOG_FILE_KEEP, .sync = LOG_SYNC_NONE };
+
+// 写出全部数据（处理部分写入和 EINTR）
+static bool log_fd_write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = log_fd_write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n; len -= (size_t)n;
+    }
+    return true;
+}
 
-    if (g_log_fp) {
+#if !P_WIN
+// 一次 writev 写出多段数据，部分写入时逐段补写剩余部分
+static void log_fd_writev_all(int fd, struct iovec* iov, int cnt) {
+    size_t total = 0;
+    for (int i = 0; i < cnt; i++) total += iov[i].iov_len;
+    ssize_t n;
+    do n = writev(fd, iov, cnt); while (n < 0 && errno == EINTR);
+    if (n < 0 || (size_t)n >= total) return;
+    size_t off = (size_t)n;
+    for (int i = 0; i < cnt; i++) {
+        if (off >= iov[i].iov_len) { off -= iov[i].iov_len; continue; }
+        if (!log_fd_write_all(fd, (const char*)iov[i].iov_base + off, iov[i].iov_len - off)) return;
+        off = 0;
+    }
+}
+#endif
 
-        fflush(g_log_fp);
+// 将缓冲区与一条额外数据一次性写出（POSIX 下为一次 writev 调用）
+static void log_file_flush_with(const char* extra, int extra_len) {
 
-        if (g_log_fp != stderr) {
+    if (g_log_file.fd < 0) return;
+    int total = g_log_file.buf_len + extra_len;
+    if (!total) return;
 #if P_WIN
-            HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(g_log_fp));
-            if (hFile != INVALID_HANDLE_VALUE)
-                FlushFileBuffers(hFile);
+    log_fd_write_all(g_log_file.fd, g_log_file.buf, g_log_file.buf_len);
+    if (extra_len) log_fd_write_all(g_log_file.fd, extra, extra_len);
 #else
-            fsync(fileno(g_log_fp));
+    struct iovec iov[2]; int cnt = 0;
+    if (g_log_file.buf_len) { iov[cnt].iov_base = g_log_file.buf; iov[cnt++].iov_len = g_log_file.buf_len; }
+    if (extra_len) { iov[cnt].iov_base = (void*)extra; iov[cnt++].iov_len = extra_len; }
+    log_fd_writev_all(g_log_file.fd, iov, cnt);
 #endif
-            fclose(g_log_fp);
-        }
+    g_log_file.buf_len = 0;
+    g_log_file.dirty = true;
+    g_log_file.last_flush = P_tick_ms();
+}
 
-        if (!filename) {
-            g_log_fp = NULL;
-            P_mutex_final(&g_cache_mutex);
+static void log_file_sync(void) {
+    if (g_log_file.fd < 0 || !g_log_file.dirty) return;
+    log_fd_sync(g_log_file.fd);
+    g_log_file.dirty = false;
+    g_log_file.last_sync = P_tick_ms();
+}
 
-            if (g_log_sys) { g_log_sys = false;
-                log_cleanup();
-            }
-            return;
+static int64_t log_file_period(void) {
+    return g_log_file.rotate_s ? (int64_t)time(NULL) / g_log_file.rotate_s : 0;
+}
+
+static void log_bin_session(void);
+
+// 轮转：file -> file.1 -> file.2 ... -> file.keep（最旧的被覆盖）
+static void log_file_rotate(void) {
+
+    // 先分配：内存不足时不轮转，继续写入当前文件（下一次写入时重试）
+    size_t n = strlen(g_log_file.path) + 8;
+    char *src = (char*)malloc(n), *dst = (char*)malloc(n);
+    if (!src || !dst) { free(src); free(dst); return; }
+
+    log_file_flush_with(NULL, 0);
+    if (g_log_file.sync != LOG_SYNC_NONE) log_file_sync();
+    log_fd_close(g_log_file.fd);
+    g_log_file.fd = -1;
+
+    if (g_log_file.keep) {
+        for (int i = g_log_file.keep - 1; i >= 1; i--) {
+            snprintf(src, n, "%s.%d", g_log_file.path, i);
+            snprintf(dst, n, "%s.%d", g_log_file.path, i + 1);
+            rename(src, dst);
         }
+        snprintf(dst, n, "%s.1", g_log_file.path);
+        rename(g_log_file.path, dst);
     }
-    else if (!filename) {
-        if (g_log_sys) { g_log_sys = false;
-            log_cleanup();
-        }
-        return;
+    else remove(g_log_file.path);
+    free(src); free(dst);
+
+    g_log_file.fd = log_fd_open(g_log_file.path);
+    g_log_file.size = 0;
+    g_log_file.period = log_file_period();
+    if (g_log_file.binary && g_log_file.fd >= 0) log_bin_session();
+}
+
+// 写入 len 字节前检查是否需要轮转（需持有锁），返回文件是否可写
+static bool log_file_room(int len) {
+    if ((g_log_file.sz_max && g_log_file.size > 0 && g_log_file.size + len > g_log_file.sz_max) ||
+        (g_log_file.rotate_s && log_file_period() != g_log_file.period))
+        log_file_rotate();
+    return g_log_file.fd >= 0;
+}
+
+// 追加数据到写缓冲（需持有锁），缓冲区放不下时与缓冲区内容合并为一次写出
+static void log_file_put(const char* data, int len) {
+    if (g_log_file.buf_len + len <= LOG_FILE_BUF) {
+        memcpy(g_log_file.buf + g_log_file.buf_len, data, len);
+        g_log_file.buf_len += len;
     }
-    else P_mutex_init(&g_cache_mutex);
+    else if (len < LOG_FILE_BUF) {
+        log_file_flush_with(NULL, 0);
+        memcpy(g_log_file.buf, data, len);
+        g_log_file.buf_len = len;
+    }
+    else log_file_flush_with(data, len);
+    g_log_file.size += len;
+}
 
-    g_log_fp = fopen(filename, "a");
-    if (!g_log_fp) {
-        // fprintf(stderr, "Error opening log file '%s'\n", filename);
-        g_log_fp = (FILE*)-1;
+// 写入后根据级别和时间执行 flush/fsync 策略（需持有锁）
+static void log_file_policy(log_level_e level) {
+    uint64_t now = P_tick_ms();
+    bool urgent = level == LOG_SLOT_FATAL || level == LOG_SLOT_ERROR;
+    if (urgent || now - g_log_file.last_flush >= LOG_FILE_FLUSH_MS)
+        log_file_flush_with(NULL, 0);
+    if ((urgent && (g_log_file.sync & LOG_SYNC_ERROR)) ||
+        ((g_log_file.sync & LOG_SYNC_INTERVAL) && now - g_log_file.last_sync >= g_log_file.sync_ms))
+        log_file_sync();
+}
+
+static int log_bin_text(char* rec, log_level_e level, int len);
+
+// 追加一行日志（文本模式自动补充末尾换行符，二进制模式写为文本记录）
+static void log_file_append(log_level_e level, const char* out, int total) {
+
+    bool nl = !(total > 0 && out[total - 1] == '\n');
+    char hdr[16]; int hdr_len = 0;
+
+    P_mutex_lock(&g_log_file.mutex);
+    if (g_log_file.binary) { nl = false;
+        if (total > UINT16_MAX) total = UINT16_MAX;
+        hdr_len = log_bin_text(hdr, level, total);
     }
+    if (log_file_room(hdr_len + total + (nl ? 1 : 0))) {
+        if (hdr_len) log_file_put(hdr, hdr_len);
+        log_file_put(out, total);
+        if (nl) log_file_put("\n", 1);
+        log_file_policy(level);
+    }
+    P_mutex_unlock(&g_log_file.mutex);
 }
 
-//-----------------------------------------------------------------------------
+// 将缓冲区写入文件（可选 fsync），由 log_flush()/异步写线程/进程退出时调用
+static void log_file_flush(bool sync) {
+    if (g_log_file.fd < 0) return;
+    P_mutex_lock(&g_log_file.mutex);
+    log_file_flush_with(NULL, 0);
+    if (sync || ((g_log_file.sync & LOG_SYNC_INTERVAL) && P_tick_ms() - g_log_file.last_sync >= g_log_file.sync_ms))
+        log_file_sync();
+    P_mutex_unlock(&g_log_file.mutex);
+}
 
-static void log_printf(log_level_e level, const char *tag, const char *fmt, ...) {
-    va_list args; va_start(args, fmt);
-    if (g_inst_log_cb)
-        log_slot(level, tag, fmt, args, g_inst_log_cb, true);
-    else if (g_inst_cb)
-        instrument_slot(level, tag, fmt, args);
-    va_end(args);
+// 定时检查（后台线程）：缓冲数据滞留超过 LOG_FILE_FLUSH_MS 时写出、LOG_SYNC_INTERVAL 到期时 fsync，不依赖下一行日志到来
+static void log_file_tick(void) {
+    if (P_get_acq(&g_log_file.fd) < 0) return;
+    P_mutex_lock(&g_log_file.mutex);
+    uint64_t now = P_tick_ms();
+    if (g_log_file.buf_len && now - g_log_file.last_flush >= LOG_FILE_FLUSH_MS)
+        log_file_flush_with(NULL, 0);
+    if ((g_log_file.sync & LOG_SYNC_INTERVAL) && now - g_log_file.last_sync >= g_log_file.sync_ms)
+        log_file_sync();
+    P_mutex_unlock(&g_log_file.mutex);
 }
 
-void log_slot(log_level_e level, const char *tag, const char *fmt, va_list params, log_cb cb_log, bool pre_tag) {
+static void log_file_close(void) {
+    if (g_log_file.fd < 0) return;
+    P_mutex_lock(&g_log_file.mutex);
+    log_file_flush_with(NULL, 0);
+    log_file_sync();
+    log_fd_close(g_log_file.fd);
+    g_log_file.fd = -1;
+    g_log_file.binary = false;
+    P_mutex_unlock(&g_log_file.mutex);
+}
 
-    if (cb_log == (log_cb)-2) {
-        if (!g_log_sys) { g_log_sys = true; log_init(); }
-        #if P_WIN || defined(__ANDROID__)
-            pre_tag = false;
-        #else
-            pre_tag = true;
-        #endif
+static void log_file_exit(void) {
+    log_file_flush(g_log_file.sync != LOG_SYNC_NONE);
+}
+
+//-----------------------------------------------------------------------------
+// 日志定时线程：首次需要时启动，每 LOG_TICK_MS 处理依赖时间（而非下一行日志）触发的工作，随进程退出
+
+#define LOG_TICK_MS             100
+
+static volatile int             g_log_tick;         // 定时线程已启动
+
+static void log_limit_tick(void);
+#if !P_WIN
+static void log_stdout_flush(void);
+#else
+#define log_stdout_flush()      ((void)0)
+#endif
+
+static int32_t log_tick_proc(void* ctx) {
+    (void)ctx;
+    for (;;) {
+        P_usleep(LOG_TICK_MS * 1000);
+        log_file_tick();
+        log_limit_tick();
+        log_stdout_flush();
     }
+    return 0;
+}
 
-    static TLS int          g_logging = -1;         // -1: 默认模式，0: 开启缓存模式（缓存内容为空），>0: 缓存模式且已写入内容
-    static TLS char         g_line[LOG_HDR_RESERVE + 256 + LOG_LINE_MAX];
-    char* const             buf = g_line + LOG_HDR_RESERVE + 256;     // 日志输出起始位置
+static void log_tick_start(void) {
+    int z = 0;
+    if (P_get(&g_log_tick) || !P_test_and_set(&g_log_tick, &z, 1)) return;
+    thd_t thread;
+    if (P_thread(&thread, log_tick_proc, NULL, P_THD_BACKGROUND, 0) != E_NONE) P_set(&g_log_tick, 0);
+}
 
-    // 如果 tag 为空，表示输出日志到缓存
-    if (!tag) {
+// 初始化文件输出的锁（首次需要时），log_rotate/log_sync 在打开文件之前也可能调用
+static void log_file_init(void) {
+    static volatile int s_init = 0;
+    if (P_get_acq(&s_init)) return;
+    static volatile int s_lock = 0;
+    P_spin_lock(&s_lock);
+    if (!s_init) {
+        P_mutex_init(&g_log_file.mutex);
+        atexit(log_file_exit);
+        P_set_rel(&s_init, 1);
+    }
+    P_spin_unlock(&s_lock);
+}
 
-        // 开启缓存模式，并 rewind 到开头
-        if (!fmt) {
-            g_logging = 0;
-            return;
-        }
-        if (g_logging >= LOG_LINE_MAX - 1) { // 缓存已满，忽略后续内容
-            fprintf(stderr, "W: log buffer full, ignore log content\n");
-            return;
-        }
-        if (g_logging < 0) g_logging = 0;
-        if (!*fmt) return;
-        if (*fmt == '%' && fmt[1] == ' ') {
-            char* b = buf + g_logging;
-            strncpy(b, fmt + 2, LOG_LINE_MAX - 1 - g_logging); 
-            buf[LOG_LINE_MAX - 1] = '\0';
-            g_logging += (int)strlen(b);
-        }
-        else g_logging += vsnprintf(buf + g_logging, LOG_LINE_MAX - g_logging, fmt, params);
-        return;
+static void log_file_open(cstr_t filename, uint32_t sz_max, bool binary) {
+
+    if (g_log_file.fd >= 0) {
+        log_file_close();
+        free(g_log_file.path);
+        g_log_file.path = NULL;
     }
 
-    // 如果之前开启了缓存模式，且缓存内容为空，则关闭缓存模式，直接返回
-    if (g_logging == 0) { g_logging = -1;
+    if (!filename) {
+        if (g_log_sys) { g_log_sys = false;
+            log_cleanup();
+        }
         return;
     }
 
-    int tag_len = (int)strlen(tag);
-    if (tag_len > 255 + LOG_LINE_MAX - 1)           // 限制 tag 长度，防止溢出
-        tag_len = 255 + LOG_LINE_MAX - 1;
-    char* out;                                      // 输出起始位置
+    log_file_init();
+    if (!g_log_file.buf && !(g_log_file.buf = (char*)malloc(LOG_FILE_BUF))) return;
+    if (!(g_log_file.path = strdup(filename))) return;
 
-    int n = 0;
-    if (g_logging > 0) {                            // 对于缓存模式的最终输出
-        n = g_logging; g_logging = -1;              // 关闭缓存模式
+    int fd = log_fd_open(filename);
+    if (fd < 0) {
+        // fprintf(stderr, "Error opening log file '%s'\n", filename);
+        free(g_log_file.path);
+        g_log_file.path = NULL;
+        return;
     }
 
-    #ifdef LOG_INSTRUMENT
-    {
-        // 复制 tag
-        int m = (tag_len < 256) ? tag_len : 255;
-        out = buf - m - 1;
-        memcpy(out, tag, m);
-        out[m] = 0;
+    stat_t st;
+    g_log_file.size = (P_stat(filename, &st) == E_NONE) ? (uint64_t)st.st_size : 0;
+    g_log_file.sz_max = sz_max;
+    g_log_file.period = log_file_period();
+    g_log_file.buf_len = 0;
+    g_log_file.last_flush = g_log_file.last_sync = P_tick_ms();
+    g_log_file.dirty = false;
+    g_log_file.binary = binary;
+    if (binary) log_bin_session();
+    P_set_rel(&g_log_file.fd, fd);
+    log_tick_start();
+}
 
-        // 格式化文本
-        if (n < LOG_LINE_MAX) {
-            if (*fmt == '%' && fmt[1] == ' ')
-                n += snprintf(buf+n, LOG_LINE_MAX-n, "%s", fmt + 2);
-            else n += vsnprintf(buf+n, LOG_LINE_MAX-n, fmt, params);
-        }
-        if (n >= LOG_LINE_MAX) buf[n = LOG_LINE_MAX - 1] = 0;
+void log_output(cstr_t filename, uint32_t sz_max) {
+    log_file_open(filename, sz_max, false);
+}
 
-        inst_send_buf((uint8_t)level, out - INST_HDR_SIZE, m, n);
+void log_rotate(uint32_t interval_s, uint8_t keep) {
+    log_file_init();
+    P_mutex_lock(&g_log_file.mutex);
+    g_log_file.rotate_s = interval_s;
+    g_log_file.keep = keep;
+    g_log_file.period = log_file_period();
+    P_mutex_unlock(&g_log_file.mutex);
+}
 
-        if (pre_tag) {
-            if (tag_len >= 256) { int shift = tag_len - 255;
-                int max_n = LOG_LINE_MAX - 1 - shift;       // 移动后的最大 text 长度 (-1 给 \0)
-                if (max_n < 0) max_n = 0;
-                if (n > max_n) buf[n = max_n] = 0;          // 截断 text
-                memmove(buf + shift, buf, n + 1);           // 后移 text (+1 含 \0)
-                memcpy(buf - 1, tag + 255, shift);          // 填入 tag 剩余部分 (从 out[255] 开始)
-            }
-            out[tag_len] = ' ';
-        } else out = buf;
-    }
-    #else
-    {
-        char* text = buf;                                   // text 起始位置
-        int text_max = LOG_LINE_MAX;                        // text 可用空间
+void log_sync(int policy, uint32_t interval_ms) {
+    log_file_init();
+    P_mutex_lock(&g_log_file.mutex);
+    g_log_file.sync = policy;
+    g_log_file.sync_ms = interval_ms;
+    P_mutex_unlock(&g_log_file.mutex);
+}
 
-        // 设置输出位置
-        if (pre_tag) {
-            int m = (tag_len < 256) ? tag_len : 255;
-            out = buf - m - 1;
-            memcpy(out, tag, m);
-            if (tag_len >= 256) { int shift = tag_len - 255;
-                text_max = LOG_LINE_MAX - 1 - shift;        // 移动后的最大 text 长度 (-1 给 \0)
-                if (text_max < 0) text_max = 0;
-                if (n > text_max) n = text_max;             // 截断缓存
-                if (n > 0) memmove(buf + shift, buf, n);
-                memcpy(buf - 1, tag + 255, shift);          // 填入 tag 剩余部分 (从 out[255] 开始)
-                text = buf + shift;                         // text 起始位置改变
-            }
-            out[tag_len] = ' ';
-        } else out = buf;
+//-----------------------------------------------------------------------------
+// 二进制日志：热路径只记录格式字典 ID、时间戳和原始参数字节，文本由 log_binary_decode 离线还原
+//
+// 记录格式（本机字节序，首字节为类型）：
+//   SESSION  0 | "SLB" | ver | little | sizeof(long) | sizeof(void*) | sizeof(size_t) | sizeof(intmax_t)
+//   DEF      1 | id:4 | tag_len:2 | fmt_len:2 | tag | fmt
+//   MSG      2 | level:1 | id:4 | ts_us:8 | len:2 | args
+//   TEXT     3 | level:1 | ts_us:8 | len:2 | text
+// 每个 SESSION（打开/轮转/追加到已有文件）之后格式字典重新编号
+
+#define LOG_BIN_VER             1
+#define LOG_BIN_DICT            4096                // 格式字典容量（2 的幂）
+#define LOG_BIN_PROBE           32                  // 最大探测长度，超出视为字典已满（以文本记录写入）
+#define LOG_BIN_MSG_HDR         16
+
+enum { LOG_BIN_SESSION = 0, LOG_BIN_DEF, LOG_BIN_MSG, LOG_BIN_TEXT };
 
-        // 格式化 fmt 到 text
-        if (n < text_max) {
-            if (*fmt == '%' && fmt[1] == ' ')
-                n += snprintf(text+n, text_max-n, "%s", fmt + 2);
-            else n += vsnprintf(text+n, text_max-n, fmt, params);
-        }
-        if (text_max > 0 && n >= text_max) text[n = text_max - 1] = 0;
-    }
-    #endif
+typedef struct {
+    const char* volatile        fmt;                // 非 NULL 表示已发布（release）
+    char*                       tag;
+    char*                       sig;                // 参数类型签名，NULL 表示包含不支持的转换（回退文本）
+    uint32_t                    id;
+    uint32_t                    gen;                // 最近一次输出 DEF 的文件会话代数
+} log_bin_fmt_t;
 
-    int total = (out == buf) ? n : tag_len + 1 + n;  // 总输出长度 todo 确保 total 可以 + 1，即补充一个 \n
+static log_bin_fmt_t            g_log_bin_dict[LOG_BIN_DICT];
+static uint32_t                 g_log_bin_ids;
 
-    // 对于标准输出
-    if (cb_log == (log_cb)-1) {
-        if (total > 0 && out[total - 1] == '\n') out[--total] = 0; // 移除末尾换行符
-        switch (level) {
-        case LOG_SLOT_FATAL: printf(P_PURPLE("%s\n"), out); break;
-        case LOG_SLOT_ERROR: printf(P_RED("%s\n"), out); break;
-        case LOG_SLOT_WARN:  printf(P_YELLOW("%s\n"), out); break;
-        case LOG_SLOT_VERBOSE: printf(P_GRAY("%s\n"), out); break;
-        case LOG_SLOT_DEBUG: printf(P_CYAN("%s\n"), out); break;
-        default: printf("%s\n", out); break;
-        }
+/**
+ * @brief 解析一个转换说明（p 指向 '%' 之后），输出参数类型签名
+ * @return 转换说明长度（不含 '%'），-1 表示不支持（%n、long double、宽字符、带精度的 %s 等）
+ * @note 签名字符：'*' 宽度/精度(int)，i(int) l(long) L(long long) z(size_t) j(intmax_t) t(ptrdiff_t)
+ *       d(double) s(字符串) p(指针)；%% 不产生签名
+ */
+static int log_fmt_spec(const char* p, char* sig, int* sig_n) {
+
+    const char* q = p;
+    while (*q && strchr("-+ #0'", *q)) ++q;
+    if (*q == '*') { sig[(*sig_n)++] = '*'; ++q; } else while (*q >= '0' && *q <= '9') ++q;
+    bool prec = *q == '.';
+    if (prec) { ++q;
+        if (*q == '*') { sig[(*sig_n)++] = '*'; ++q; } else while (*q >= '0' && *q <= '9') ++q;
     }
-    else if (cb_log == (log_cb)-2) {
-        log_write(level, tag, out, total);
+    char len = 0;
+    switch (*q) {
+        case 'h': ++q; if (*q == 'h') ++q; break;
+        case 'l': ++q; if (*q == 'l') { ++q; len = 'L'; } else len = 'l'; break;
+        case 'q': ++q; len = 'L'; break;
+        case 'z': case 'j': case 't': len = *q++; break;
+        case 'L': return -1;
     }
-    // 对于回调（包括系统日志）
-    else if (cb_log) {
-        cb_log(level, pre_tag ? NULL : tag, out, total);
+    switch (*q) {
+        case '%': break;
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+            sig[(*sig_n)++] = len ? len : 'i'; break;
+        case 'c': if (len) return -1; sig[(*sig_n)++] = 'i'; break;
+        case 's': if (len || prec) return -1; sig[(*sig_n)++] = 's'; break;   // %.Ns 的参数可不以 0 结尾，回退文本
+        case 'p': sig[(*sig_n)++] = 'p'; break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            sig[(*sig_n)++] = 'd'; break;
+        default: return -1;
     }
+    return (int)(q - p) + 1;
+}
 
-    if (g_log_fp) {
-
-#if 0
-        pthread_mutex_lock(&g_cache_mutex);
+// 生成整个格式串的参数签名，失败返回 NULL
+static char* log_fmt_sig(const char* fmt) {
+
+    int cap = 8, n = 0;
+    for (const char* p = fmt; *p; ++p) if (*p == '%') cap += 3;
+    char* sig = (char*)malloc(cap);
+    if (!sig) return NULL;
+    for (const char* p = fmt; *p; ) {
+        if (*p++ != '%') continue;
+        int m = log_fmt_spec(p, sig, &n);
+        if (m < 0 || n > 64) { free(sig); return NULL; }  // 参数过多也回退文本
+        p += m;
+    }
+    sig[n] = 0;
+    return sig;
+}
 
-        static bool log_append = false;
-        static char log_fn[256];
-        if (!log_append) {
-            for(int i=0;;) {
-                sprintf(log_fn, "%s/%s%d.txt", LOG_OUTPUT_PATH, get_log_name(), ++i);
-                if (access(log_fn, F_OK) < 0) break;
-            }
+// 查找格式字典项，insert 为 true 时在未找到处插入（需持有锁）
+static log_bin_fmt_t* log_bin_find(const char* fmt, const char* tag, bool insert) {
+
+    uint32_t h = (uint32_t)(((uintptr_t)fmt >> 3) * 2654435761u);
+    for (uint32_t i = 0; i < LOG_BIN_PROBE; ++i) {
+        log_bin_fmt_t* e = &g_log_bin_dict[(h + i) & (LOG_BIN_DICT - 1)];
+        const char* f = P_get_acq(&e->fmt);
+        if (!f) {
+            if (!insert || !(e->tag = strdup(tag))) return NULL;
+            e->sig = log_fmt_sig(fmt);
+            e->id = g_log_bin_ids++;
+            e->gen = 0;
+            P_set_rel(&e->fmt, fmt);
+            return e;
         }
+        if (f == fmt && !strcmp(e->tag, tag)) return e;
+    }
+    return NULL;                                    // 探测范围内已满
+}
 
-        FILE* fp = fopen(log_fn, log_append?"a":"w");
-        if (fp) {
+// 查找（或注册）格式字典项：按 fmt 指针哈希，tag 按内容比较（printf 调试模式的 tag 为 TLS 缓冲）
+// + 查找无锁，仅首次注册时加锁
+static log_bin_fmt_t* log_bin_lookup(const char* fmt, const char* tag) {
+    log_bin_fmt_t* e = log_bin_find(fmt, tag, false);
+    if (e) return e;
+    P_mutex_lock(&g_log_file.mutex);
+    e = log_bin_find(fmt, tag, true);
+    P_mutex_unlock(&g_log_file.mutex);
+    return e;
+}
 
-            if (g_cache_head) {
-                do {
-                    void** item = (void**)g_cache_head;
-                    fputs((char*)(item+1), fp);
-                    g_cache_head = *item;
-                    free(item);
-                }
-                while (g_cache_head);
-                g_cache_rear = NULL;
-                g_line_count = 0;
-            }
-            fprintf(fp, "%s\n", out);
-            fclose(fp);
+static inline char* log_bin_w(char* p, const void* v, size_t n) { memcpy(p, v, n); return p + n; }
 
-            log_append = true;
-        }
-        else {
+static inline uint64_t log_bin_ts(void) { P_clock c; P_time_now(&c); return (uint64_t)clock_us(c); }
+
+// 输出会话记录，并使格式字典在新会话中重新输出（需持有锁）
+static void log_bin_session(void) {
+    uint16_t one = 1;
+    char rec[10] = { LOG_BIN_SESSION, 'S', 'L', 'B', LOG_BIN_VER, (char)*(uint8_t*)&one,
+                     (char)sizeof(long), (char)sizeof(void*), (char)sizeof(size_t), (char)sizeof(intmax_t) };
+    log_file_put(rec, sizeof(rec));
+    ++g_log_file.gen;
+}
 
-            void** item = (void**)malloc(total + 2/* \n\0 */ + sizeof(void*)); *item = NULL;
-            sprintf((char*)(item+1), "%s\n", out);
-            if (g_cache_rear) *(void**)g_cache_rear = item;
-            else g_cache_head = item;
-            g_cache_rear = item;
+// 生成文本记录头，返回头长度
+static int log_bin_text(char* rec, log_level_e level, int len) {
+    uint64_t ts = log_bin_ts(); uint16_t n = (uint16_t)len;
+    char* p = rec;
+    *p++ = LOG_BIN_TEXT; *p++ = (char)level;
+    p = log_bin_w(p, &ts, 8);
+    p = log_bin_w(p, &n, 2);
+    return (int)(p - rec);
+}
 
-            if (++g_line_count > 1000) {
-                void* next = *(void**)g_cache_head;
-                free(g_cache_head);
-                g_cache_head = next;
+/**
+ * @brief 以二进制记录输出一条日志（不做格式化）
+ * @param rec 记录缓冲区（调用方提供，避免额外分配）
+ * @return false 表示格式串不支持二进制模式（此时 params 未被读取），需回退到文本输出
+ */
+static bool log_bin_write(log_level_e level, const char* tag, const char* fmt, va_list params, char* rec, int rec_max) {
+
+    log_bin_fmt_t* e = log_bin_lookup(fmt, tag);
+    if (!e || !e->sig) return false;
+
+    uint64_t ts = log_bin_ts();
+    char* p = rec + LOG_BIN_MSG_HDR, *end = rec + rec_max;
+    for (const char* s = e->sig; *s; ++s) {
+        switch (*s) {
+            case '*': case 'i': { int v = va_arg(params, int);             p = log_bin_w(p, &v, sizeof(v)); break; }
+            case 'l': { long v = va_arg(params, long);                      p = log_bin_w(p, &v, sizeof(v)); break; }
+            case 'L': { long long v = va_arg(params, long long);            p = log_bin_w(p, &v, sizeof(v)); break; }
+            case 'z': { size_t v = va_arg(params, size_t);                  p = log_bin_w(p, &v, sizeof(v)); break; }
+            case 'j': { intmax_t v = va_arg(params, intmax_t);              p = log_bin_w(p, &v, sizeof(v)); break; }
+            case 't': { ptrdiff_t v = va_arg(params, ptrdiff_t);            p = log_bin_w(p, &v, sizeof(v)); break; }
+            case 'd': { double v = va_arg(params, double);                  p = log_bin_w(p, &v, sizeof(v)); break; }
+            case 'p': { void* v = va_arg(params, void*);                    p = log_bin_w(p, &v, sizeof(v)); break; }
+            case 's': {
+                const char* v = va_arg(params, const char*);
+                if (!v) v = "(null)";
+                ptrdiff_t room = (end - p) - 2 - (ptrdiff_t)(strlen(s + 1) * sizeof(intmax_t));   // 为后续参数预留空间
+                size_t m = strlen(v); if (room < 0) room = 0; if (m > (size_t)room) m = (size_t)room;
+                uint16_t l = (uint16_t)m;
+                p = log_bin_w(p, &l, 2);
+                p = log_bin_w(p, v, m);
+                break;
             }
         }
+    }
 
-        pthread_mutex_unlock(&g_cache_mutex);
-#endif
+    uint16_t len = (uint16_t)(p - rec - LOG_BIN_MSG_HDR);
+    char* h = rec;
+    *h++ = LOG_BIN_MSG; *h++ = (char)level;
+    h = log_bin_w(h, &e->id, 4);
+    h = log_bin_w(h, &ts, 8);
+    log_bin_w(h, &len, 2);
+
+    P_mutex_lock(&g_log_file.mutex);
+    if (g_log_file.binary && log_file_room((int)(p - rec) + 9 + (int)strlen(tag) + (int)strlen(fmt))) {
+        if (e->gen != g_log_file.gen) { e->gen = g_log_file.gen;
+            uint16_t tl = (uint16_t)strlen(e->tag), fl = (uint16_t)strlen(fmt);
+            char def[9], *d = def;
+            *d++ = LOG_BIN_DEF;
+            d = log_bin_w(d, &e->id, 4);
+            d = log_bin_w(d, &tl, 2);
+            log_bin_w(d, &fl, 2);
+            log_file_put(def, sizeof(def));
+            log_file_put(e->tag, tl);
+            log_file_put(fmt, fl);
+        }
+        log_file_put(rec, (int)(p - rec));
+        log_file_policy(level);
     }
+    P_mutex_unlock(&g_log_file.mutex);
+    return true;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-#ifdef LOG_INSTRUMENT
-
-void
-instrument_port(uint16_t port) {
-    
-    assert(g_inst_sock == P_INVALID_SOCKET);        // 必须在首次使用前调用
-    g_inst_port = port;
+void log_binary(cstr_t filename, uint32_t sz_max) {
+    log_file_open(filename, sz_max, true);
 }
 
-void
-instrument_ctrl(uint16_t chn) {
-    
-    assert(g_inst_sock == P_INVALID_SOCKET);        // 必须在首次使用前调用
-    g_inst_ctrl = (uint8_t)chn;
-}
+//-----------------------------------------------------------------------------
+// 二进制日志解码
 
-void
-instrument_loggable(log_cb cb) {
-    g_inst_log_cb = cb;
+typedef struct {
+    uint32_t                    id;
+    char*                       tag;
+    char*                       fmt;
+    char*                       sig;
+} log_dec_fmt_t;
+
+static const char* log_dec_get(void* v, size_t n, const char* arg, const char* end) {
+    if (arg + n <= end) memcpy(v, arg, n);
+    return arg + n;
 }
 
-void
-instrument_local(int keep_chn, ...) {
+// 按格式串逐个转换说明渲染参数，返回文本长度
+static int log_bin_render(char* out, int out_max, const char* fmt, const char* arg, const char* arg_end) {
+
+    int n = 0;
+    char spec[64], sig[8];
+#define LOG_DEC_GET(T, v) T v = 0; arg = log_dec_get(&v, sizeof(T), arg, arg_end)
+#define LOG_DEC_PUT(v) do { \
+        if (stars == 0)      n += snprintf(out + n, n < out_max ? out_max - n : 0, spec, v); \
+        else if (stars == 1) n += snprintf(out + n, n < out_max ? out_max - n : 0, spec, st[0], v); \
+        else                 n += snprintf(out + n, n < out_max ? out_max - n : 0, spec, st[0], st[1], v); \
+    } while (0)
+
+    for (const char* p = fmt; *p; ) {
+        if (*p != '%') { if (n < out_max - 1) out[n] = *p; ++n; ++p; continue; }
+        int sn = 0, m = log_fmt_spec(p + 1, sig, &sn);
+        if (m < 0 || m + 2 > (int)sizeof(spec)) break;
+        memcpy(spec, p, m + 1); spec[m + 1] = 0;
+        p += m + 1;
+        if (!sn) { if (n < out_max - 1) out[n] = '%'; ++n; continue; }
+
+        int st[2] = {0, 0}, stars = 0;
+        while (stars < sn - 1) { LOG_DEC_GET(int, v); st[stars++] = v; }
+        switch (sig[sn - 1]) {
+            case 'i': { LOG_DEC_GET(int, v);             LOG_DEC_PUT(v); break; }
+            case 'l': { LOG_DEC_GET(long, v);           LOG_DEC_PUT(v); break; }
+            case 'L': { LOG_DEC_GET(long long, v); LOG_DEC_PUT(v); break; }
+            case 'z': { LOG_DEC_GET(size_t, v);       LOG_DEC_PUT(v); break; }
+            case 'j': { LOG_DEC_GET(intmax_t, v);   LOG_DEC_PUT(v); break; }
+            case 't': { LOG_DEC_GET(ptrdiff_t, v); LOG_DEC_PUT(v); break; }
+            case 'd': { LOG_DEC_GET(double, v);       LOG_DEC_PUT(v); break; }
+            case 'p': { LOG_DEC_GET(void*, v);         LOG_DEC_PUT(v); break; }
+            case 's': {
+                LOG_DEC_GET(uint16_t, l);
+                if (arg + l > arg_end) l = (uint16_t)(arg_end > arg ? arg_end - arg : 0);
+                char* v = (char*)malloc(l + 1);
+                if (!v) break;
+                memcpy(v, arg, l); v[l] = 0; arg += l;
+                LOG_DEC_PUT(v);
+                free(v);
+                break;
+            }
+        }
+    }
+#undef LOG_DEC_GET
+#undef LOG_DEC_PUT
+    if (n >= out_max) n = out_max - 1;
+    out[n] = 0;
+    return n;
+}
+
+// 输出一条解码后的日志（时间戳作为正文前缀）
+static void log_bin_out(log_level_e level, const char* tag, uint64_t ts, char* line, int len, int line_max, log_cb cb) {
+
+    time_t sec = (time_t)(ts / 1000000); struct tm tm;
+#if P_WIN
+    localtime_s(&tm, &sec);
+#else
+    localtime_r(&sec, &tm);
+#endif
+    char stamp[40];
+    int sl = (int)strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    sl += snprintf(stamp + sl, sizeof(stamp) - sl, ".%06u ", (unsigned)(ts % 1000000));
+    if (len + sl >= line_max) len = line_max - sl - 1;
+    memmove(line + sl, line, len); memcpy(line, stamp, sl);
+    len += sl; line[len] = 0;
+
+    if (cb && cb != (log_cb)-1) cb(level, tag, line, len);
+    else if (*tag) printf("%s %s\n", tag, line);
+    else printf("%s\n", line);
+}
+
+ret_t log_binary_decode(cstr_t filename, log_cb cb) {
+
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) return E_INVALID;
+
+    ret_t ret = E_NONE;
+    log_dec_fmt_t* dict = NULL; uint32_t dict_n = 0, dict_cap = 0;
+    char* line = (char*)malloc(LOG_LINE_MAX + 64);
+    char* rec = (char*)malloc(UINT16_MAX + 64);
+    if (!line || !rec) { ret = E_OUT_OF_MEMORY; goto end; }
+
+    int type;
+    while ((type = fgetc(fp)) != EOF) {
+        if (type == LOG_BIN_SESSION) {
+            uint8_t h[9], sz_ref[5] = { (uint8_t)sizeof(long), (uint8_t)sizeof(void*), (uint8_t)sizeof(size_t), (uint8_t)sizeof(intmax_t) };
+            uint16_t one = 1;
+            if (fread(h, 1, 9, fp) != 9 || memcmp(h, "SLB", 3) || h[3] != LOG_BIN_VER) { ret = E_INVALID; break; }
+            if (h[4] != *(uint8_t*)&one || memcmp(h + 5, sz_ref, 4)) { ret = E_NO_SUPPORT; break; }   // 需在相同架构下解码
+            for (uint32_t i = 0; i < dict_n; ++i) { free(dict[i].tag); free(dict[i].fmt); free(dict[i].sig); }
+            dict_n = 0;
+        }
+        else if (type == LOG_BIN_DEF) {
+            uint32_t id; uint16_t tl, fl;
+            if (fread(&id, 4, 1, fp) != 1 || fread(&tl, 2, 1, fp) != 1 || fread(&fl, 2, 1, fp) != 1) { ret = E_INVALID; break; }
+            if (dict_n == dict_cap) {
+                dict_cap = dict_cap ? dict_cap * 2 : 256;
+                log_dec_fmt_t* d = (log_dec_fmt_t*)realloc(dict, dict_cap * sizeof(*dict));
+                if (!d) { ret = E_OUT_OF_MEMORY; break; }
+                dict = d;
+            }
+            log_dec_fmt_t* e = &dict[dict_n];
+            e->id = id; e->tag = (char*)malloc(tl + 1); e->fmt = (char*)malloc(fl + 1);
+            if (!e->tag || !e->fmt) { free(e->tag); free(e->fmt); ret = E_OUT_OF_MEMORY; break; }
+            if (fread(e->tag, 1, tl, fp) != tl || fread(e->fmt, 1, fl, fp) != fl) { free(e->tag); free(e->fmt); ret = E_INVALID; break; }
+            e->tag[tl] = 0; e->fmt[fl] = 0;
+            e->sig = log_fmt_sig(e->fmt);
+            ++dict_n;
+        }
+        else if (type == LOG_BIN_MSG || type == LOG_BIN_TEXT) {
+            uint8_t level; uint32_t id = 0; uint64_t ts; uint16_t len;
+            if (fread(&level, 1, 1, fp) != 1 || (type == LOG_BIN_MSG && fread(&id, 4, 1, fp) != 1) ||
+                fread(&ts, 8, 1, fp) != 1 || fread(&len, 2, 1, fp) != 1 || fread(rec, 1, len, fp) != len) { ret = E_INVALID; break; }
+            if (type == LOG_BIN_TEXT) {
+                int n = len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1;
+                memcpy(line, rec, n);
+                while (n > 0 && line[n - 1] == '\n') --n;
+                log_bin_out((log_level_e)level, "", ts, line, n, LOG_LINE_MAX + 64, cb);
+                continue;
+            }
+            log_dec_fmt_t* e = NULL;
+            for (uint32_t i = dict_n; i-- > 0; ) if (dict[i].id == id) { e = &dict[i]; break; }
+            if (!e) { ret = E_INVALID; break; }
+            int n = log_bin_render(line, LOG_LINE_MAX, e->fmt, rec, rec + len);
+            while (n > 0 && line[n - 1] == '\n') --n;
+            log_bin_out((log_level_e)level, e->tag, ts, line, n, LOG_LINE_MAX + 64, cb);
+        }
+        else { ret = E_INVALID; break; }
+    }
+
+end:
+    for (uint32_t i = 0; i < dict_n; ++i) { free(dict[i].tag); free(dict[i].fmt); free(dict[i].sig); }
+    free(dict); free(line); free(rec);
+    fclose(fp);
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+// 飞行记录器：固定大小的 mmap 环形文件，进程崩溃后由内核保留页面内容，可用 log_recorder_dump 还原
+//
+// 文件布局：header(LOG_REC_HDR) + nchunks * chunk
+//   每个线程独占一个 chunk 顺序写入，写满后原子领取下一个 chunk（覆盖最旧的）
+//   写入期间 gen 置 LOG_REC_BUSY 位（CAS），领取方跳过正在写入的 chunk，避免回收后被原所有者写坏
+//   chunk = gen:8 + tid:4 + pad:4 + 记录...，记录 = len:4 + seq:8 + ts_us:8 + level:1 + text
+//   len 最后写入（release），其后紧跟的 len=0 作为结束标记；全局 seq 用于跨线程排序
+
+#if !P_WIN
+#include <sys/mman.h>
+#endif
+
+#define LOG_REC_MAGIC           0x52464C53u                         // "SLFR"
+#define LOG_REC_VER             1
+#define LOG_REC_HDR             64
+#define LOG_REC_CHUNK           (16 * 1024)
+#define LOG_REC_CHUNK_HDR       16
+#define LOG_REC_REC_HDR         21
+#define LOG_REC_BUSY            (1ull << 63)                        // gen 最高位：所有者正在写入
+
+typedef struct {
+    uint32_t                    magic;
+    uint32_t                    ver;
+    uint32_t                    chunk;
+    uint32_t                    nchunks;
+    volatile uint64_t           next_chunk;                         // 已领取的 chunk 总数
+    volatile uint64_t           seq;                                // 全局记录序号
+} log_rec_hdr_t;
+
+uint8_t                         log_recorder_level;                 // 0 表示未开启
+
+static uint64_t log_tid(void);
+
+// 切换/关闭时旧映射不解除（其他线程可能仍在写入），每个映射地址唯一，可直接用于判断线程缓存的 chunk 是否失效
+static struct {
+    log_rec_hdr_t* volatile     hdr;
+    size_t                      size;
+} g_log_rec;
+
+static TLS struct {
+    log_rec_hdr_t*              hdr;                                // chunk 所属的映射
+    char*                       chunk;
+    uint64_t                    gen;                                // 领取时的代数，不一致说明 chunk 已被其他线程回收
+    uint32_t                    off;
+}                               g_log_rec_cur;
+
+// 领取下一个 chunk
+static bool log_rec_claim(log_rec_hdr_t* h) {
+    uint64_t n; char* c;
+    for (;;) {                                                      // 先作废旧内容（跳过正在写入的），再写结束标记和新代数
+        n = P_get_and_inc(&h->next_chunk, 1);
+        c = (char*)h + LOG_REC_HDR + (size_t)(n % h->nchunks) * h->chunk;
+        uint64_t old = P_get_acq((uint64_t*)c);
+        if (!(old & LOG_REC_BUSY) && P_test_and_set_ord((uint64_t*)c, &old, (uint64_t)0)) break;
+    }
+    uint32_t zero = 0, tid = (uint32_t)log_tid();
+    memcpy(c + LOG_REC_CHUNK_HDR, &zero, 4);
+    memcpy(c + 8, &tid, 4);
+    P_set_rel((uint64_t*)c, n + 1);
+    g_log_rec_cur.chunk = c;
+    g_log_rec_cur.gen = n + 1;
+    g_log_rec_cur.off = LOG_REC_CHUNK_HDR;
+    g_log_rec_cur.hdr = h;
+    return true;
+}
+
+// 写入一条记录（无系统调用）
+static void log_rec_write(log_level_e level, const char* text, int len) {
+
+    log_rec_hdr_t* h = P_get_acq(&g_log_rec.hdr);
+    if (!h) return;
+
+    uint32_t cap = h->chunk - LOG_REC_CHUNK_HDR - LOG_REC_REC_HDR - 4;
+    if ((uint32_t)len > cap) len = (int)cap;
+    uint32_t need = LOG_REC_REC_HDR + (uint32_t)len;
+
+    // 标记写入中：gen 不一致说明 chunk 已被其他线程回收，重新领取
+    for (;;) {
+        if (g_log_rec_cur.hdr != h || !g_log_rec_cur.chunk || g_log_rec_cur.off + need + 4 > h->chunk)
+            log_rec_claim(h);
+        uint64_t gen = g_log_rec_cur.gen;
+        if (P_test_and_set_ord((uint64_t*)g_log_rec_cur.chunk, &gen, gen | LOG_REC_BUSY)) break;
+        g_log_rec_cur.chunk = NULL;
+    }
+
+    char* p = g_log_rec_cur.chunk + g_log_rec_cur.off;
+    uint64_t seq = P_get_and_inc(&h->seq, 1), ts = log_bin_ts();
+    uint32_t zero = 0;
+    memcpy(p + 4, &seq, 8);
+    memcpy(p + 12, &ts, 8);
+    p[20] = (char)level;
+    memcpy(p + LOG_REC_REC_HDR, text, len);
+    memcpy(p + need, &zero, 4);                                     // 结束标记
+    P_set_rel((uint32_t*)p, need);                                  // 最后发布长度
+    P_set_rel((uint64_t*)g_log_rec_cur.chunk, g_log_rec_cur.gen);   // 清除写入标记
+    g_log_rec_cur.off += need;
+}
+
+static bool log_site_rec_fn(log_site_t* site, void* ctx);
+static bool log_sites_lock(void);
+static void log_sites_unlock(bool locked);
+static int log_sites_each(bool (*fn)(log_site_t* site, void* ctx), void* ctx);
+
+ret_t log_recorder(cstr_t filename, uint32_t size, log_level_e level) {
+
+#if P_WIN
+    (void)filename; (void)size; (void)level;
+    return E_NO_SUPPORT;
+#else
+    // 关闭当前记录器：不解除映射（并发的写入者可能仍持有旧映射），只刷出并保留
+    P_set(&log_recorder_level, 0);
+    log_rec_hdr_t* old = P_get_and_set(&g_log_rec.hdr, NULL);
+    if (old) msync(old, g_log_rec.size, MS_ASYNC);
+    if (!filename) {
+        bool locked = log_sites_lock();
+        log_sites_each(log_site_rec_fn, NULL);
+        log_sites_unlock(locked);
+        return E_NONE;
+    }
+    if ((unsigned)level > LOG_SLOT_VERBOSE) return E_INVALID;
+
+    uint32_t nchunks = size > LOG_REC_HDR ? (size - LOG_REC_HDR) / LOG_REC_CHUNK : 0;
+    if (nchunks < 4) return E_INVALID;
+    size_t total = LOG_REC_HDR + (size_t)nchunks * LOG_REC_CHUNK;
+
+    // 先删除再创建：旧映射可能仍指向同名文件，截断它会使仍在写入的线程收到 SIGBUS
+    unlink(filename);
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return E_EXTERNAL(errno);
+    if (ftruncate(fd, (off_t)total) != 0) { int e = errno; close(fd); return E_EXTERNAL(e); }
+    void* m = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return E_EXTERNAL(errno);
+
+    log_rec_hdr_t* h = (log_rec_hdr_t*)m;
+    h->magic = LOG_REC_MAGIC; h->ver = LOG_REC_VER;
+    h->chunk = LOG_REC_CHUNK; h->nchunks = nchunks;
+    h->next_chunk = 0; h->seq = 0;
+
+    g_log_rec.size = total;
+    P_set_rel(&g_log_rec.hdr, h);
+    P_set(&log_recorder_level, (uint8_t)level);
+
+    // 让超出 LOG_LEVEL 的调用点重新启用（写入记录器）
+    bool locked = log_sites_lock();
+    log_sites_each(log_site_rec_fn, NULL);
+    log_sites_unlock(locked);
+    return E_NONE;
+#endif
+}
+
+typedef struct { uint64_t seq; uint64_t ts; uint32_t off; uint32_t len; uint8_t level; } log_rec_ent_t;
+
+static int log_rec_cmp(const void* a, const void* b) {
+    uint64_t x = ((const log_rec_ent_t*)a)->seq, y = ((const log_rec_ent_t*)b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+ret_t log_recorder_dump(cstr_t filename, log_cb cb) {
+
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) return E_INVALID;
+    fseek(fp, 0, SEEK_END);
+    long fsz = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char* data = fsz > LOG_REC_HDR ? (char*)malloc((size_t)fsz) : NULL;
+    if (!data || fread(data, 1, (size_t)fsz, fp) != (size_t)fsz) { free(data); fclose(fp); return fsz > LOG_REC_HDR ? E_OUT_OF_MEMORY : E_INVALID; }
+    fclose(fp);
+
+    ret_t ret = E_NONE;
+    log_rec_hdr_t h; memcpy(&h, data, sizeof(h));
+    log_rec_ent_t* ents = NULL; size_t n = 0, cap = 0;
+    char* line = NULL;
+    if (h.magic != LOG_REC_MAGIC || h.ver != LOG_REC_VER || h.chunk < LOG_REC_CHUNK_HDR + LOG_REC_REC_HDR ||
+        LOG_REC_HDR + (uint64_t)h.nchunks * h.chunk > (uint64_t)fsz) { ret = E_INVALID; goto end; }
+
+    // 收集所有 chunk 中的有效记录，按全局 seq 排序
+    for (uint32_t i = 0; i < h.nchunks; ++i) {
+        char* c = data + LOG_REC_HDR + (size_t)i * h.chunk;
+        uint64_t gen; memcpy(&gen, c, 8);
+        if (!(gen & ~LOG_REC_BUSY)) continue;
+        for (uint32_t off = LOG_REC_CHUNK_HDR; off + 4 <= h.chunk; ) {
+            uint32_t len; memcpy(&len, c + off, 4);
+            if (len < LOG_REC_REC_HDR || off + len > h.chunk) break;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 1024;
+                log_rec_ent_t* e = (log_rec_ent_t*)realloc(ents, cap * sizeof(*ents));
+                if (!e) { ret = E_OUT_OF_MEMORY; goto end; }
+                ents = e;
+            }
+            log_rec_ent_t* e = &ents[n++];
+            memcpy(&e->seq, c + off + 4, 8);
+            memcpy(&e->ts, c + off + 12, 8);
+            e->level = (uint8_t)c[off + 20];
+            e->off = (uint32_t)(c - data) + off + LOG_REC_REC_HDR;
+            e->len = len - LOG_REC_REC_HDR;
+            off += len;
+        }
+    }
+    qsort(ents, n, sizeof(*ents), log_rec_cmp);
+
+    if (!(line = (char*)malloc(h.chunk + 64))) { ret = E_OUT_OF_MEMORY; goto end; }
+    for (size_t i = 0; i < n; ++i) {
+        int len = (int)ents[i].len;
+        memcpy(line, data + ents[i].off, len);
+        while (len > 0 && line[len - 1] == '\n') --len;
+        log_bin_out((log_level_e)ents[i].level, "", ents[i].ts, line, len, (int)h.chunk + 64, cb);
+    }
+
+end:
+    free(line); free(ents); free(data);
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+// 标准输出：绕过 stdio 直接 writev(颜色 + 文本 + 复位/换行)
+// + 合并写：持有写权的线程在写出期间，其他线程只把日志追加到暂存区，由其在下一次 writev 中一并写出
+
+#if !P_WIN
+#define LOG_STDOUT_BUF          (64 * 1024)
+
+#if P_LINUX
+#include <stdio_ext.h>
+#define log_stdio_pending()     (__fpending(stdout) > 0)
+#else
+#define log_stdio_pending()     true                // 无法查询 stdio 缓冲，每次写出前冲刷
+#endif
+
+static struct {
+    P_mutex_t                   mutex;
+    bool                        writing;            // 已有线程在执行写出
+    int                         tty;                // -1: 未检测; 0: 非终端（不输出颜色）; 1: 终端
+    int                         len;
+    char*                       stage;              // 等待写出的日志
+    char*                       spare;              // 写出中的缓冲区（与 stage 交换）
+}                               g_log_stdout = { .tty = -1 };
+
+static const char* log_color(log_level_e level) {
+    switch (level) {
+    case LOG_SLOT_FATAL:   return P_PURPLE_BEGIN;
+    case LOG_SLOT_ERROR:   return P_RED_BEGIN;
+    case LOG_SLOT_WARN:    return P_YELLOW_BEGIN;
+    case LOG_SLOT_VERBOSE: return P_GRAY_BEGIN;
+    case LOG_SLOT_DEBUG:   return P_CYAN_BEGIN;
+    default:               return "";
+    }
+}
+
+// 写出暂存区（需持有锁且 writing 为 true），own 非 NULL 时调用方自身的一行随暂存区在同一次 writev 中写出
+// 只在实际写出前（而非每行）检查 stdio 是否有待写内容，有则先冲刷，使之前的 printf 排在本批日志之前
+static void log_stdout_drain(struct iovec* own) {
+    while (g_log_stdout.len || own) {
+        char* buf = g_log_stdout.stage; int n = g_log_stdout.len;
+        g_log_stdout.stage = g_log_stdout.spare;
+        g_log_stdout.spare = buf;
+        g_log_stdout.len = 0;
+        P_mutex_unlock(&g_log_stdout.mutex);
+        if (log_stdio_pending()) fflush(stdout);
+        struct iovec iov[4] = { { .iov_base = buf, .iov_len = (size_t)n } };
+        int cnt = 1;
+        if (own) { memcpy(iov + 1, own, 3 * sizeof(struct iovec)); cnt = 4; own = NULL; }
+        log_fd_writev_all(STDOUT_FILENO, iov, cnt);
+        P_mutex_lock(&g_log_stdout.mutex);
+    }
+}
+
+static void log_stdout_flush(void) {
+    if (P_get_acq(&g_log_stdout.tty) < 0) return;
+    P_mutex_lock(&g_log_stdout.mutex);
+    if (!g_log_stdout.writing && g_log_stdout.len) {
+        g_log_stdout.writing = true;
+        log_stdout_drain(NULL);
+        g_log_stdout.writing = false;
+    }
+    P_mutex_unlock(&g_log_stdout.mutex);
+}
+
+static void log_stdout_init(void) {
+    P_mutex_init(&g_log_stdout.mutex);
+    g_log_stdout.stage = (char*)malloc(LOG_STDOUT_BUF);
+    g_log_stdout.spare = (char*)malloc(LOG_STDOUT_BUF);
+    if (!g_log_stdout.stage || !g_log_stdout.spare) {
+        free(g_log_stdout.stage); free(g_log_stdout.spare);
+        g_log_stdout.stage = g_log_stdout.spare = NULL;
+    }
+    int tty = P_isatty(stdout) ? 1 : 0;
+    P_set_rel(&g_log_stdout.tty, tty);
+    atexit(log_stdout_flush);
+    if (!tty && g_log_stdout.stage) log_tick_start();  // 暂存的日志最迟一个定时周期后写出
+}
+
+/**
+ * @brief 输出一行到标准输出
+ * @note 终端：立即写出（期间其他线程追加的日志合并到下一次写出）
+ *       非终端（文件/管道）：暂存区过半、ERROR/FATAL、定时线程（LOG_TICK_MS）、log_flush() 或退出时写出
+ *       直接写 fd 1 不经过 stdio：仅在写出时冲刷 stdio 的待写内容，暂存期间应用的 printf 可能排到已暂存的日志之前，
+ *       需要严格先后顺序时由应用在 printf 之前调用 log_flush()
+ */
+static void log_stdout(log_level_e level, const char* out, int total) {
+
+    if (P_get_acq(&g_log_stdout.tty) < 0) {
+        static volatile int s_lock = 0;
+        P_spin_lock(&s_lock);
+        if (g_log_stdout.tty < 0) log_stdout_init();
+        P_spin_unlock(&s_lock);
+    }
+
+    const char* col = g_log_stdout.tty ? log_color(level) : "";
+    const char* end = *col ? P_COLOR_RESET "\n" : "\n";
+    int col_len = (int)strlen(col), end_len = (int)strlen(end);
+    int len = col_len + total + end_len;
+    struct iovec iov[3] = { { .iov_base = (void*)col, .iov_len = (size_t)col_len }, { .iov_base = (void*)out, .iov_len = (size_t)total },
+                            { .iov_base = (void*)end, .iov_len = (size_t)end_len } };
+    struct iovec* own = NULL;
+
+    P_mutex_lock(&g_log_stdout.mutex);
+    if (g_log_stdout.stage && g_log_stdout.len + len <= LOG_STDOUT_BUF) {
+        char* p = g_log_stdout.stage + g_log_stdout.len;
+        memcpy(p, col, col_len); memcpy(p + col_len, out, total); memcpy(p + col_len + total, end, end_len);
+        g_log_stdout.len += len;
+    }
+    else if (g_log_stdout.writing) {                                // 暂存区已满且有线程在写出，自行写出
+        P_mutex_unlock(&g_log_stdout.mutex);
+        log_fd_writev_all(STDOUT_FILENO, iov, 3);
+        return;
+    }
+    else own = iov;
+
+    // 已有线程在写出（会顺带写出本行），或非终端且无需立即写出
+    if (g_log_stdout.writing || (!own && !g_log_stdout.tty && level > LOG_SLOT_ERROR && g_log_stdout.len < LOG_STDOUT_BUF / 2)) {
+        P_mutex_unlock(&g_log_stdout.mutex);
+        return;
+    }
+    g_log_stdout.writing = true;
+    log_stdout_drain(own);
+    g_log_stdout.writing = false;
+    P_mutex_unlock(&g_log_stdout.mutex);
+}
+#endif
+
+/**
+ * @brief 将已格式化的日志输出到目标（stdout、系统日志或回调）
+ * @param out 输出内容，需确保 out[total] 之后至少还有 1 字节可写（回调允许追加 \n）
+ */
+static void log_emit(log_level_e level, const char* tag, char* out, int total, log_cb cb_log, bool pre_tag) {
+
+    // 日志文件（与其他目标同时输出）
+    if (P_get_acq(&g_log_file.fd) >= 0) log_file_append(level, out, total);
+    if (P_get(&g_log_file.binary) && level != LOG_SLOT_FATAL) return;   // 二进制模式仅输出到文件
+
+    // 对于标准输出
+    if (cb_log == (log_cb)-1) {
+        if (total > 0 && out[total - 1] == '\n') out[--total] = 0; // 移除末尾换行符
+#if P_WIN
+        switch (level) {
+        case LOG_SLOT_FATAL: printf(P_PURPLE("%s\n"), out); break;
+        case LOG_SLOT_ERROR: printf(P_RED("%s\n"), out); break;
+        case LOG_SLOT_WARN:  printf(P_YELLOW("%s\n"), out); break;
+        case LOG_SLOT_VERBOSE: printf(P_GRAY("%s\n"), out); break;
+        case LOG_SLOT_DEBUG: printf(P_CYAN("%s\n"), out); break;
+        default: printf("%s\n", out); break;
+        }
+#else
+        log_stdout(level, out, total);
+#endif
+    }
+    else if (cb_log == (log_cb)-2) {
+        log_write(level, tag, out, total);
+    }
+    // 对于回调（包括系统日志）
+    else if (cb_log) {
+        cb_log(level, pre_tag ? NULL : tag, out, total);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// 异步日志：log_slot() 格式化后拷贝到无锁队列，后台写线程批量输出
+
+#define LOG_ASYNC_INLINE        480                 // 槽位内联数据大小，超出部分单独分配
+
+// 队列槽位数据区布局：log_async_rec_t + [tag \0] + text \0 (+1 供回调追加 \n)
+typedef struct {
+    log_cb                      cb_log;
+    char*                       heap;               // 超长日志的独立内存（NULL 表示内联存储）
+    uint16_t                    tag_len;
+    uint8_t                     level;
+    bool                        pre_tag;
+} log_async_rec_t;
+
+static struct {
+    lfq_t                       q;
+    log_async_e                 policy;
+    volatile bool               running;
+    volatile bool               idle;               // 写线程空闲等待中
+    volatile int                blocked;            // 阻塞等待队列空间的生产者数量
+    volatile uint64_t           done;               // 已处理（输出或丢弃）的日志条数
+    volatile uint64_t           dropped;            // 队列满丢弃的日志条数
+    thd_t                       thread;
+    P_mutex_t                   mutex;
+    P_cond_t                    cond_work;          // 通知写线程有新数据
+    P_cond_t                    cond_done;          // 通知生产者/flush 方写线程已推进
+} g_log_async;
+static TLS bool                 g_log_in_writer;    // 当前线程为写线程（回调中的日志直接同步输出）
+
+// 释放一个已出队的槽位（包括超长日志的独立内存）
+static void log_async_drop(lfq_slot_t* slot, size_t pos) {
+    log_async_rec_t* rec = (log_async_rec_t*)LFQ_DATA(slot);
+    if (rec->heap) { free(rec->heap); rec->heap = NULL; }
+    lfq_release(&g_log_async.q, slot, pos);
+}
+
+// 将已格式化的日志写入队列，返回 false 表示该日志被丢弃
+static bool log_async_push(log_level_e level, const char* tag, const char* out, int total, log_cb cb_log, bool pre_tag) {
+
+    size_t pos; lfq_slot_t* slot;
+    while (!(slot = lfq_claim(&g_log_async.q, &pos))) {
+        switch (g_log_async.policy) {
+        case LOG_ASYNC_DROP_NEWEST:
+            P_get_and_inc(&g_log_async.dropped, 1);
+            return false;
+        case LOG_ASYNC_DROP_OLDEST: {
+            size_t old; lfq_slot_t* s = lfq_take(&g_log_async.q, &old);
+            if (s) {
+                log_async_drop(s, old);
+                P_get_and_inc(&g_log_async.dropped, 1);
+                P_get_and_inc(&g_log_async.done, 1);
+            }
+            break;
+        }
+        default: {
+            if (!P_get(&g_log_async.running)) {     // 写线程已退出（进程退出中）
+                P_get_and_inc(&g_log_async.dropped, 1);
+                return false;
+            }
+            P_mutex_lock(&g_log_async.mutex);
+            P_get_and_inc(&g_log_async.blocked, 1);
+            P_cond_one(&g_log_async.cond_work);
+            P_clock tm = { 0, 1000000 };            // 1ms，防止唤醒丢失
+            P_wait_timeout(&g_log_async.cond_done, &g_log_async.mutex, &tm);
+            P_get_and_inc(&g_log_async.blocked, -1);
+            P_mutex_unlock(&g_log_async.mutex);
+            break;
+        }
+        }
+    }
+
+    log_async_rec_t* rec = (log_async_rec_t*)LFQ_DATA(slot);
+    int tag_len = (!pre_tag && tag) ? (int)strlen(tag) : 0;
+    if (tag_len > 255) tag_len = 255;
+    size_t need = (size_t)tag_len + 1 + (size_t)total + 2;
+
+    char* data = (char*)(rec + 1);
+    rec->heap = NULL;
+    if (need > LOG_ASYNC_INLINE && (rec->heap = (char*)malloc(need)) != NULL) data = rec->heap;
+    else if (need > LOG_ASYNC_INLINE) {             // OOM：截断到内联空间
+        total = LOG_ASYNC_INLINE - tag_len - 3;
+        if (total < 0) { tag_len = 0; total = LOG_ASYNC_INLINE - 3; }
+    }
+
+    rec->cb_log  = cb_log;
+    rec->level   = (uint8_t)level;
+    rec->pre_tag = pre_tag;
+    rec->tag_len = (uint16_t)tag_len;
+    memcpy(data, tag, tag_len); data[tag_len] = '\0';
+    memcpy(data + tag_len + 1, out, total); data[tag_len + 1 + total] = '\0';
+    slot->len = total;
+    lfq_commit(slot, pos);
+
+    if (P_get_ord(&g_log_async.idle)) {
+        P_mutex_lock(&g_log_async.mutex);
+        P_cond_one(&g_log_async.cond_work);
+        P_mutex_unlock(&g_log_async.mutex);
+    }
+    return true;
+}
+
+// 写线程：批量取出日志输出，每批结束后统一 fflush
+static int32_t log_async_proc(void* ctx) {
+    (void)ctx;
+    g_log_in_writer = true;
+
+    for (;;) {
+        int n = 0; size_t pos; lfq_slot_t* slot;
+        while ((slot = lfq_take(&g_log_async.q, &pos))) {
+            log_async_rec_t* rec = (log_async_rec_t*)LFQ_DATA(slot);
+            char* tag = rec->heap ? rec->heap : (char*)(rec + 1);
+            log_emit((log_level_e)rec->level, rec->tag_len ? tag : NULL, tag + rec->tag_len + 1, slot->len,
+                     rec->cb_log, rec->pre_tag);
+            log_async_drop(slot, pos);
+            if (++n >= 256) break;                  // 分批推进，及时唤醒等待方
+        }
+
+        if (n) {
+            fflush(stdout);
+            log_file_flush(false);
+            log_stdout_flush();
+            P_get_and_inc_rel(&g_log_async.done, n);
+            if (P_get(&g_log_async.blocked) || !P_get(&g_log_async.running)) {
+                P_mutex_lock(&g_log_async.mutex);
+                P_cond_all(&g_log_async.cond_done);
+                P_mutex_unlock(&g_log_async.mutex);
+            }
+            continue;
+        }
+
+        if (!P_get_acq(&g_log_async.running)) break;
+
+        // 队列为空：进入空闲等待。先置 idle 再复查队列，避免与生产者的通知交错而丢失唤醒
+        P_mutex_lock(&g_log_async.mutex);
+        P_cond_all(&g_log_async.cond_done);
+        P_set_ord(&g_log_async.idle, true);
+        size_t tail = P_get(&g_log_async.q.tail);
+        if ((intptr_t)P_get_ord(&LFQ_SLOT(&g_log_async.q, tail)->seq) - (intptr_t)(tail + 1) < 0
+            && P_get(&g_log_async.running)) {
+            P_clock tm = { 0, 50000000 };           // 50ms 兜底
+            P_wait_timeout(&g_log_async.cond_work, &g_log_async.mutex, &tm);
+        }
+        P_set(&g_log_async.idle, false);
+        P_mutex_unlock(&g_log_async.mutex);
+    }
+
+    g_log_in_writer = false;
+    return 0;
+}
+
+// 停止写线程（退出前会输出全部剩余日志）
+static void log_async_exit(void) {
+
+    if (!g_log_async.thread) return;
+
+    P_mutex_lock(&g_log_async.mutex);
+    P_set_rel(&g_log_async.running, false);
+    P_cond_one(&g_log_async.cond_work);
+    P_mutex_unlock(&g_log_async.mutex);
+    P_join(g_log_async.thread, NULL);
+    g_log_async.thread = 0;
+}
+
+// 停止写线程并释放队列
+// + 进程退出时（atexit）只停止写线程，不释放队列，避免其他线程仍在写入
+static void log_async_stop(void) {
+
+    if (!g_log_async.thread) return;
+    log_async_exit();
+
+    lfq_final(&g_log_async.q);
+    P_cond_final(&g_log_async.cond_work);
+    P_cond_final(&g_log_async.cond_done);
+    P_mutex_final(&g_log_async.mutex);
+}
+
+ret_t log_async(uint32_t capacity, log_async_e policy) {
+
+    static bool s_atexit = false;
+
+    log_async_stop();
+    if (!capacity) return E_NONE;
+
+    if (!lfq_init(&g_log_async.q, capacity, sizeof(log_async_rec_t) + LOG_ASYNC_INLINE))
+        return E_OUT_OF_MEMORY;
+    g_log_async.policy  = policy;
+    g_log_async.idle    = false;
+    g_log_async.blocked = 0;
+    g_log_async.done    = 0;
+    P_mutex_init(&g_log_async.mutex);
+    P_cond_init(&g_log_async.cond_work);
+    P_cond_init(&g_log_async.cond_done);
+
+    P_set_rel(&g_log_async.running, true);
+    ret_t ret = P_thread(&g_log_async.thread, log_async_proc, NULL, P_THD_BACKGROUND, 0);
+    if (ret != E_NONE) {
+        g_log_async.running = false;
+        g_log_async.thread = 0;
+        lfq_final(&g_log_async.q);
+        P_cond_final(&g_log_async.cond_work);
+        P_cond_final(&g_log_async.cond_done);
+        P_mutex_final(&g_log_async.mutex);
+        return ret;
+    }
+
+    if (!s_atexit) { s_atexit = true;
+        atexit(log_async_exit);
+    }
+    return E_NONE;
+}
+
+void log_flush(void) {
+
+    if (!P_get_acq(&g_log_async.running) || g_log_in_writer) {
+        log_file_flush(false);
+        log_stdout_flush();
+        return;
+    }
+
+    uint64_t target = (uint64_t)P_get(&g_log_async.q.head);
+    P_mutex_lock(&g_log_async.mutex);
+    while (P_get_acq(&g_log_async.done) < target && P_get(&g_log_async.running)) {
+        P_cond_one(&g_log_async.cond_work);
+        P_clock tm = { 0, 10000000 };
+        P_wait_timeout(&g_log_async.cond_done, &g_log_async.mutex, &tm);
+    }
+    P_mutex_unlock(&g_log_async.mutex);
+    log_file_flush(false);
+    log_stdout_flush();
+}
+
+uint64_t log_dropped(void) {
+    return P_get(&g_log_async.dropped);
+}
+
+//-----------------------------------------------------------------------------
+
+#ifdef LOG_INSTRUMENT
+static void log_printf(log_level_e level, const char *tag, const char *fmt, ...) {
+    va_list args; va_start(args, fmt);
+    if (g_inst_log_cb)
+        log_slot(level, tag, fmt, args, g_inst_log_cb, true);
+    else if (g_inst_cb)
+        instrument_slot(level, tag, fmt, args);
+    va_end(args);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// 日志前缀：时间戳按秒缓存格式化结果，每行只追加微秒部分；线程 ID 按线程缓存为字符串
+
+#define LOG_PREFIX_MAX          80
+
+static int                      g_log_prefix;                       // log_prefix_e 组合
+
+static TLS struct {
+    int64_t                     sec;                                // wall 缓存对应的秒，-1 表示未缓存
+    uint8_t                     wall_len;
+    uint8_t                     tid_len;                            // 0 表示未缓存
+    char                        wall[24];                           // "YYYY-MM-DD HH:MM:SS"
+    char                        tid[24];
+}                               g_log_pfx = { .sec = -1 };
+
+// 无符号整数转十进制（width > 0 时左侧补 0 到固定宽度）
+static char* log_u2a(char* p, uint64_t v, int width) {
+    char tmp[20]; int n = 0;
+    do { tmp[n++] = (char)('0' + v % 10); v /= 10; } while (v);
+    while (n < width) tmp[n++] = '0';
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+static uint64_t log_tid(void) {
+    if (tls_this) return tls_this->ID;
+#if P_WIN
+    return GetCurrentThreadId();
+#elif P_DARWIN
+    return pthread_mach_thread_np(pthread_self());
+#elif P_LINUX
+    return (uint64_t)syscall(SYS_gettid);
+#else
+    return (uint64_t)(uintptr_t)pthread_self();
+#endif
+}
+
+static int log_prefix_fmt(char* buf, int flags) {
+
+    char* p = buf;
+    if (flags & LOG_PREFIX_WALL) {
+        P_clock c; P_time_now(&c);
+        if (c.tv_sec != g_log_pfx.sec) {                            // 每秒（每线程）只格式化一次
+            time_t t = (time_t)c.tv_sec; struct tm tm;
+#if P_WIN
+            localtime_s(&tm, &t);
+#else
+            localtime_r(&t, &tm);
+#endif
+            g_log_pfx.wall_len = (uint8_t)strftime(g_log_pfx.wall, sizeof(g_log_pfx.wall), "%Y-%m-%d %H:%M:%S", &tm);
+            g_log_pfx.sec = c.tv_sec;
+        }
+        memcpy(p, g_log_pfx.wall, g_log_pfx.wall_len); p += g_log_pfx.wall_len;
+        *p++ = '.';
+        p = log_u2a(p, (uint64_t)c.tv_nsec / 1000, 6);
+        *p++ = ' ';
+    }
+    if (flags & LOG_PREFIX_MONO) {
+        P_clock c; P_clock_now(&c);
+        p = log_u2a(p, (uint64_t)c.tv_sec, 0);
+        *p++ = '.';
+        p = log_u2a(p, (uint64_t)c.tv_nsec / 1000, 6);
+        *p++ = ' ';
+    }
+    if (flags & LOG_PREFIX_TID) {
+        if (!g_log_pfx.tid_len) {
+            char* e = log_u2a(g_log_pfx.tid, log_tid(), 0);
+            *e++ = ' ';
+            g_log_pfx.tid_len = (uint8_t)(e - g_log_pfx.tid);
+        }
+        memcpy(p, g_log_pfx.tid, g_log_pfx.tid_len); p += g_log_pfx.tid_len;
+    }
+    return (int)(p - buf);
+}
+
+void log_prefix(int flags) {
+    P_set(&g_log_prefix, flags);
+}
+
+//-----------------------------------------------------------------------------
+// print(":") 缓存模式：每线程可增长的缓冲区，跨记录复用；最终记录整体输出（不截断、不拆行）
+
+#define LOG_CACHE_HEAD          (LOG_HDR_RESERVE + LOG_PREFIX_MAX + 256)   // 文本前预留：instrument header + 前缀 + tag
+#define LOG_CACHE_KEEP          (64 * 1024)         // 超过该大小的缓冲区在下一条记录开始时释放
+#define LOG_CACHE_MAX           (16 * 1024 * 1024)  // 单条记录上限
+
+static TLS struct {
+    char*                       data;
+    int                         cap;
+}                               g_log_cache;
+
+// 确保缓存可容纳 len 字节文本（另 +1 给 \0）
+static bool log_cache_reserve(int len) {
+    if (LOG_CACHE_HEAD + len + 1 <= g_log_cache.cap) return true;
+    if (len > LOG_CACHE_MAX) return false;
+    int cap = g_log_cache.cap ? g_log_cache.cap : LOG_CACHE_HEAD + LOG_LINE_MAX;
+    while (cap < LOG_CACHE_HEAD + len + 1) cap *= 2;
+    char* p = (char*)realloc(g_log_cache.data, cap);
+    if (!p) return false;
+    g_log_cache.data = p;
+    g_log_cache.cap = cap;
+    return true;
+}
+
+// 追加一段到缓存（当前长度 n），返回新长度，失败返回 -1
+static int log_cache_append(int n, const char* fmt, va_list params) {
+
+    if (!log_cache_reserve(n + 256)) return -1;
+    char* text = g_log_cache.data + LOG_CACHE_HEAD;
+    if (*fmt == '%' && fmt[1] == ' ') {
+        int m = (int)strlen(fmt + 2);
+        if (!log_cache_reserve(n + m)) return -1;
+        text = g_log_cache.data + LOG_CACHE_HEAD;
+        memcpy(text + n, fmt + 2, m);
+        n += m;
+    }
+    else {
+        va_list ap; va_copy(ap, params);
+        int avail = g_log_cache.cap - LOG_CACHE_HEAD - n;
+        int m = vsnprintf(text + n, avail, fmt, ap);
+        va_end(ap);
+        if (m < 0) m = 0;
+        else if (m >= avail) {                      // 空间不足：扩容后重新格式化
+            if (!log_cache_reserve(n + m)) return -1;
+            text = g_log_cache.data + LOG_CACHE_HEAD;
+            vsnprintf(text + n, m + 1, fmt, params);
+        }
+        n += m;
+    }
+    text[n] = 0;
+    return n;
+}
+
+void log_slot(log_level_e level, const char *tag, const char *fmt, va_list params, log_cb cb_log, bool pre_tag) {
+
+    bool rec_only = (level & LOG_SLOT_REC_ONLY) != 0;              // 超出正常输出级别（由 print 判定）
+    level = (log_level_e)(level & ~LOG_SLOT_REC_ONLY);
+
+    if (cb_log == (log_cb)-2) {
+        if (!g_log_sys) { g_log_sys = true; log_init(); }
+        #if P_WIN || defined(__ANDROID__)
+            pre_tag = false;
+        #else
+            pre_tag = true;
+        #endif
+    }
+
+    static TLS int          g_logging = -1;         // -1: 默认模式，0: 开启缓存模式（缓存内容为空），>0: 缓存模式且已写入内容
+    static TLS char         g_line[LOG_CACHE_HEAD + LOG_LINE_MAX];
+    char*                   buf = g_line + LOG_CACHE_HEAD;          // 日志输出起始位置
+    int                     line_max = LOG_LINE_MAX;                // buf 可用空间
+    bool                    formatted = false;                      // 文本已完整写入 buf（缓存模式）
+
+    // 如果 tag 为空，表示输出日志到缓存
+    if (!tag) {
+
+        // 开启缓存模式，并 rewind 到开头（上一条超大记录的缓存在此释放）
+        if (!fmt) {
+            g_logging = 0;
+            if (g_log_cache.cap > LOG_CACHE_KEEP) {
+                free(g_log_cache.data);
+                g_log_cache.data = NULL; g_log_cache.cap = 0;
+            }
+            return;
+        }
+        if (g_logging < 0) g_logging = 0;
+        if (!*fmt) return;
+        int n = log_cache_append(g_logging, fmt, params);
+        if (n < 0) fprintf(stderr, "W: log buffer full, ignore log content\n");
+        else g_logging = n;
+        return;
+    }
+
+    // 如果之前开启了缓存模式，且缓存内容为空，则关闭缓存模式，直接返回
+    if (g_logging == 0) { g_logging = -1;
+        return;
+    }
+
+    // 二进制模式：不格式化，直接记录参数（FATAL、缓存输出及不支持的格式串仍走文本路径）
+    uint8_t rec_level = P_get(&log_recorder_level);
+    if (rec_level && level >= rec_level) rec_only = true;           // 仅写入飞行记录器
+    if (!rec_only && P_get(&g_log_file.binary) && g_logging < 0 && level != LOG_SLOT_FATAL && !(*fmt == '%' && fmt[1] == ' ') &&
+        log_bin_write(level, tag, fmt, params, g_line, (int)sizeof(g_line)))
+        return;
+
+    int tag_len = (int)strlen(tag);
+    if (tag_len > 255 + LOG_LINE_MAX - 1)           // 限制 tag 长度，防止溢出
+        tag_len = 255 + LOG_LINE_MAX - 1;
+    char* out;                                      // 输出起始位置
+
+    int n = 0;
+    if (g_logging > 0) {                            // 对于缓存模式的最终输出：追加最后一段后整体输出
+        n = log_cache_append(g_logging, fmt, params);
+        if (n < 0) n = g_logging;
+        g_logging = -1;                             // 关闭缓存模式
+        log_cache_reserve(n + 256);                 // 为超长 tag 的移动预留空间
+        buf = g_log_cache.data + LOG_CACHE_HEAD;
+        line_max = g_log_cache.cap - LOG_CACHE_HEAD;
+        formatted = true;
+    }
+
+    #ifdef LOG_INSTRUMENT
+    {
+        // 复制 tag
+        int m = (tag_len < 256) ? tag_len : 255;
+        out = buf - m - 1;
+        memcpy(out, tag, m);
+        out[m] = 0;
+
+        // 格式化文本
+        if (!formatted && n < line_max) {
+            if (*fmt == '%' && fmt[1] == ' ')
+                n += snprintf(buf+n, line_max-n, "%s", fmt + 2);
+            else n += vsnprintf(buf+n, line_max-n, fmt, params);
+        }
+        if (n >= line_max) buf[n = line_max - 1] = 0;
+
+        if (P_get(&g_inst_gate[level / 32]) & (1u << (level % 32)))   // 无人订阅：文本仍用于本地输出，只跳过发送
+            inst_send_buf((uint8_t)level, out - INST_HDR_SIZE, m, n);
+
+        if (pre_tag) {
+            if (tag_len >= 256) { int shift = tag_len - 255;
+                int max_n = line_max - 1 - shift;           // 移动后的最大 text 长度 (-1 给 \0)
+                if (max_n < 0) max_n = 0;
+                if (n > max_n) buf[n = max_n] = 0;          // 截断 text
+                memmove(buf + shift, buf, n + 1);           // 后移 text (+1 含 \0)
+                memcpy(buf - 1, tag + 255, shift);          // 填入 tag 剩余部分 (从 out[255] 开始)
+            }
+            out[tag_len] = ' ';
+        } else out = buf;
+    }
+    #else
+    {
+        char* text = buf;                                   // text 起始位置
+        int text_max = line_max;                            // text 可用空间
+
+        // 设置输出位置
+        if (pre_tag) {
+            int m = (tag_len < 256) ? tag_len : 255;
+            out = buf - m - 1;
+            memcpy(out, tag, m);
+            if (tag_len >= 256) { int shift = tag_len - 255;
+                text_max = line_max - 1 - shift;            // 移动后的最大 text 长度 (-1 给 \0)
+                if (text_max < 0) text_max = 0;
+                if (n > text_max) n = text_max;             // 截断缓存
+                if (n > 0) memmove(buf + shift, buf, n);
+                memcpy(buf - 1, tag + 255, shift);          // 填入 tag 剩余部分 (从 out[255] 开始)
+                text = buf + shift;                         // text 起始位置改变
+            }
+            out[tag_len] = ' ';
+        } else out = buf;
+
+        // 格式化 fmt 到 text
+        if (!formatted && n < text_max) {
+            if (*fmt == '%' && fmt[1] == ' ')
+                n += snprintf(text+n, text_max-n, "%s", fmt + 2);
+            else n += vsnprintf(text+n, text_max-n, fmt, params);
+        }
+        if (text_max > 0 && n >= text_max) text[n = text_max - 1] = 0;
+    }
+    #endif
+
+    int total = (out == buf) ? n : tag_len + 1 + n;  // 总输出长度 todo 确保 total 可以 + 1，即补充一个 \n
+
+    // 时间戳/线程 ID 前缀（instrument 已发送，不包含前缀）
+    int prefix = P_get(&g_log_prefix);
+    if (prefix) {
+        char pfx[LOG_PREFIX_MAX];
+        int m = log_prefix_fmt(pfx, prefix);
+        out -= m; total += m;
+        memcpy(out, pfx, m);
+    }
+
+    // 飞行记录器
+    if (rec_level) log_rec_write(level, out, total);
+    if (rec_only) return;
+
+    // 异步模式：拷贝到队列后立即返回（写线程自身的日志直接同步输出，避免递归等待）
+    if (P_get_acq(&g_log_async.running) && !g_log_in_writer) {
+        if (cb_log || P_get(&g_log_file.fd) >= 0) log_async_push(level, tag, out, total, cb_log, pre_tag);
+        if (level == LOG_SLOT_FATAL) log_flush();
+    }
+    else log_emit(level, tag, out, total, cb_log, pre_tag);
+}
+
+//-----------------------------------------------------------------------------
+// 日志调用点注册表
+
+#define LOG_SITE_RULES          32
+
+static struct {
+    char*                       pattern;
+    uint8_t                     mode;
+}                               g_log_site_rules[LOG_SITE_RULES];
+static int                      g_log_site_rule_n;
+static log_site_t*              g_log_sites;                        // 已执行过的调用点
+static P_mutex_t                g_log_sites_mutex;
+static volatile int             g_log_sites_init;                   // g_log_sites_mutex 已初始化（调用点可能在任何初始化之前执行）
+static TLS bool                 g_log_sites_owner;                  // 当前线程已持有锁（遍历回调中再次进入）
+
+#if defined(__ELF__) && (defined(__GNUC__) || defined(__clang__))
+extern log_site_t* const        __start_stdc_log_sites[] __attribute__((weak));
+extern log_site_t* const        __stop_stdc_log_sites[] __attribute__((weak));
+#endif
+
+static bool log_sites_lock(void) {
+    if (g_log_sites_owner) return false;
+    if (!P_get_acq(&g_log_sites_init)) {
+        static volatile int spin = 0;
+        P_spin_lock(&spin);
+        if (!g_log_sites_init) { P_mutex_init(&g_log_sites_mutex); P_set_rel(&g_log_sites_init, 1); }
+        P_spin_unlock(&spin);
+    }
+    P_mutex_lock(&g_log_sites_mutex);
+    return g_log_sites_owner = true;
+}
+
+static void log_sites_unlock(bool locked) {
+    if (!locked) return;
+    g_log_sites_owner = false;
+    P_mutex_unlock(&g_log_sites_mutex);
+}
+
+// 通配符匹配（* 和 ?）
+static bool log_glob(const char* p, const char* s) {
+    const char *star = NULL, *ss = s;
+    while (*s) {
+        if (*p == '?' || *p == *s) { ++p; ++s; }
+        else if (*p == '*') { star = p++; ss = s; }
+        else if (star) { p = star + 1; s = ++ss; }
+        else return false;
+    }
+    while (*p == '*') ++p;
+    return !*p;
+}
+
+static bool log_site_match(const log_site_t* site, const char* pattern) {
+    if (!pattern) return true;
+    const char* base = site->file, *q;
+    if ((q = strrchr(base, '/'))) base = q + 1;
+    if ((q = strrchr(base, '\\'))) base = q + 1;
+    char name[256];
+    snprintf(name, sizeof(name), "%s:%d", base, (int)site->line);
+    return log_glob(pattern, name) || log_glob(pattern, base) || log_glob(pattern, site->file) ||
+           (site->tag && log_glob(pattern, site->tag));
+}
+
+#ifdef LOG_INSTRUMENT
+static uint8_t inst_log_override(const char* tag);
+#endif
+
+static void log_site_apply(log_site_t* site) {
+    if (site->mode == LOG_SITE_ON) site->enabled = 1;
+    else if (site->mode == LOG_SITE_OFF) site->enabled = 0;
+    else site->enabled = (site->state & LOG_SITE_S_RESOLVED)
+        ? ((site->state & LOG_SITE_S_AUTO_ON) || P_get(&log_recorder_level)) : 1;
+}
+
+void log_site_resolve(log_site_t* site, uint8_t level, const char* fmt, const char* tag, bool auto_on) {
+
+    bool locked = log_sites_lock();
+    if (!(site->state & LOG_SITE_S_RESOLVED)) {
+        site->level = level;
+        site->fmt = fmt;
+        site->tag = tag;
+        site->state = LOG_SITE_S_RESOLVED | (auto_on ? LOG_SITE_S_AUTO_ON : 0);
+#ifdef LOG_INSTRUMENT
+        site->state |= (uint8_t)(inst_log_override(tag) << 4);
+#endif
+        for (int i = 0; i < g_log_site_rule_n; ++i)
+            if (log_site_match(site, g_log_site_rules[i].pattern)) site->mode = g_log_site_rules[i].mode;
+        site->next = g_log_sites;
+        g_log_sites = site;
+        log_site_apply(site);
+    }
+    log_sites_unlock(locked);
+}
+
+// 遍历所有调用点（需持有锁）：先遍历已执行的，再遍历 section 中尚未执行的
+static int log_sites_each(bool (*fn)(log_site_t* site, void* ctx), void* ctx) {
+    int n = 0;
+    for (log_site_t* site = g_log_sites; site; site = site->next) {
+        ++n; if (!fn(site, ctx)) return n;
+    }
+#if defined(__ELF__) && (defined(__GNUC__) || defined(__clang__))
+    if (__start_stdc_log_sites && __stop_stdc_log_sites) {
+        for (log_site_t* const* p = __start_stdc_log_sites; p < __stop_stdc_log_sites; ++p) {
+            if ((*p)->state & LOG_SITE_S_RESOLVED) continue;
+            ++n; if (!fn(*p, ctx)) return n;
+        }
+    }
+#endif
+    return n;
+}
+
+#ifdef LOG_INSTRUMENT
+static bool log_site_level_fn(log_site_t* site, void* ctx) { (void)ctx;
+    if (site->tag) site->state = (uint8_t)((site->state & 0x0F) | (inst_log_override(site->tag) << 4));
+    return true;
+}
+
+// 远程日志级别变化后刷新所有调用点缓存的级别
+static void log_site_levels(void) {
+    bool locked = log_sites_lock();
+    log_sites_each(log_site_level_fn, NULL);
+    log_sites_unlock(locked);
+}
+#endif
+
+static bool log_site_rec_fn(log_site_t* site, void* ctx) { (void)ctx;
+    log_site_apply(site);
+    return true;
+}
+
+typedef struct { const char* pattern; uint8_t mode; int n; } log_site_set_t;
+
+static bool log_site_set_fn(log_site_t* site, void* ctx) {
+    log_site_set_t* c = (log_site_set_t*)ctx;
+    if (log_site_match(site, c->pattern)) { ++c->n;
+        site->mode = c->mode;
+        log_site_apply(site);
+    }
+    return true;
+}
+
+int log_site_set(const char* pattern, log_site_e mode) {
+
+    bool locked = log_sites_lock();
+
+    // 更新规则：同一 pattern 只保留最后一次设置；NULL 表示全部，同时清除所有规则
+    if (!pattern) {
+        for (int i = 0; i < g_log_site_rule_n; ++i) free(g_log_site_rules[i].pattern);
+        g_log_site_rule_n = 0;
+    }
+    else for (int i = 0; i < g_log_site_rule_n; ++i) {
+        if (strcmp(g_log_site_rules[i].pattern, pattern)) continue;
+        free(g_log_site_rules[i].pattern);
+        memmove(&g_log_site_rules[i], &g_log_site_rules[i + 1], (g_log_site_rule_n - i - 1) * sizeof(g_log_site_rules[0]));
+        --g_log_site_rule_n;
+        break;
+    }
+    if (mode != LOG_SITE_AUTO) {
+        if (g_log_site_rule_n == LOG_SITE_RULES) {                  // 规则已满，丢弃最早的规则
+            free(g_log_site_rules[0].pattern);
+            memmove(&g_log_site_rules[0], &g_log_site_rules[1], (LOG_SITE_RULES - 1) * sizeof(g_log_site_rules[0]));
+            --g_log_site_rule_n;
+        }
+        char* dup = strdup(pattern ? pattern : "*");
+        if (dup) {
+            g_log_site_rules[g_log_site_rule_n].pattern = dup;
+            g_log_site_rules[g_log_site_rule_n++].mode = (uint8_t)mode;
+        }
+    }
+
+    log_site_set_t c = { pattern, (uint8_t)mode, 0 };
+    log_sites_each(log_site_set_fn, &c);
+
+    log_sites_unlock(locked);
+    return c.n;
+}
+
+typedef struct { bool (*cb)(const log_site_t* site, void* ctx); void* ctx; } log_sites_t;
+
+static bool log_sites_fn(log_site_t* site, void* ctx) {
+    log_sites_t* c = (log_sites_t*)ctx;
+    return c->cb(site, c->ctx);
+}
+
+int log_sites(bool (*cb)(const log_site_t* site, void* ctx), void* ctx) {
+    if (!cb) return 0;
+    bool locked = log_sites_lock();
+    log_sites_t c = { cb, ctx };
+    int n = log_sites_each(log_sites_fn, &c);
+    log_sites_unlock(locked);
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// 调用点限流：按级别配置，每个调用点独立的令牌桶（GCRA，32 位微秒时钟回绕安全）+ 1/N 采样
+
+#define LOG_LIMIT_REPORT_US     1000000             // 同一调用点汇总行的最小间隔
+
+uint8_t                         log_limit_mask = 0; // 位 n 表示级别 n 开启了限流/采样
+
+static struct {
+    uint32_t                    interval;           // 令牌间隔 (us)，0 不限速
+    uint32_t                    tau;                // 允许的突发提前量 (us) = interval * (burst - 1)
+    uint32_t                    sample;             // 1/N 采样，<= 1 不采样
+}                               g_log_limit[LOG_SLOT_VERBOSE + 1];
+
+void log_limit(log_level_e level, uint32_t rate, uint32_t burst, uint32_t sample) {
+    if (level <= LOG_SLOT_NONE || level > LOG_SLOT_VERBOSE) return;
+    uint32_t interval = rate ? (rate >= 1000000 ? 1 : 1000000 / rate) : 0;
+    if (!burst) burst = rate ? rate : 1;
+    uint64_t tau = (uint64_t)interval * (burst - 1);
+    P_set(&log_limit_mask, (uint8_t)(log_limit_mask & ~(1u << level)));
+    g_log_limit[level].interval = interval;
+    g_log_limit[level].tau = tau > 0x3FFFFFFF ? 0x3FFFFFFF : (uint32_t)tau;
+    g_log_limit[level].sample = sample;
+    if (interval || sample > 1) {
+        P_set(&log_limit_mask, (uint8_t)(log_limit_mask | (1u << level)));
+        log_tick_start();                           // 调用点不再放行时，由定时线程输出汇总
+    }
+}
+
+static void log_limit_report(log_level_e level, const char* tag, log_cb cb_log, bool pre_tag, const char* fmt, ...) {
+    va_list args; va_start(args, fmt);
+    log_slot(level, tag, fmt, args, cb_log, pre_tag);
+    va_end(args);
+}
+
+// 输出调用点被抑制的行数（距上次汇总超过 1 秒时）
+static void log_site_report(log_site_t* site, uint8_t level, const char* tag, log_cb cb_log, bool pre_tag, uint32_t now) {
+    if (!P_get(&site->dropped) || now - P_get(&site->report) < LOG_LIMIT_REPORT_US) return;
+    P_set(&site->report, now);
+    uint32_t n = P_get_and_set(&site->dropped, 0);
+    if (!n) return;
+    const char* base = site->file, *q;
+    if ((q = strrchr(base, '/'))) base = q + 1;
+    if ((q = strrchr(base, '\\'))) base = q + 1;
+    log_limit_report((log_level_e)level, tag, cb_log, pre_tag,
+                     "suppressed %u similar messages (%s:%d)\n", n, base, (int)site->line);
+}
+
+// 抑制一次调用：首次抑制时记录汇总行的输出目标，供定时线程使用
+static bool log_site_drop(log_site_t* site, log_cb cb_log, bool pre_tag) {
+    if (!site->cb_log) { site->pre_tag = pre_tag; P_set_rel(&site->cb_log, cb_log); }
+    P_get_and_inc(&site->dropped, 1);
+    return false;
+}
+
+// 定时线程：调用点之后不再放行时，被抑制的行数也会在 1 秒后输出
+// 持锁只收集待汇总的调用点，解锁后再输出（慢速输出目标不阻塞其他线程注册调用点）
+#define LOG_LIMIT_TICK_MAX      64
+static void log_limit_tick(void) {
+    if (!P_get(&log_limit_mask)) return;
+    uint32_t now = (uint32_t)P_tick_us();
+    log_site_t* due[LOG_LIMIT_TICK_MAX];
+    int n;
+    do {
+        n = 0;
+        bool locked = log_sites_lock();
+        for (log_site_t* site = g_log_sites; site && n < LOG_LIMIT_TICK_MAX; site = site->next) {
+            if (P_get_acq(&site->cb_log) && site->level <= LOG_SLOT_VERBOSE && P_get(&site->dropped) &&
+                now - P_get(&site->report) >= LOG_LIMIT_REPORT_US) due[n++] = site;
+        }
+        log_sites_unlock(locked);
+        for (int i = 0; i < n; ++i)                 // 调用点描述符为静态存储，解锁后仍然有效
+            log_site_report(due[i], due[i]->level, due[i]->tag, due[i]->cb_log, due[i]->pre_tag, now);
+    } while (n == LOG_LIMIT_TICK_MAX);
+}
+
+bool log_site_admit(log_site_t* site, uint8_t level, const char* tag, log_cb cb_log, bool pre_tag) {
+
+    uint32_t sample = g_log_limit[level].sample, interval = g_log_limit[level].interval;
+
+    // 采样：每 N 次调用放行 1 次
+    if (sample > 1 && P_get_and_inc(&site->hits, 1) % sample) return log_site_drop(site, cb_log, pre_tag);
+
+    // 令牌桶（GCRA）：tat 为理论到达时间，超前 now 不超过 tau 才放行
+    uint32_t now = (uint32_t)P_tick_us();
+    if (interval) {
+        uint32_t tau = g_log_limit[level].tau, tat = P_get(&site->tat);
+        for (;;) {
+            int32_t ahead = (int32_t)(tat - now);
+            if (ahead < 0 || (uint32_t)ahead > tau + interval) ahead = 0;  // 空闲已久或时钟回绕
+            if ((uint32_t)ahead > tau) return log_site_drop(site, cb_log, pre_tag);
+            if (P_test_and_set(&site->tat, &tat, now + (uint32_t)ahead + interval)) break;
+        }
+    }
+
+    // 放行：距上次汇总超过 1 秒时，先输出被抑制的行数
+    log_site_report(site, level, tag, cb_log, pre_tag, now);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+#ifdef LOG_INSTRUMENT
+
+void
+instrument_port(uint16_t port) {
+    
+    assert(g_inst_sock == P_INVALID_SOCKET);        // 必须在首次使用前调用
+    g_inst_port = port;
+}
+
+void
+instrument_ctrl(uint16_t chn) {
+    
+    assert(g_inst_sock == P_INVALID_SOCKET);        // 必须在首次使用前调用
+    g_inst_ctrl = (uint8_t)chn;
+}
+
+void
+instrument_loggable(log_cb cb) {
+    g_inst_log_cb = cb;
+}
+
+void
+instrument_local(int keep_chn, ...) {
 
     g_inst_mode = INST_MODE_LOCAL;
     
@@ -914,232 +2807,1355 @@ instrument_local(int keep_chn, ...) {
     while ((chn = (uint8_t)va_arg(args, int)) != 0) {
         g_inst_keep_chn[chn / 32] |= (1u << (chn % 32));
     }
-    va_end(args);
+    va_end(args);
+}
+
+void
+instrument_remote(void) {
+
+    g_inst_mode = INST_MODE_REMOTE;
+    
+    // 如果 socket 已初始化，更新目标地址
+    if (g_inst_sock != P_INVALID_SOCKET) {
+        g_inst_dest.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    }
+}
+
+void
+instrument_slot(uint8_t chn, const char* tag, const char* fmt, va_list params) {
+
+    if (!(P_get(&g_inst_gate[chn / 32]) & (1u << (chn % 32)))) return;    // 无人订阅：不格式化
+    if (chn == g_inst_ctrl) return;                   // 保留通道，禁止用户使用
+    char stack[INST_UDP_MAX], *buf = stack;
+
+    // 先计算 tag_len，直接格式化到正确位置，避免 memmove
+    int tag_len = tag ? (int)strlen(tag) : 0;
+    if (tag_len > 255) tag_len = 255;
+
+    char* tag_pos  = buf + INST_HDR_SIZE;
+    char* text_pos = tag_pos + tag_len + 1;         // 跳过 tag + \0
+    int text_max   = INST_PAYLOAD_MAX - tag_len - 1; // 最小 1393-255-1=1137
+    int text_limit = INST_MSG_MAX - INST_HDR_SIZE - tag_len - 1;
+    int text_len;
+
+    // "% " 前缀：直接拷贝字符串；超过单包容量时改用堆缓冲区（分片发送）
+    if (*fmt == '%' && fmt[1] == ' ') { const char *src = fmt + 2;
+        text_len = (int)strlen(src);
+        if (text_len > text_limit) text_len = text_limit;
+        if (text_len > text_max && (buf = (char*)malloc(INST_HDR_SIZE + tag_len + 1 + text_len + 1))) {
+            tag_pos = buf + INST_HDR_SIZE;
+            text_pos = tag_pos + tag_len + 1;
+        }
+        else if (!buf) { buf = stack; text_len = text_max; }
+        memcpy(text_pos, src, text_len);
+    }
+    // 格式化到 text 位置
+    else {
+        va_list args;
+        va_copy(args, params);
+        text_len = vsnprintf(text_pos, text_max, fmt, params);
+        if (text_len < 0) text_len = 0;
+        if (text_len >= text_max) {
+            if (text_len > text_limit) text_len = text_limit;
+            if ((buf = (char*)malloc(INST_HDR_SIZE + tag_len + 1 + text_len + 1))) {
+                tag_pos = buf + INST_HDR_SIZE;
+                text_pos = tag_pos + tag_len + 1;
+                vsnprintf(text_pos, text_len + 1, fmt, args);
+            }
+            else { buf = stack; text_len = text_max - 1; }
+        }
+        va_end(args);
+    }
+
+    // 写入 tag + \0
+    if (tag_len > 0) memcpy(tag_pos, tag, tag_len);
+    tag_pos[tag_len] = '\0';
+
+    inst_send_buf(chn, buf, tag_len, text_len);
+    if (buf != stack) free(buf);
+}
+
+
+static void inst_frag_free(inst_frag_t* f) {
+    free(f->buf);
+    f->buf = NULL;
+    f->cnt = 0;
+    f->len = f->cap = 0;
+}
+
+// 释放所有 sender 及槽位池（接收线程未运行，或由接收线程自身调用）
+static void inst_free_senders(void) {
+    for (uint32_t i = 0; i < g_inst_senders_cap; ++i) free(g_inst_senders[i]);
+    free(g_inst_senders);
+    g_inst_senders = NULL;
+    g_inst_senders_cap = g_inst_senders_n = 0;
+    inst_slab_t* slab;
+    while ((slab = g_inst_slabs)) { g_inst_slabs = slab->next; free(slab); }
+    g_inst_slot_free = NULL;
+    g_inst_gaps = 0;
+    for (int i = 0; i < INST_FRAG_SLOTS; ++i) inst_frag_free(&g_inst_frags[i]);
+    inst_mreg_clear();
+}
+
+static void inst_batch_stop(void);
+static void inst_async_stop(void);
+static void inst_metrics_stop(void);
+#if P_LINUX
+static void inst_shm_stop(void);
+#else
+#define inst_shm_stop()         ((void)0)
+#endif
+
+static void inst_cleanup(void) {
+    inst_metrics_stop();
+    inst_batch_stop();
+    inst_async_stop();                              // 发出批量冲刷后仍在排队的包
+    g_inst_running = false;
+    if (g_inst_thread) {
+        P_join(g_inst_thread, NULL);
+        g_inst_thread = 0;
+    }
+    inst_shm_stop();
+    if (g_inst_sock != P_INVALID_SOCKET) {
+        P_sock_close(g_inst_sock);
+        g_inst_sock = P_INVALID_SOCKET;
+    }
+    inst_free_senders();
+}
+
+// 读取选项 bitset 的一个字节（字节 i 为位 [i*8, i*8+8)）
+static inline uint8_t inst_bits_byte(uint16_t byte_idx) {
+    return (uint8_t)(P_get(&instrument_bits[byte_idx / 4]) >> (byte_idx % 4 * 8));
+}
+
+// 修改字节中 mask 覆盖的位为 val，返回是否有变化（有变化时递增 instrument_gen）
+static bool inst_bits_store(uint16_t byte_idx, uint8_t mask, uint8_t val) {
+    uint32_t* w = &instrument_bits[byte_idx / 4];
+    int shift = byte_idx % 4 * 8;
+    uint32_t old = P_get(w), nv;
+    do {
+        nv = (old & ~((uint32_t)mask << shift)) | ((uint32_t)(val & mask) << shift);
+        if (nv == old) return false;
+    } while (!P_test_and_set(w, &old, nv));
+    P_get_and_inc(&instrument_gen, 1);
+    return true;
+}
+
+// 初始化 socket（仅网络，不启动线程）
+// 前置条件：g_inst_sock == P_INVALID_SOCKET（调用处判断）
+// 纯发送场景（instrument_set/instrument_slot）只需调用此函数
+static bool inst_init_sock(void) {
+
+    assert(g_inst_sock == P_INVALID_SOCKET);
+
+    g_inst_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (g_inst_sock == P_INVALID_SOCKET) return false;
+
+    int opt = 1;
+    setsockopt(g_inst_sock, SOL_SOCKET, SO_BROADCAST, (const char*)&opt, sizeof(opt));
+    setsockopt(g_inst_sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    setsockopt(g_inst_sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&opt, sizeof(opt));
+#endif
+#ifdef SO_RXQ_OVFL
+    setsockopt(g_inst_sock, SOL_SOCKET, SO_RXQ_OVFL, (const char*)&opt, sizeof(opt));  // 接收时附带内核丢包计数
+#endif
+
+    // bind 到指定端口（收发共用）
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(g_inst_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(g_inst_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        P_sock_close(g_inst_sock);
+        g_inst_sock = P_INVALID_SOCKET;
+        return false;
+    }
+
+    // 组播设置：
+    // - 加入组播组，确保能接收发往该组播地址的消息
+    // - 启用组播回环，使本机发送的消息也能被本机其他进程收到
+    // 注：单播 + SO_REUSEPORT 在 macOS/Linux 上是负载均衡（只有一个进程收到），
+    //     组播是真正的一对多广播，所有加入组的进程都能收到
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = htonl(INST_MCAST_ADDR);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    setsockopt(g_inst_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq, sizeof(mreq));
+    unsigned char loop = 1;
+    setsockopt(g_inst_sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop));
+
+    // 目标地址：
+    // - HOST 模式：组播地址（本机所有进程可见）
+    // - REMOTE 模式：广播地址（局域网可见）
+    memset(&g_inst_dest, 0, sizeof(g_inst_dest));
+    g_inst_dest.sin_family      = AF_INET;
+    g_inst_dest.sin_port        = htons(g_inst_port);
+    g_inst_dest.sin_addr.s_addr = (g_inst_mode == INST_MODE_REMOTE)
+                                    ? htonl(INADDR_BROADCAST)
+                                    : htonl(INST_MCAST_ADDR);  // 组播地址
+
+    // 生成随机 rid
+    g_inst_rid = (uint16_t)(P_tick_us() ^ (uintptr_t)&g_inst_sock);
+
+    // 设置接收超时（100ms），供线程周期性检查 g_inst_running
+    P_sock_rcvtimeo(g_inst_sock, 100);
+
+    // 增大接收缓冲区（默认通常 ~200KB，高频发送时容易溢出丢包）；收到大消息时再按需增大
+    P_sock_rcvbuf(g_inst_sock, g_inst_rcvbuf);
+
+    atexit(inst_cleanup);
+    return true;
+}
+
+static int32_t inst_thread_proc(void *ctx);  // 前向声明
+
+// 启动接收线程（监听场景需要）
+// 前置条件：g_inst_sock 已初始化，g_inst_thread == 0（调用处判断）
+// instrument_listen/instrument_get 需要调用此函数以接收其他进程的消息
+static bool inst_start_thread(void) {
+
+    assert(g_inst_sock != P_INVALID_SOCKET);
+    assert(g_inst_thread == 0);
+
+    static bool mutex_init = false;
+    if (!mutex_init) {
+        P_mutex_init(&g_inst_rx_mutex);
+        P_mutex_init(&g_inst_opt_mutex);
+        P_mutex_init(&g_inst_mreg_mutex);
+        P_mutex_init(&g_inst_stat_pub.mutex);
+        P_mutex_init(&g_inst_sig.mutex);
+        P_cond_init(&g_inst_sig.cond);
+        mutex_init = true;
+    }
+
+    g_inst_running = true;
+    if (P_thread(&g_inst_thread, inst_thread_proc, NULL, P_THD_BACKGROUND, 0) != E_NONE) {
+        g_inst_running = false;
+        return false;
+    }
+    return true;
+}
+
+// 初始化 socket 并启动接收线程，可由多个线程并发调用（如并发的 instrument_req）
+static bool inst_ensure_thread(void) {
+    if (g_inst_sock != P_INVALID_SOCKET && g_inst_thread) return true;
+    static volatile int lock = 0;
+    P_spin_lock(&lock);
+    bool ok = (g_inst_sock != P_INVALID_SOCKET || inst_init_sock()) &&
+              (g_inst_thread != 0 || inst_start_thread());
+    P_spin_unlock(&lock);
+    return ok;
+}
+
+static inline uint64_t inst_now_ms(void) {
+    P_clock c; P_clock_now(&c);
+    return clock_ms(c);
+}
+
+// 墙钟时间（us），用于跨进程比较的时间戳（与 SO_TIMESTAMPNS 同为 CLOCK_REALTIME）
+static inline uint64_t inst_wall_us(void) {
+    P_clock c; P_time_now(&c);
+    return clock_us(c);
+}
+
+// 调用监听回调：instrument_listen_ex 注册时附带时间信息
+static void inst_cb_call(uint16_t rid, uint8_t chn, const char* tag, char* txt, int len, uint64_t send_us, uint64_t recv_us) {
+    instrument_ex_cb ex = g_inst_cb_ex;
+    if (ex) {
+        instrument_meta_t meta = { send_us, recv_us };
+        ex(rid, chn, tag, txt, len, &meta);
+    }
+    else g_inst_cb(rid, chn, tag, txt, len);
+}
+
+// 在包末尾追加发送时间并打上 INST_TYPE_STAMP 标志，返回新长度（调用方保证有 INST_STAMP_SIZE 余量）
+static int inst_stamp_put(uint8_t* pkt, int len) {
+    uint64_t us = inst_wall_us();
+    pkt[4] |= INST_TYPE_STAMP;
+    nwrite_ll(pkt + len, us);
+    return len + INST_STAMP_SIZE;
+}
+
+// ---- 选项机制 ----
+
+// 每个选项字节的版本戳：墙钟毫秒 << 16 | 设置方 rid（后写者胜，同一毫秒 rid 大者胜），0 表示从未设置
+// 增量（type=1）和快照（type=11）都携带版本戳，接收方只接受更新的版本，重复/过期的包幂等
+// 以下状态由 g_inst_opt_mutex 保护（回调中可调用 instrument_set 等，因此不使用 g_inst_rx_mutex）
+static uint64_t                 g_inst_bits_stamp[INSTRUMENT_OPT_WORDS * 4];
+static uint32_t                 g_inst_bits_stamped = 0;            // 版本戳非 0 的字节数
+static bool                     g_inst_bits_owner   = false;        // 本节点设置过选项：周期广播快照
+static uint64_t                 g_inst_snap_ms      = 0;            // 上次发送快照的时间
+
+static void inst_bits_stamp(uint16_t byte_idx, uint64_t stamp) {
+    if (!g_inst_bits_stamp[byte_idx]) g_inst_bits_stamped++;
+    g_inst_bits_stamp[byte_idx] = stamp;
+}
+
+// 本地修改选项字节，并分配新于已知版本的版本戳（需持有 g_inst_opt_mutex）
+static void inst_bits_local(uint16_t byte_idx, uint8_t mask, uint8_t val) {
+    P_clock c; P_time_now(&c);
+    uint64_t ms = (uint64_t)clock_ms(c), prev = g_inst_bits_stamp[byte_idx] >> 16;
+    if (ms <= prev) ms = prev + 1;                  // 墙钟回拨或对端时钟超前
+    inst_bits_stamp(byte_idx, ms << 16 | g_inst_rid);
+    g_inst_bits_owner = true;
+    inst_bits_store(byte_idx, mask, val);
+}
+
+// 应用对端的选项字节（需持有 g_inst_opt_mutex）；stamp 为 0 表示旧版对端，直接覆盖
+static void inst_bits_apply(uint16_t byte_idx, uint8_t val, uint64_t stamp) {
+    if (stamp) {
+        if (stamp <= g_inst_bits_stamp[byte_idx]) return;
+        inst_bits_stamp(byte_idx, stamp);
+    }
+    if (inst_bits_store(byte_idx, 0xFF, val) && INST_LOG_BYTE(byte_idx)) log_site_levels();
+}
+
+// 发送 type=1 包：header(7) + offset(2) + byte(1) + stamp(8)（需持有 g_inst_opt_mutex）
+// 包格式与 type=0 统一使用 INST_HDR_SIZE header，便于接收端统一处理；旧版接收方只读取前 3 字节
+static void inst_send_bits(uint16_t byte_idx) {
+    if (g_inst_sock == P_INVALID_SOCKET) return;
+
+    uint8_t pkt[INST_HDR_SIZE + INST_SNAP_REC];
+    nwrite_s(pkt, g_inst_rid);                      // rid
+    nwrite_s(pkt + 2, 0);                           // seq（选项包不占序列号）
+    pkt[4] = 1;                                     // type=1 选项包
+    pkt[5] = 0;                                     // chn（未使用，占位）
+    pkt[6] = 0;                                     // tag_len（未使用，占位）
+    // payload: offset(2) + byte(1) + stamp(8)
+    uint64_t stamp = g_inst_bits_stamp[byte_idx];
+    nwrite_s(pkt + INST_HDR_SIZE, byte_idx);
+    pkt[INST_HDR_SIZE + 2] = inst_bits_byte(byte_idx);
+    nwrite_ll(pkt + INST_HDR_SIZE + 3, stamp);
+
+    sendto(g_inst_sock, (const char*)pkt, sizeof(pkt), 0,
+           (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+}
+
+// 发送所有设置过的选项字节：type=11 包 header(7) + N * [byte_idx(2) + byte(1) + stamp(8)]
+// 超过单包容量时分多个包（每条记录独立应用，无需重组）；需持有 g_inst_opt_mutex
+static void inst_send_snapshot(void) {
+    uint8_t pkt[INST_UDP_MAX];
+    nwrite_s(pkt, g_inst_rid);                      // rid
+    nwrite_s(pkt + 2, 0);                           // seq（快照包不占序列号）
+    pkt[4] = 11;                                    // type=11 选项快照
+    pkt[5] = 0;
+    pkt[6] = 0;
+    int len = INST_HDR_SIZE;
+    for (uint32_t i = 0; i < INSTRUMENT_OPT_WORDS * 4; ++i) {
+        uint64_t stamp = g_inst_bits_stamp[i];
+        if (!stamp) continue;
+        if (len + INST_SNAP_REC > INST_UDP_MAX) {
+            sendto(g_inst_sock, (const char*)pkt, len, 0, (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+            len = INST_HDR_SIZE;
+        }
+        uint16_t byte_idx = (uint16_t)i;
+        nwrite_s(pkt + len, byte_idx);
+        pkt[len + 2] = inst_bits_byte(byte_idx);
+        nwrite_ll(pkt + len + 3, stamp);
+        len += INST_SNAP_REC;
+    }
+    if (len > INST_HDR_SIZE)
+        sendto(g_inst_sock, (const char*)pkt, len, 0, (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+    g_inst_snap_ms = inst_now_ms();
 }
 
-void
-instrument_remote(void) {
+// 请求所有节点发送选项快照（type=12，接收线程启动时发出），新节点据此获取启动前设置的选项
+static void inst_send_snap_req(void) {
+    uint8_t pkt[INST_HDR_SIZE + 2];
+    nwrite_s(pkt, g_inst_rid);                      // rid
+    nwrite_s(pkt + 2, 0);                           // seq
+    pkt[4] = 12;                                    // type=12 快照请求
+    pkt[5] = 0;
+    pkt[6] = 0;
+    pkt[7] = pkt[8] = 0;                            // 占位（接收方丢弃小于 header + 2 的包）
+    sendto(g_inst_sock, (const char*)pkt, sizeof(pkt), 0,
+           (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+}
 
-    g_inst_mode = INST_MODE_REMOTE;
-    
-    // 如果 socket 已初始化，更新目标地址
-    if (g_inst_sock != P_INVALID_SOCKET) {
-        g_inst_dest.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+// 接收线程周期处理：设置过选项的节点定期广播快照，补偿丢失的增量包
+static void inst_bits_tick(uint64_t now_ms) {
+    P_mutex_lock(&g_inst_opt_mutex);
+    if (g_inst_bits_owner && now_ms - g_inst_snap_ms >= INST_SNAP_MS) inst_send_snapshot();
+    P_mutex_unlock(&g_inst_opt_mutex);
+}
+
+ret_t
+instrument_set(uint16_t idx, bool enable) {
+
+    // 需要接收线程：周期广播快照、应答新节点的快照请求
+    if (!inst_ensure_thread()) return E_EXTERNAL(P_sock_errno());
+
+    uint16_t byte_idx = idx / 8; uint8_t  bit_mask = (uint8_t)(1u << (idx % 8));
+    P_mutex_lock(&g_inst_opt_mutex);
+    inst_bits_local(byte_idx, bit_mask, enable ? bit_mask : 0);
+    inst_send_bits(byte_idx);
+    P_mutex_unlock(&g_inst_opt_mutex);
+
+    if (INST_LOG_BYTE(byte_idx)) log_site_levels();
+    return E_NONE;
+}
+
+bool
+instrument_get(uint16_t idx) {
+
+    // 监听操作：首次调用启动接收线程以接收其他进程的选项包，之后只读 bitset
+    static int ready = 0;
+    if (!P_get_acq(&ready)) {
+        if (!inst_ensure_thread()) return false;
+        P_set_rel(&ready, 1);
     }
+    return instrument_peek(idx);
 }
 
-void
-instrument_slot(uint8_t chn, const char* tag, const char* fmt, va_list params) {
+// ---- 远程日志级别 ----
+// 选项 bitset 中 [INSTRUMENT_LOG_BASE, +INST_LOG_SLOTS*4) 区域，每个 tag 按哈希占一个 4 位槽，
+// 槽值为覆盖的日志级别（0 表示使用编译时的 LOG_LEVEL）
+
+// 归一化 tag：去除两端的括号、空格等修饰字符（对应 LOG_TAG_L/LOG_TAG_R 及宽度补齐）
+#define INST_TAG_CH(c)          (((c) >= '0' && (c) <= '9') || (((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'z') || (c) == '_' || (c) == '.')
+static uint8_t inst_log_slot(const char* tag) {
+    const char* e = tag + strlen(tag);
+    while (*tag && !INST_TAG_CH(*tag)) ++tag;
+    while (e > tag && !INST_TAG_CH(e[-1])) --e;
+    uint32_t h = 2166136261u;
+    for (; tag < e; ++tag) h = (h ^ (uint8_t)*tag) * 16777619u;
+    return (uint8_t)(h % INST_LOG_SLOTS);
+}
 
-    if (chn == g_inst_ctrl) return;                   // 保留通道，禁止用户使用
-    char buf[INST_UDP_MAX];
+static uint8_t inst_log_override(const char* tag) {
+    uint8_t slot = inst_log_slot(tag);
+    uint16_t byte_idx = INSTRUMENT_LOG_BASE / 8 + slot / 2;
+    uint8_t v = (uint8_t)((inst_bits_byte(byte_idx) >> ((slot & 1) * 4)) & 0x0F);
+    return v > LOG_SLOT_VERBOSE ? LOG_SLOT_VERBOSE : v;
+}
 
-    // 先计算 tag_len，直接格式化到正确位置，避免 memmove
-    int tag_len = tag ? (int)strlen(tag) : 0;
-    if (tag_len > 255) tag_len = 255;
+ret_t
+instrument_log_level(cstr_t tag, log_level_e level) {
 
-    char* tag_pos  = buf + INST_HDR_SIZE;
-    char* text_pos = tag_pos + tag_len + 1;         // 跳过 tag + \0
-    int text_max   = INST_PAYLOAD_MAX - tag_len - 1; // 最小 1393-255-1=1137
-    int text_len;
+    if (!tag || (unsigned)level > LOG_SLOT_VERBOSE) return E_INVALID;
+    if (!inst_ensure_thread()) return E_EXTERNAL(P_sock_errno());
 
-    // "% " 前缀：直接拷贝字符串
-    if (*fmt == '%' && fmt[1] == ' ') { const char *src = fmt + 2;
-        text_len = (int)strlen(src);
-        if (text_len > text_max) text_len = text_max;
-        memcpy(text_pos, src, text_len);
+    uint8_t slot = inst_log_slot(tag);
+    uint16_t byte_idx = INSTRUMENT_LOG_BASE / 8 + slot / 2;
+    int shift = (slot & 1) * 4;
+    P_mutex_lock(&g_inst_opt_mutex);
+    inst_bits_local(byte_idx, (uint8_t)(0x0F << shift), (uint8_t)((unsigned)level << shift));
+    inst_send_bits(byte_idx);
+    P_mutex_unlock(&g_inst_opt_mutex);
+
+    log_site_levels();
+    return E_NONE;
+}
+
+ret_t
+instrument_log_follow(void) {
+    if (!inst_ensure_thread()) return E_EXTERNAL(P_sock_errno());
+    return E_NONE;
+}
+
+// ---- 共享内存传输（Linux，HOST 模式）----
+
+// 同主机进程间不经过内核 UDP 协议栈：每个发送进程拥有一个共享内存环形区域（shm_open，监听方只读映射），
+// 数据包（type=0/6）原样写入环形区；监听方通过登记表（/stdc_inst_<port>）发现发送方，
+// 并在登记表的 doorbell（futex）上等待。发送路径只有在有监听方休眠时才需要一次 futex 唤醒
+//
+// 环形区 = header(64) + data[size]；记录 = len(4) + reserved(4) + 数据包，8 字节对齐；len=0 表示回绕到开头
+// 发送方从不等待监听方：落后超过环形区大小的监听方丢弃被覆盖的记录
+
+#if P_LINUX
+#include <linux/futex.h>
+#include <signal.h>
+
+#define INST_SHM_SLOTS          256                                 // 登记表容量（发送进程数）
+#define INST_SHM_MAGIC          0x4D485349u                         // "ISHM"
+#define INST_SHM_REC_HDR        8
+#define INST_SHM_ALIGN(n)       (((n) + 7u) & ~7u)
+#define INST_SHM_GUARD          (INST_SHM_REC_HDR + INST_SHM_ALIGN(INST_UDP_MAX))   // 正在写入、尚未发布的最大长度
+#define INST_SHM_MIN            (64 * 1024)
+
+typedef struct {
+    volatile uint32_t           seq;                // doorbell（futex 字）
+    volatile uint32_t           armed;              // 有监听方准备休眠（发送方唤醒一次后清零）
+    uint32_t                    _pad[14];
+    struct {
+        volatile uint32_t       pid;                // 0 = 空闲
+        volatile uint32_t       gen;                // 每次登记/注销递增
+        volatile uint32_t       rid;
+        uint32_t                _pad;
+    }                           slots[INST_SHM_SLOTS];
+} inst_shm_reg_t;
+
+typedef struct {
+    uint32_t                    magic;
+    uint32_t                    pid;
+    uint32_t                    rid;
+    uint32_t                    size;               // data 区大小（8 的倍数）
+    volatile uint64_t           head;               // 已发布的写入位置（单调递增）
+    uint8_t                     _pad[40];
+} inst_shm_hdr_t;
+
+static struct {
+    inst_shm_reg_t*             reg;
+    inst_shm_hdr_t*             ring;               // 本进程的发送区域，NULL 表示未开启
+    uint8_t*                    data;
+    uint32_t                    size;
+    int                         slot;
+    bool                        mutex_init;
+    P_mutex_t                   mutex;              // 本进程多线程写入互斥
+    thd_t                       thread;             // 监听方读取线程
+    char                        name[64];
+}                               g_inst_shm = { .slot = -1 };
+
+#define inst_shm_active()       (g_inst_shm.ring && g_inst_mode == INST_MODE_HOST)
+
+static void inst_deliver(uint16_t rid, uint8_t *pkt, int len, uint64_t rx_us);
+
+static void inst_shm_name(char* name, size_t n, uint32_t pid) {
+    if (pid) snprintf(name, n, "/stdc_inst_%u_%u", (unsigned)g_inst_port, (unsigned)pid);
+    else snprintf(name, n, "/stdc_inst_%u", (unsigned)g_inst_port);
+}
+
+// 打开（或创建）登记表
+static inst_shm_reg_t* inst_shm_reg(void) {
+    if (g_inst_shm.reg) return g_inst_shm.reg;
+    char name[64]; inst_shm_name(name, sizeof(name), 0);
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);               // 仅同一用户的进程互相发现
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < (off_t)sizeof(inst_shm_reg_t) && ftruncate(fd, sizeof(inst_shm_reg_t)) < 0)) {
+        close(fd);
+        return NULL;
     }
-    // 格式化到 text 位置
-    else {
-        text_len = vsnprintf(text_pos, text_max, fmt, params);
-        if (text_len < 0) text_len = 0;
-        if (text_len >= text_max) text_len = text_max - 1;
+    void* p = mmap(NULL, sizeof(inst_shm_reg_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    inst_shm_reg_t* reg = (inst_shm_reg_t*)p, *expected = NULL;
+    if (!__atomic_compare_exchange_n(&g_inst_shm.reg, &expected, reg, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(p, sizeof(inst_shm_reg_t));
+        return expected;
     }
+    return reg;
+}
 
-    // 写入 tag + \0
-    if (tag_len > 0) memcpy(tag_pos, tag, tag_len);
-    tag_pos[tag_len] = '\0';
+static void inst_shm_ring_bell(inst_shm_reg_t* reg) {
+    P_get_and_inc_ord(&reg->seq, 1);
+    syscall(SYS_futex, &reg->seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
 
-    inst_send_buf(chn, buf, tag_len, text_len);
+// 写入一个数据包（持有 g_inst_shm.mutex 期间无系统调用），环形区已关闭时返回 false（由调用方改走 UDP）
+static bool inst_shm_put(const uint8_t* pkt, int len) {
+
+    P_mutex_lock(&g_inst_shm.mutex);
+    if (!g_inst_shm.ring) {                         // inst_shm_active() 之后被关闭
+        P_mutex_unlock(&g_inst_shm.mutex);
+        return false;
+    }
+    uint32_t need = INST_SHM_REC_HDR + INST_SHM_ALIGN((uint32_t)len), size = g_inst_shm.size;
+    uint64_t head = g_inst_shm.ring->head;
+    uint32_t pos = (uint32_t)(head % size);
+    if (size - pos < need) {                        // 尾部空间不足：写回绕标记，从头开始
+        *(uint32_t*)(g_inst_shm.data + pos) = 0;
+        head += size - pos;
+        pos = 0;
+    }
+    uint8_t* rec = g_inst_shm.data + pos;
+    memcpy(rec + INST_SHM_REC_HDR, pkt, (size_t)len);
+    *(uint32_t*)rec = (uint32_t)len;
+    P_set_ord(&g_inst_shm.ring->head, head + need);
+    P_mutex_unlock(&g_inst_shm.mutex);
+
+    // 只有监听方准备休眠时才唤醒，且每轮休眠只唤醒一次（与监听方的 armed 置位 + 重新检查 head 配对）
+    inst_shm_reg_t* reg = g_inst_shm.reg;
+    if (P_get_ord(&reg->armed) && P_get_and_set_ord(&reg->armed, 0)) inst_shm_ring_bell(reg);
+    return true;
+}
+
+static void inst_shm_close(void) {
+    if (!g_inst_shm.ring) return;
+    inst_shm_reg_t* reg = g_inst_shm.reg;
+    inst_shm_hdr_t* ring = g_inst_shm.ring;
+    P_mutex_lock(&g_inst_shm.mutex);                // 写入方持锁复查 ring：解锁后不再有写入，可以安全解除映射
+    g_inst_shm.ring = NULL;
+    P_mutex_unlock(&g_inst_shm.mutex);
+    if (g_inst_shm.slot >= 0) {
+        P_set_ord(&reg->slots[g_inst_shm.slot].pid, 0);
+        P_get_and_inc_ord(&reg->slots[g_inst_shm.slot].gen, 1);
+        g_inst_shm.slot = -1;
+        inst_shm_ring_bell(reg);
+    }
+    munmap(ring, sizeof(inst_shm_hdr_t) + g_inst_shm.size);
+    shm_unlink(g_inst_shm.name);                    // 已映射的监听方仍可读完剩余记录
 }
 
+ret_t
+instrument_shm(uint32_t size) {
+
+    if (!g_inst_shm.mutex_init) { P_mutex_init(&g_inst_shm.mutex); g_inst_shm.mutex_init = true; }
+    inst_shm_close();
+    if (!size) return E_NONE;
 
-static void inst_free_senders(void) {
-    inst_sender_t *s;
-    while ((s = g_inst_senders)) { g_inst_senders = s->next; free(s); }
+    if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())   // rid 由 socket 初始化时生成
+        return E_EXTERNAL(P_sock_errno());
+    inst_shm_reg_t* reg = inst_shm_reg();
+    if (!reg) return E_EXTERNAL(errno);
+
+    size = INST_SHM_ALIGN(size);
+    if (size < INST_SHM_MIN) size = INST_SHM_MIN;
+    uint32_t pid = (uint32_t)getpid();
+    inst_shm_name(g_inst_shm.name, sizeof(g_inst_shm.name), pid);
+    // 独占创建，仅同一用户可读（监听方须与发送方同一用户）；同名对象为同 pid 旧进程的残留，删除后重建
+    int fd = shm_open(g_inst_shm.name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        shm_unlink(g_inst_shm.name);
+        fd = shm_open(g_inst_shm.name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    }
+    if (fd < 0) return E_EXTERNAL(errno);
+    if (ftruncate(fd, (off_t)(sizeof(inst_shm_hdr_t) + size)) < 0) {
+        int err = errno; close(fd); shm_unlink(g_inst_shm.name);
+        return E_EXTERNAL(err);
+    }
+    void* p = mmap(NULL, sizeof(inst_shm_hdr_t) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) { shm_unlink(g_inst_shm.name); return E_EXTERNAL(errno); }
+
+    inst_shm_hdr_t* ring = (inst_shm_hdr_t*)p;
+    ring->pid   = pid;
+    ring->rid   = g_inst_rid;
+    ring->size  = size;
+    ring->head  = 0;
+    P_set_ord(&ring->magic, INST_SHM_MAGIC);
+
+    // 登记：占用空闲槽位，或回收已退出进程的槽位
+    for (int i = 0; i < INST_SHM_SLOTS; ++i) {
+        uint32_t old = P_get(&reg->slots[i].pid);
+        if (old && (kill((pid_t)old, 0) == 0 || errno != ESRCH)) continue;
+        if (!P_test_and_set(&reg->slots[i].pid, &old, pid)) continue;
+        reg->slots[i].rid = g_inst_rid;
+        P_get_and_inc_ord(&reg->slots[i].gen, 1);
+        g_inst_shm.slot = i;
+        break;
+    }
+    if (g_inst_shm.slot < 0) {
+        munmap(p, sizeof(inst_shm_hdr_t) + size);
+        shm_unlink(g_inst_shm.name);
+        return E_OUT_OF_CAPACITY;
+    }
+
+    g_inst_shm.size = size;
+    g_inst_shm.data = (uint8_t*)p + sizeof(inst_shm_hdr_t);
+    g_inst_shm.ring = ring;
+    inst_shm_ring_bell(reg);
+    return E_NONE;
 }
 
-static void inst_cleanup(void) {
-    g_inst_running = false;
-    if (g_inst_thread) {
-        P_join(g_inst_thread, NULL);
-        g_inst_thread = 0;
+// 监听方：每个登记槽位对应的只读映射
+typedef struct {
+    inst_shm_hdr_t*             hdr;
+    size_t                      map_len;
+    uint64_t                    tail;
+    uint32_t                    gen;
+    uint32_t                    pid;
+} inst_shm_peer_t;
+
+static void inst_shm_detach(inst_shm_peer_t* peer) {
+    if (peer->hdr) munmap(peer->hdr, peer->map_len);
+    peer->hdr = NULL;
+}
+
+static bool inst_shm_attach(inst_shm_peer_t* peer, uint32_t pid, uint32_t gen) {
+    char name[64]; inst_shm_name(name, sizeof(name), pid);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return false;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(inst_shm_hdr_t))
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return false;
+    inst_shm_hdr_t* hdr = (inst_shm_hdr_t*)p;
+    if (P_get_acq(&hdr->magic) != INST_SHM_MAGIC || hdr->pid != pid ||
+        sizeof(inst_shm_hdr_t) + hdr->size > (size_t)st.st_size) {
+        munmap(p, (size_t)st.st_size);
+        return false;
     }
-    if (g_inst_sock != P_INVALID_SOCKET) {
-        P_sock_close(g_inst_sock);
-        g_inst_sock = P_INVALID_SOCKET;
+    peer->hdr     = hdr;
+    peer->map_len = (size_t)st.st_size;
+    peer->tail    = P_get_acq(&hdr->head);          // 与 UDP 一致：只接收之后的记录
+    peer->gen     = gen;
+    peer->pid     = pid;
+    return true;
+}
+
+// 交付发送方已发布的记录，返回是否有新记录
+static bool inst_shm_drain(inst_shm_peer_t* peer, uint8_t* buf) {
+
+    inst_shm_hdr_t* hdr = peer->hdr;
+    const uint8_t* data = (const uint8_t*)hdr + sizeof(inst_shm_hdr_t);
+    uint32_t size = hdr->size, limit = size - INST_SHM_GUARD;
+    uint64_t head = P_get_acq(&hdr->head);
+    if (peer->tail == head) return false;
+
+    while (peer->tail != head) {
+        if (head - peer->tail > limit) {            // 落后太多，记录已被覆盖
+            log_printf(LOG_SLOT_WARN, "INSTRUMENT", "[%d] SHM rid=%u: overrun, %llu bytes dropped\n",
+                       g_inst_rid, hdr->rid, (unsigned long long)(head - peer->tail));
+            peer->tail = head;
+            break;
+        }
+        uint32_t pos = (uint32_t)(peer->tail % size);
+        uint32_t len = *(const uint32_t*)(data + pos);
+        if (!len) { peer->tail += size - pos; continue; }
+        if (len > INST_UDP_MAX) { peer->tail = head; break; }
+        memcpy(buf, data + pos + INST_SHM_REC_HDR, len);
+
+        // 拷贝期间可能被覆盖：确认发送方尚未写到该记录（否则按落后处理）
+        uint64_t now_head = P_get_acq(&hdr->head);
+        if (now_head - peer->tail > limit) { head = now_head; continue; }
+        peer->tail += INST_SHM_REC_HDR + INST_SHM_ALIGN(len);
+        if (len >= INST_HDR_SIZE + 2 && g_inst_cb) {
+            P_mutex_lock(&g_inst_rx_mutex);
+            inst_stat_rx(&g_inst_stat, (int)len, inst_now_ms());
+            g_inst_stat.in_order++;
+            inst_deliver((uint16_t)hdr->rid, buf, (int)len, inst_wall_us());
+            P_mutex_unlock(&g_inst_rx_mutex);
+        }
+        if (peer->tail == head) head = P_get_acq(&hdr->head);
     }
-    if (g_inst_bits) {
-        free(g_inst_bits);
-        g_inst_bits = NULL;
-        g_inst_bits_len = 0;
+    if (g_inst_cb) {                                // 聚合统计已更新
+        P_mutex_lock(&g_inst_rx_mutex);
+        inst_stats_publish();
+        P_mutex_unlock(&g_inst_rx_mutex);
     }
-    inst_free_senders();
+    return true;
+}
+
+// 监听方读取线程：轮询所有登记的发送方，无新记录时在 doorbell 上等待（100ms 超时检查退出）
+static int32_t inst_shm_proc(void* ctx) {
+    (void)ctx;
+    inst_shm_reg_t* reg = g_inst_shm.reg;
+    inst_shm_peer_t* peers = (inst_shm_peer_t*)calloc(INST_SHM_SLOTS, sizeof(inst_shm_peer_t));
+    if (!peers) return -1;
+    uint8_t buf[INST_UDP_MAX + 1];
+    uint32_t self = (uint32_t)getpid();
+    uint64_t checked = 0;
+
+    while (g_inst_running) {
+        uint32_t seq = P_get_ord(&reg->seq);
+        P_clock c; P_clock_now(&c);
+        uint64_t now = clock_ms(c);
+        bool check = now - checked >= 1000, busy = false;
+        if (check) checked = now;
+
+        for (int i = 0; i < INST_SHM_SLOTS; ++i) {
+            inst_shm_peer_t* peer = &peers[i];
+            uint32_t pid = P_get_acq(&reg->slots[i].pid), gen = P_get_acq(&reg->slots[i].gen);
+
+            // 发送方注销或槽位被重新登记：读完剩余记录后解除映射
+            if (peer->hdr && (peer->gen != gen || peer->pid != pid)) {
+                inst_shm_drain(peer, buf);
+                inst_shm_detach(peer);
+            }
+            if (!pid || pid == self) continue;
+            if (!peer->hdr && !inst_shm_attach(peer, pid, gen)) continue;
+            busy |= inst_shm_drain(peer, buf);
+
+            // 发送进程崩溃未注销：回收槽位
+            if (check && kill((pid_t)pid, 0) < 0 && errno == ESRCH) {
+                inst_shm_drain(peer, buf);
+                inst_shm_detach(peer);
+                if (P_test_and_set(&reg->slots[i].pid, &pid, 0)) {
+                    P_get_and_inc_ord(&reg->slots[i].gen, 1);
+                    char name[64]; inst_shm_name(name, sizeof(name), pid);
+                    shm_unlink(name);
+                }
+            }
+        }
+        if (busy) continue;
+
+        // 休眠前先置位 armed，再确认确实没有新记录（避免与发送方的唤醒判断错过）
+        P_set_ord(&reg->armed, 1);
+        for (int i = 0; i < INST_SHM_SLOTS && !busy; ++i)
+            busy = peers[i].hdr && P_get_ord(&peers[i].hdr->head) != peers[i].tail;
+        if (!busy && P_get_ord(&reg->seq) == seq) {
+            struct timespec ts = { 0, 100 * 1000000 };
+            syscall(SYS_futex, &reg->seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+        }
+    }
+
+    for (int i = 0; i < INST_SHM_SLOTS; ++i) inst_shm_detach(&peers[i]);
+    free(peers);
+    return 0;
+}
+
+// 启动监听方读取线程（instrument_listen 调用）
+static void inst_shm_listen(void) {
+    if (g_inst_shm.thread || g_inst_mode != INST_MODE_HOST || !inst_shm_reg()) return;
+    if (P_thread(&g_inst_shm.thread, inst_shm_proc, NULL, P_THD_BACKGROUND, 0) != E_NONE)
+        g_inst_shm.thread = 0;
 }
 
-// 确保 bitset 能容纳指定字节偏移
-static void inst_bits_reserve(uint16_t byte_idx) {
-    uint16_t need = byte_idx + 1;
-    if (need <= g_inst_bits_len) return;
+static void inst_shm_stop(void) {
+    if (g_inst_shm.thread) {
+        P_join(g_inst_shm.thread, NULL);
+        g_inst_shm.thread = 0;
+    }
+    inst_shm_close();
+}
 
-    uint8_t *new_bits = (uint8_t*)realloc(g_inst_bits, need);
-    if (!new_bits) return;
+#else
+#define inst_shm_active()       false
+#define inst_shm_put(pkt, len)  false
+#define inst_shm_listen()       ((void)0)
 
-    // 新增部分初始化为 0
-    memset(new_bits + g_inst_bits_len, 0, need - g_inst_bits_len);
-    g_inst_bits = new_bits;
-    g_inst_bits_len = need;
+ret_t
+instrument_shm(uint32_t size) {
+    return size ? E_NO_SUPPORT : E_NONE;
 }
+#endif
 
-// 初始化 socket（仅网络，不启动线程）
-// 前置条件：g_inst_sock == P_INVALID_SOCKET（调用处判断）
-// 纯发送场景（instrument_set/instrument_slot）只需调用此函数
-static bool inst_init_sock(void) {
+// 分配数据包 seq：共享内存传输的包由监听方直接交付、不经过 UDP 接收窗口，因此使用独立的计数，
+// 之后切换回 UDP 时监听方不会看到 seq 空洞（否则要等窗口滑过或 NACK 放弃才能继续交付）
+static inline uint16_t inst_seq_next(void) {
+    if (inst_shm_active()) return (uint16_t)P_get_and_inc(&g_inst_shm_sent, 1);
+    return (uint16_t)P_get_and_inc(&g_inst_seq, 1);
+}
 
-    assert(g_inst_sock == P_INVALID_SOCKET);
+// ---- 重传（可靠模式）----
 
-    g_inst_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (g_inst_sock == P_INVALID_SOCKET) return false;
+// 发送方按 seq 保留最近 depth 个数据包，收到 type=7 NACK 时重发 bitmap 标记的包
+// 数据包 type 带 INST_TYPE_RELIABLE 标志，接收方据此决定对空洞发 NACK 还是直接等待窗口滑过
+typedef struct {
+    uint16_t                    seq;
+    uint16_t                    len;                // 0 表示空槽
+    uint8_t                     data[INST_UDP_MAX];
+} inst_rtx_slot_t;
+
+static struct {
+    P_mutex_t                   mutex;
+    bool                        init;
+    uint32_t                    mask;               // depth - 1，0 表示关闭
+    inst_rtx_slot_t*            slots;
+} g_inst_rtx;
+
+// 发送前调用：打上可靠标志并保存副本
+static void inst_rtx_keep(uint8_t* pkt, int len) {
+    if (!P_get(&g_inst_rtx.mask)) return;
+    pkt[4] |= INST_TYPE_RELIABLE;
+    P_mutex_lock(&g_inst_rtx.mutex);
+    if (g_inst_rtx.mask) {
+        uint16_t seq = nget_s(pkt + 2);
+        inst_rtx_slot_t* slot = &g_inst_rtx.slots[seq & g_inst_rtx.mask];
+        slot->seq = seq;
+        slot->len = (uint16_t)len;
+        memcpy(slot->data, pkt, len);
+    }
+    P_mutex_unlock(&g_inst_rtx.mutex);
+}
 
-    int opt = 1;
-    setsockopt(g_inst_sock, SOL_SOCKET, SO_BROADCAST, (const char*)&opt, sizeof(opt));
-    setsockopt(g_inst_sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
-#ifdef SO_REUSEPORT
-    setsockopt(g_inst_sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&opt, sizeof(opt));
+// 处理 NACK：bits 为 8 字节 bitmap，bit i 表示 base+i 缺失；已被覆盖的包不再重发（接收方超时后跳过）
+static void inst_rtx_resend(uint16_t base, const uint8_t* bits) {
+    if (!P_get(&g_inst_rtx.mask)) return;
+    P_mutex_lock(&g_inst_rtx.mutex);
+    for (int i = 0; g_inst_rtx.mask && i < INST_WINDOW_SIZE; ++i) {
+        if (!(bits[i >> 3] & (1u << (i & 7)))) continue;
+        uint16_t seq = (uint16_t)(base + i);
+        inst_rtx_slot_t* slot = &g_inst_rtx.slots[seq & g_inst_rtx.mask];
+        if (!slot->len || slot->seq != seq) continue;
+        sendto(g_inst_sock, (const char*)slot->data, slot->len, 0,
+               (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+    }
+    P_mutex_unlock(&g_inst_rtx.mutex);
+}
+
+ret_t
+instrument_reliable(uint32_t depth) {
+
+    if (depth & (depth - 1)) return E_INVALID;
+    if (!g_inst_rtx.init) {
+        P_mutex_init(&g_inst_rtx.mutex);
+        g_inst_rtx.init = true;
+    }
+
+    inst_rtx_slot_t* slots = NULL;
+    if (depth) {
+        if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())
+            return E_EXTERNAL(P_sock_errno());
+        // NACK 由接收线程处理
+        if (!g_inst_thread && !inst_start_thread()) return E_NO_SUPPORT;
+        if (!(slots = (inst_rtx_slot_t*)calloc(depth, sizeof(inst_rtx_slot_t)))) return E_OUT_OF_MEMORY;
+    }
+
+    P_mutex_lock(&g_inst_rtx.mutex);
+    inst_rtx_slot_t* old = g_inst_rtx.slots;
+    g_inst_rtx.slots = slots;
+    P_set(&g_inst_rtx.mask, depth ? depth - 1 : 0);
+    P_mutex_unlock(&g_inst_rtx.mutex);
+    free(old);
+    return E_NONE;
+}
+
+// ---- 异步发送 ----
+
+// 调用线程把准备好的包拷贝进有界无锁 MPSC 环后立即返回，由发送线程批量取出、独占 socket 写入
+// 两个环：高优先级环（控制包 WAIT/CONTINUE/REQ/RESP 及 instrument_priority 指定的通道）总是先于普通环发送
+// 普通环满时丢弃并计数（接收方表现为 seq 空洞）；高优先级环满时由调用线程直接发送，不丢弃
+typedef struct {
+    uint32_t                    seq;                // 等于槽位序号 + 1 时表示已写入，等待发送线程取出
+    uint16_t                    len;
+    uint8_t                     data[INST_UDP_MAX];
+} inst_async_cell_t;
+
+typedef struct {
+    uint32_t                    tail;               // 生产方：下一个写入位置（CAS 抢占）
+    uint8_t                     pad[60];            // 与消费方字段分处不同缓存行
+    uint32_t                    head;               // 发送线程：下一个读取位置
+    uint32_t                    mask;
+    inst_async_cell_t*          cells;
+} inst_async_ring_t;
+
+static struct {
+    volatile int                on;                 // 是否入队（0 时调用线程直接发送）
+    volatile int                running;            // 发送线程是否运行
+    volatile int                idle;               // 发送线程即将休眠，生产方需要唤醒
+    thd_t                       thread;
+    P_mutex_t                   mutex;
+    P_cond_t                    cond;
+    bool                        init;
+    inst_async_ring_t           ring[2];            // [0] 普通，[1] 高优先级
+    uint64_t                    sent;               // 只由发送线程写入
+    uint32_t                    dropped;
+    uint32_t                    overflow;
+} g_inst_async;
+
+static uint32_t                 g_inst_prio[8];                     // 高优先级通道 bitset
+
+static bool inst_async_ring_init(inst_async_ring_t* r, uint32_t depth) {
+    if (!(r->cells = (inst_async_cell_t*)malloc(sizeof(inst_async_cell_t) * depth))) return false;
+    for (uint32_t i = 0; i < depth; ++i) r->cells[i].seq = i;
+    r->tail = r->head = 0;
+    r->mask = depth - 1;
+    return true;
+}
+
+// 生产方：写入一个包，环满时返回 false
+static bool inst_async_ring_put(inst_async_ring_t* r, const uint8_t* pkt, int len) {
+    uint32_t pos = P_get(&r->tail);
+    inst_async_cell_t* cell;
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        int32_t dif = (int32_t)(P_get_acq(&cell->seq) - pos);
+        if (dif == 0) { if (P_test_and_set(&r->tail, &pos, pos + 1)) break; }  // 失败时 pos 已更新为最新值
+        else if (dif < 0) return false;             // 槽位尚未被发送线程释放：环满
+        else pos = P_get(&r->tail);
+    }
+    cell->len = (uint16_t)len;
+    memcpy(cell->data, pkt, len);
+    P_set_ord(&cell->seq, pos + 1);                 // 与发送线程的 idle 标志构成 store-load 顺序，保证不漏唤醒
+    return true;
+}
+
+// 发送线程：取出最多 max 个已写入的包（不释放槽位），返回个数
+static int inst_async_ring_peek(inst_async_ring_t* r, uint8_t** pkts, int* lens, int max) {
+    int n = 0;
+    for (; n < max; ++n) {
+        uint32_t pos = r->head + (uint32_t)n;
+        inst_async_cell_t* cell = &r->cells[pos & r->mask];
+        if (P_get_ord(&cell->seq) != pos + 1) break;
+        pkts[n] = cell->data;
+        lens[n] = cell->len;
+    }
+    return n;
+}
+
+// 发送线程：释放已发送的 n 个槽位
+static void inst_async_ring_pop(inst_async_ring_t* r, int n) {
+    for (int i = 0; i < n; ++i, ++r->head)
+        P_set_rel(&r->cells[r->head & r->mask].seq, r->head + r->mask + 1);
+}
+
+static uint32_t inst_async_pending(void) {
+    return (P_get(&g_inst_async.ring[0].tail) - P_get(&g_inst_async.ring[0].head)) +
+           (P_get(&g_inst_async.ring[1].tail) - P_get(&g_inst_async.ring[1].head));
+}
+
+// 一次发送多个包：Linux 使用 sendmmsg（一次系统调用），其他平台或不支持时逐个 sendto
+static void inst_sendv_sock(uint8_t* const* pkts, const int* lens, int cnt) {
+#if P_LINUX && defined(MSG_WAITFORONE)
+    static bool no_mmsg = false;
+    if (cnt > 1 && !no_mmsg) {
+        struct mmsghdr msgs[INST_SEND_BATCH];
+        struct iovec iovs[INST_SEND_BATCH];
+        int done = 0;
+        while (done < cnt) {
+            int m = cnt - done < INST_SEND_BATCH ? cnt - done : INST_SEND_BATCH;
+            memset(msgs, 0, sizeof(msgs[0]) * m);
+            for (int i = 0; i < m; ++i) {
+                iovs[i].iov_base = pkts[done + i];
+                iovs[i].iov_len  = (size_t)lens[done + i];
+                msgs[i].msg_hdr.msg_name    = &g_inst_dest;
+                msgs[i].msg_hdr.msg_namelen = sizeof(g_inst_dest);
+                msgs[i].msg_hdr.msg_iov     = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen  = 1;
+            }
+            int r = sendmmsg(g_inst_sock, msgs, (unsigned)m, 0);
+            if (r < 0 && errno == ENOSYS) { no_mmsg = true; break; }
+            done += r > 0 ? r : 1;                  // 出错的包丢弃（与 sendto 行为一致）
+        }
+        if (done >= cnt) return;
+        pkts += done; lens += done; cnt -= done;
+    }
 #endif
+    for (int i = 0; i < cnt; ++i)
+        sendto(g_inst_sock, (const char*)pkts[i], lens[i], 0,
+               (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+}
 
-    // bind 到指定端口（收发共用）
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family      = AF_INET;
-    addr.sin_port        = htons(g_inst_port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(g_inst_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        P_sock_close(g_inst_sock);
-        g_inst_sock = P_INVALID_SOCKET;
-        return false;
+// 发送一个 UDP 包：异步模式下入队（返回后 pkt 可复用），否则直接 sendto
+static void inst_sendto(const uint8_t* pkt, int len, bool high) {
+    if (P_get(&g_inst_async.on)) {
+        if (inst_async_ring_put(&g_inst_async.ring[high], pkt, len)) {
+            if (P_get_ord(&g_inst_async.idle)) {
+                P_mutex_lock(&g_inst_async.mutex);
+                P_cond_one(&g_inst_async.cond);
+                P_mutex_unlock(&g_inst_async.mutex);
+            }
+            return;
+        }
+        if (!high) { P_get_and_inc(&g_inst_async.dropped, 1); return; }
+        P_get_and_inc(&g_inst_async.overflow, 1);
     }
+    sendto(g_inst_sock, (const char*)pkt, len, 0, (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+}
 
-    // 组播设置：
-    // - 加入组播组，确保能接收发往该组播地址的消息
-    // - 启用组播回环，使本机发送的消息也能被本机其他进程收到
-    // 注：单播 + SO_REUSEPORT 在 macOS/Linux 上是负载均衡（只有一个进程收到），
-    //     组播是真正的一对多广播，所有加入组的进程都能收到
-    struct ip_mreq mreq;
-    mreq.imr_multiaddr.s_addr = htonl(INST_MCAST_ADDR);
-    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-    setsockopt(g_inst_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq, sizeof(mreq));
-    unsigned char loop = 1;
-    setsockopt(g_inst_sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop));
+// 数据包的优先级由通道决定
+static inline bool inst_chn_high(uint8_t chn) {
+    return (P_get(&g_inst_prio[chn / 32]) >> (chn % 32)) & 1;
+}
 
-    // 目标地址：
-    // - HOST 模式：组播地址（本机所有进程可见）
-    // - REMOTE 模式：广播地址（局域网可见）
-    memset(&g_inst_dest, 0, sizeof(g_inst_dest));
-    g_inst_dest.sin_family      = AF_INET;
-    g_inst_dest.sin_port        = htons(g_inst_port);
-    g_inst_dest.sin_addr.s_addr = (g_inst_mode == INST_MODE_REMOTE)
-                                    ? htonl(INADDR_BROADCAST)
-                                    : htonl(INST_MCAST_ADDR);  // 组播地址
+// 发送线程：先清空高优先级环，再每次取一批普通包（sendmmsg），批间重新检查高优先级环
+static int32_t inst_async_proc(void* ctx) {
+    (void)ctx;
+    uint8_t* pkts[INST_SEND_BATCH];
+    int lens[INST_SEND_BATCH];
+    for (;;) {
+        int n, total = 0;
+        while ((n = inst_async_ring_peek(&g_inst_async.ring[1], pkts, lens, INST_SEND_BATCH))) {
+            inst_sendv_sock(pkts, lens, n);
+            inst_async_ring_pop(&g_inst_async.ring[1], n);
+            total += n;
+        }
+        if ((n = inst_async_ring_peek(&g_inst_async.ring[0], pkts, lens, INST_SEND_BATCH))) {
+            inst_sendv_sock(pkts, lens, n);
+            inst_async_ring_pop(&g_inst_async.ring[0], n);
+            total += n;
+        }
+        if (total) { g_inst_async.sent += (uint64_t)total; continue; }
+        if (!P_get(&g_inst_async.running)) break;   // 退出前已发送全部排队的包
+
+        // 两个环都为空：先置 idle 再复查，生产方写入后看到 idle 即唤醒
+        P_mutex_lock(&g_inst_async.mutex);
+        P_set_ord(&g_inst_async.idle, 1);
+        if (!inst_async_ring_peek(&g_inst_async.ring[1], pkts, lens, 1) &&
+            !inst_async_ring_peek(&g_inst_async.ring[0], pkts, lens, 1) && P_get(&g_inst_async.running)) {
+            P_clock timeout = { 0, 100 * 1000000 };
+            P_wait_timeout(&g_inst_async.cond, &g_inst_async.mutex, &timeout);
+        }
+        P_set(&g_inst_async.idle, 0);
+        P_mutex_unlock(&g_inst_async.mutex);
+    }
+    return 0;
+}
+
+// 等待发送线程发出所有排队的包（最多约 1 秒）
+static void inst_async_drain(void) {
+    for (int i = 0; i < 10000 && g_inst_async.thread && inst_async_pending(); ++i) P_usleep(100);
+}
+
+static void inst_async_stop(void) {
+    P_set(&g_inst_async.on, 0);
+    if (!g_inst_async.thread) return;
+    P_mutex_lock(&g_inst_async.mutex);
+    P_set(&g_inst_async.running, 0);
+    P_cond_one(&g_inst_async.cond);
+    P_mutex_unlock(&g_inst_async.mutex);
+    P_join(g_inst_async.thread, NULL);
+    g_inst_async.thread = 0;                        // 不释放环：生产方可能仍在 inst_async_ring_put 中，再次开启时沿用
+}
+
+ret_t
+instrument_async(uint32_t depth) {
+
+    if (depth & (depth - 1)) return E_INVALID;
+    if (!depth) { P_set(&g_inst_async.on, 0); return E_NONE; }     // 已排队的包由发送线程继续发出
+    if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())
+        return E_EXTERNAL(P_sock_errno());
+    if (!g_inst_async.init) {
+        P_mutex_init(&g_inst_async.mutex);
+        P_cond_init(&g_inst_async.cond);
+        g_inst_async.init = true;
+    }
+
+    // 环只在首次开启时分配且不再释放（生产方可能仍持有旧环的槽位），之后的调用只切换开关
+    if (!g_inst_async.ring[1].cells) {
+        if (!inst_async_ring_init(&g_inst_async.ring[0], depth < 2 ? 2 : depth) ||
+            !inst_async_ring_init(&g_inst_async.ring[1], INST_ASYNC_HIGH)) {
+            free(g_inst_async.ring[0].cells); g_inst_async.ring[0].cells = NULL;
+            return E_OUT_OF_MEMORY;
+        }
+    }
+    if (!g_inst_async.thread) {
+        g_inst_async.running = 1;
+        if (P_thread(&g_inst_async.thread, inst_async_proc, NULL, P_THD_BACKGROUND, 0) != E_NONE) {
+            g_inst_async.running = 0;
+            g_inst_async.thread = 0;
+            return E_NO_SUPPORT;
+        }
+    }
+    P_set(&g_inst_async.on, 1);
+    return E_NONE;
+}
 
-    // 生成随机 rid
-    g_inst_rid = (uint16_t)(P_tick_us() ^ (uintptr_t)&g_inst_sock);
+void
+instrument_priority(uint8_t chn, bool high) {
+    uint32_t* w = &g_inst_prio[chn / 32];
+    uint32_t old = P_get(w), nv;
+    do nv = high ? old | (1u << (chn % 32)) : old & ~(1u << (chn % 32));
+    while (!P_test_and_set(w, &old, nv));
+}
 
-    // 设置接收超时（100ms），供线程周期性检查 g_inst_running
-    P_sock_rcvtimeo(g_inst_sock, 100);
+void
+instrument_async_stat(instrument_async_stat_t* out) {
+    out->depth    = g_inst_async.thread ? g_inst_async.ring[0].mask + 1 : 0;
+    out->pending  = g_inst_async.thread ? inst_async_pending() : 0;
+    out->sent     = g_inst_async.sent;
+    out->dropped  = P_get(&g_inst_async.dropped);
+    out->overflow = P_get(&g_inst_async.overflow);
+}
 
-    // 增大接收缓冲区（默认通常 ~200KB，高频发送时容易溢出丢包）
-    int rcvbuf = 1024 * 1024;  // 1MB
-    setsockopt(g_inst_sock, SOL_SOCKET, SO_RCVBUF, (const char*)&rcvbuf, sizeof(rcvbuf));
+// ---- 批量发送 ----
 
-    atexit(inst_cleanup);
-    return true;
+// 多条记录打包为一个 type=6 包：header(7, chn=0, tag_len=0) + N * [chn(1) + tag_len(1) + text_len(2) + tag + \0 + text] [+ send_us(8)]
+// 包满、超过 deadline（由冲刷线程检查）或 instrument_flush() 时发送
+typedef struct {
+    P_mutex_t                   mutex;
+    int                         len;                // 已写入的记录长度（header 之后）
+    uint64_t                    first;              // 首条记录时间 (us)
+    uint8_t                     pkt[INST_UDP_MAX];
+} inst_batch_t;
+
+static inst_batch_t             g_inst_batch[INST_BATCH_SHARDS];
+static bool                     g_inst_batch_init = false;
+static volatile bool            g_inst_batch_running = false;
+static thd_t                    g_inst_batch_thread = 0;
+static uint32_t                 g_inst_batch_next = 0;              // 下一个分配的缓冲区
+static TLS int                  g_inst_batch_idx = -1;              // 本线程使用的缓冲区
+
+// 发送多个数据包：共享内存传输时写入环形区，否则保存重传副本后异步入队或直接批量发送
+static void inst_sendv(uint8_t* const* pkts, const int* lens, int cnt, bool high) {
+    if (inst_shm_active()) {
+        int i = 0;
+        while (i < cnt && inst_shm_put(pkts[i], lens[i])) ++i;
+        if (i == cnt) return;
+        pkts += i; lens += i; cnt -= i;             // 环形区刚被关闭：其余的包重新分配 seq 后改走 UDP
+        for (int k = 0; k < cnt; ++k) { uint16_t seq = (uint16_t)P_get_and_inc(&g_inst_seq, 1); nwrite_s(pkts[k] + 2, seq); }
+    }
+    for (int i = 0; i < cnt; ++i) inst_rtx_keep(pkts[i], lens[i]);
+    if (P_get(&g_inst_async.on)) for (int i = 0; i < cnt; ++i) inst_sendto(pkts[i], lens[i], high);
+    else inst_sendv_sock(pkts, lens, cnt);
 }
 
-static int32_t inst_thread_proc(void *ctx);  // 前向声明
+// 填写批量包 header 并分配 seq，返回包长度（需持有 b->mutex）
+static int inst_batch_seal(inst_batch_t* b) {
+    uint8_t* pkt = b->pkt;
+    nwrite_s(pkt, g_inst_rid);                      // rid
+    uint16_t seq = inst_seq_next();
+    nwrite_s(pkt + 2, seq);                         // seq
+    pkt[4] = 6;                                     // type=6 批量包
+    pkt[5] = 0;
+    pkt[6] = 0;
+    int len = INST_HDR_SIZE + b->len;
+    // 发送时间戳（开启前已写满的包不带）
+    if (P_get(&g_inst_stamp) && b->len + INST_STAMP_SIZE <= INST_PAYLOAD_MAX) len = inst_stamp_put(pkt, len);
+    return len;
+}
 
-// 启动接收线程（监听场景需要）
-// 前置条件：g_inst_sock 已初始化，g_inst_thread == 0（调用处判断）
-// instrument_listen/instrument_get 需要调用此函数以接收其他进程的消息
-static bool inst_start_thread(void) {
+// 发送批量包（需持有 b->mutex）
+static void inst_batch_send(inst_batch_t* b) {
+    if (!b->len) return;
+    uint8_t* pkt = b->pkt;
+    int len = inst_batch_seal(b);
+    inst_sendv(&pkt, &len, 1, false);
+    b->len = 0;
+}
 
-    assert(g_inst_sock != P_INVALID_SOCKET);
-    assert(g_inst_thread == 0);
+static inst_batch_t* inst_batch_own(void) {
+    if (g_inst_batch_idx < 0) g_inst_batch_idx = (int)(P_get_and_inc(&g_inst_batch_next, 1) % INST_BATCH_SHARDS);
+    return &g_inst_batch[g_inst_batch_idx];
+}
 
-    g_inst_running = true;
-    if (P_thread(&g_inst_thread, inst_thread_proc, NULL, P_THD_BACKGROUND, 0) != E_NONE) {
-        g_inst_running = false;
-        return false;
-    }
+// 追加一条记录，记录超过单包容量时返回 false（由调用方直接发送）
+static bool inst_batch_put(uint8_t chn, const char* tag, int tag_len, const char* text, int text_len) {
+
+    int rec_len = INST_BATCH_REC_HDR + tag_len + 1 + text_len;
+    int cap = INST_PAYLOAD_MAX - (P_get(&g_inst_stamp) ? INST_STAMP_SIZE : 0);
+    if (rec_len > cap) return false;
+
+    inst_batch_t* b = inst_batch_own();
+    P_mutex_lock(&b->mutex);
+    if (b->len + rec_len > cap) inst_batch_send(b);
+    if (!b->len) b->first = P_tick_us();
+
+    uint8_t* p = b->pkt + INST_HDR_SIZE + b->len;
+    p[0] = chn;
+    p[1] = (uint8_t)tag_len;
+    nwrite_s(p + 2, (uint16_t)text_len);
+    memcpy(p + INST_BATCH_REC_HDR, tag, tag_len);
+    p[INST_BATCH_REC_HDR + tag_len] = '\0';
+    memcpy(p + INST_BATCH_REC_HDR + tag_len + 1, text, text_len);
+    b->len += rec_len;
+
+    // 批量模式已关闭（并发切换）时立即发送
+    if (!P_get(&g_inst_batch_us)) inst_batch_send(b);
+    P_mutex_unlock(&b->mutex);
     return true;
 }
 
-// ---- 选项机制 ----
+static void inst_batch_flush_own(void) {
+    inst_batch_t* b = inst_batch_own();
+    P_mutex_lock(&b->mutex);
+    inst_batch_send(b);
+    P_mutex_unlock(&b->mutex);
+}
 
-// 发送 type=1 包：header(7) + offset(2) + byte(1)
-// 包格式与 type=0 统一使用 INST_HDR_SIZE header，便于接收端统一处理
-static void inst_send_bits(uint16_t byte_idx) {
-    if (g_inst_sock == P_INVALID_SOCKET) return;
-    if (byte_idx >= g_inst_bits_len) return;
+// 冲刷缓冲区：age_us 为 0 时冲刷全部，否则只冲刷首条记录已超过 age_us 的
+// 到期的缓冲区一起锁定后用 inst_sendv 一次发出（按缓冲区序号加锁，不会死锁）
+static void inst_batch_flush(uint32_t age_us) {
+    if (!g_inst_batch_init || g_inst_sock == P_INVALID_SOCKET) return;
+    uint64_t now = age_us ? P_tick_us() : 0;
+    inst_batch_t* due[INST_BATCH_SHARDS];
+    uint8_t* pkts[INST_BATCH_SHARDS];
+    int lens[INST_BATCH_SHARDS], cnt = 0;
+    for (int i = 0; i < INST_BATCH_SHARDS; ++i) {
+        inst_batch_t* b = &g_inst_batch[i];
+        if (!P_get(&b->len)) continue;
+        P_mutex_lock(&b->mutex);
+        if (b->len && (!age_us || now - b->first >= age_us)) {
+            due[cnt] = b;
+            pkts[cnt] = b->pkt;
+            lens[cnt++] = inst_batch_seal(b);
+        }
+        else P_mutex_unlock(&b->mutex);
+    }
+    if (!cnt) return;
+    inst_sendv(pkts, lens, cnt, false);
+    for (int i = 0; i < cnt; ++i) {
+        due[i]->len = 0;
+        P_mutex_unlock(&due[i]->mutex);
+    }
+}
 
-    uint8_t pkt[INST_HDR_SIZE + 3];
-    nwrite_s(pkt, g_inst_rid);                      // rid
-    nwrite_s(pkt + 2, 0);                           // seq（选项包不占序列号）
-    pkt[4] = 1;                                     // type=1 选项包
-    pkt[5] = 0;                                     // chn（未使用，占位）
-    pkt[6] = 0;                                     // tag_len（未使用，占位）
-    // payload: offset(2) + byte(1)
-    nwrite_s(pkt + INST_HDR_SIZE, byte_idx);
-    pkt[INST_HDR_SIZE + 2] = g_inst_bits[byte_idx];
+// 冲刷线程：按 deadline 的一半周期检查各缓冲区
+static int32_t inst_batch_proc(void* ctx) {
+    (void)ctx;
+    while (P_get(&g_inst_batch_running)) {
+        uint32_t us = P_get(&g_inst_batch_us);
+        uint32_t period = us / 2;
+        if (period < 500) period = 500;
+        if (period > 100000 || !us) period = 100000;
+        P_usleep(period);
+        if (us) inst_batch_flush(us);
+    }
+    return 0;
+}
 
-    sendto(g_inst_sock, (const char*)pkt, sizeof(pkt), 0,
-           (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+static void inst_batch_stop(void) {
+    if (g_inst_batch_thread) {
+        g_inst_batch_running = false;
+        P_join(g_inst_batch_thread, NULL);
+        g_inst_batch_thread = 0;
+    }
+    inst_batch_flush(0);
 }
 
 ret_t
-instrument_set(uint16_t idx, bool enable) {
+instrument_batch(uint32_t deadline_us) {
 
-    // 发送操作：只需初始化 socket，不启动接收线程
+    if (!g_inst_batch_init) {
+        for (int i = 0; i < INST_BATCH_SHARDS; ++i) P_mutex_init(&g_inst_batch[i].mutex);
+        g_inst_batch_init = true;
+    }
     if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())
         return E_EXTERNAL(P_sock_errno());
 
-    uint16_t byte_idx = idx / 8; uint8_t  bit_mask = (uint8_t)(1u << (idx % 8));
-
-    inst_bits_reserve(byte_idx);
-    if (byte_idx >= g_inst_bits_len) return E_OUT_OF_MEMORY;
-
-    if (enable)
-        g_inst_bits[byte_idx] |= bit_mask;
-    else
-        g_inst_bits[byte_idx] &= ~bit_mask;
-
-    inst_send_bits(byte_idx);
+    P_set(&g_inst_batch_us, deadline_us);
+    if (!deadline_us) {
+        inst_batch_flush(0);
+        return E_NONE;
+    }
+    if (!g_inst_batch_thread) {
+        g_inst_batch_running = true;
+        if (P_thread(&g_inst_batch_thread, inst_batch_proc, NULL, P_THD_BACKGROUND, 0) != E_NONE) {
+            g_inst_batch_running = false;
+            g_inst_batch_thread = 0;
+            P_set(&g_inst_batch_us, 0);
+            return E_NO_SUPPORT;
+        }
+    }
     return E_NONE;
 }
 
-bool
-instrument_get(uint16_t idx) {
+void
+instrument_flush(void) {
+    inst_batch_flush(0);
+    inst_metrics_flush();
+    inst_async_drain();
+}
 
-    // 监听操作：需要启动接收线程以接收其他进程的选项包
-    if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock()) return false;
-    if (g_inst_thread == 0 && !inst_start_thread()) return false;
+// ---- 消息机制 ----
 
-    uint16_t byte_idx = idx / 8;
-    if (byte_idx >= g_inst_bits_len) return false;
-    return (g_inst_bits[byte_idx] & (1u << (idx % 8))) != 0;
+// 超过单包容量的完整包（header + payload）切分为 type=8 分片：
+// header(7, chn=内层包类型, tag_len=0) + msg_id(2) + idx(2) + cnt(2) + 数据
+// ordered: 数据包的分片占用 seq，按窗口顺序交付后重组；控制包（REQ/RESP）的分片不占 seq，始终走 UDP，
+// 重组后按普通控制包处理（重发由 REQ 机制负责）
+// tail: 逻辑上接在 pkt 之后的数据（时间戳），nullable
+static void inst_send_frags(const uint8_t* pkt, int len, bool ordered, const uint8_t* tail, int tail_len) {
+    static TLS uint8_t frag[INST_SEND_BATCH][INST_UDP_MAX];
+    uint8_t* pkts[INST_SEND_BATCH];
+    int lens[INST_SEND_BATCH], k = 0;
+    int total = len + tail_len;                     // tail 逻辑上接在 pkt 之后
+    int cnt = (total + INST_FRAG_CHUNK - 1) / INST_FRAG_CHUNK;
+    uint16_t id = (uint16_t)P_get_and_inc(&g_inst_frag_id, 1);
+    for (int i = 0; i < cnt; ++i) {
+        int off = i * INST_FRAG_CHUNK;
+        int n = total - off < INST_FRAG_CHUNK ? total - off : INST_FRAG_CHUNK;
+        int a = off >= len ? 0 : (len - off < n ? len - off : n);       // 取自 pkt 的部分
+        uint8_t* f = frag[k];
+        uint16_t seq = ordered ? inst_seq_next() : 0;
+        nwrite_s(f, g_inst_rid);                    // rid
+        nwrite_s(f + 2, seq);                       // seq
+        f[4] = 8;                                   // type=8 分片包
+        f[5] = pkt[4] & INST_TYPE_MASK;             // 内层包类型
+        f[6] = 0;
+        nwrite_s(f + INST_HDR_SIZE, id);            // msg_id
+        nwrite_s(f + INST_HDR_SIZE + 2, (uint16_t)i);
+        nwrite_s(f + INST_HDR_SIZE + 4, (uint16_t)cnt);
+        if (a) memcpy(f + INST_FRAG_HDR, pkt + off, a);
+        if (a < n) memcpy(f + INST_FRAG_HDR + a, tail + (off + a - len), n - a);
+        pkts[k] = f;
+        lens[k++] = INST_FRAG_HDR + n;
+        if (k < INST_SEND_BATCH && i < cnt - 1) continue;
+        if (ordered) inst_sendv(pkts, lens, k, inst_chn_high(pkt[5]));
+        else inst_sendv_sock(pkts, lens, k);       // 控制包分片不经过高优先级环：环满时部分分片直接发送会打乱顺序，重组失败
+        k = 0;
+    }
 }
 
-// ---- 消息机制 ----
+// 发送控制包（REQ/RESP），超过单包容量时分片
+static void inst_send_ctrl(const uint8_t* pkt, int len) {
+    if (len > INST_UDP_MAX) inst_send_frags(pkt, len, false, NULL, 0);
+    else inst_sendto(pkt, len, true);
+}
 
 // 内部函数：发送已格式化的文本
 // buf: 缓冲区，tag + \0 + text 从 buf + INST_HDR_SIZE 开始
@@ -1148,14 +4164,17 @@ instrument_get(uint16_t idx) {
 static void
 inst_send_buf(uint8_t chn, char* buf, int tag_len, int text_len) {
 
+    if (!(P_get(&g_inst_gate[chn / 32]) & (1u << (chn % 32)))) return;    // 无人订阅（本地回调存在时门控全开）
+
     char* tag  = buf + INST_HDR_SIZE;
     char* text = tag + tag_len + 1;                 // 跳过 \0
 
     // 本地回调：tag 已有 \0 结尾，直接使用
     // 递归保护：防止回调中调用 print() 导致无限递归
     if (g_inst_cb && !g_inst_in_cb) {
+        uint64_t now = g_inst_cb_ex ? inst_wall_us() : 0;
         g_inst_in_cb = 1;
-        g_inst_cb(0, chn, tag, text, text_len);
+        inst_cb_call(0, chn, tag, text, text_len, now, now);
         g_inst_in_cb = 0;
     }
 
@@ -1167,18 +4186,47 @@ inst_send_buf(uint8_t chn, char* buf, int tag_len, int text_len) {
     // 发送操作：只需初始化 socket，不启动接收线程
     if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock()) return;
 
+    // 批量模式：小记录追加到本线程的批量包，超长记录先冲刷已缓存的记录以保持顺序
+    if (P_get(&g_inst_batch_us)) {
+        if (inst_batch_put(chn, tag, tag_len, text, text_len)) return;
+        inst_batch_flush_own();
+    }
+
     // 写入固定 header (7 bytes)
     uint8_t *pkt = (uint8_t*)buf;
     nwrite_s(pkt, g_inst_rid);                      // rid
-    uint16_t seq = (uint16_t)P_get_and_inc(&g_inst_seq, 1);
-    nwrite_s(pkt + 2, seq);                         // seq
     pkt[4] = 0;                                     // type=0 数据包
     pkt[5] = chn;                                   // chn
     pkt[6] = (uint8_t)tag_len;                      // tag_len
 
-    // 协议: header + tag + \0 + text
-    sendto(g_inst_sock, buf, INST_HDR_SIZE + tag_len + 1 + text_len, 0,
-           (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+    // 协议: header + tag + \0 + text [+ send_us(8)]
+    int stamp = P_get(&g_inst_stamp) ? INST_STAMP_SIZE : 0;
+    int text_max = INST_PAYLOAD_MAX - tag_len - 1 - stamp;
+    if (text_len <= text_max) {
+        uint16_t seq = inst_seq_next();
+        nwrite_s(pkt + 2, seq);                     // seq
+        int len = INST_HDR_SIZE + tag_len + 1 + text_len;
+        if (stamp) len = inst_stamp_put(pkt, len);
+        inst_sendv(&pkt, &len, 1, inst_chn_high(chn));
+        return;
+    }
+
+    // 超长文本（如 print(":") 缓存模式的大块输出）：整包分片发送，接收方重组后作为一条消息交付
+    // 时间戳由分片函数接在最后一片之后（文本之后不一定有余量）
+    uint8_t ts[INST_STAMP_SIZE];
+    if (stamp) {
+        uint64_t us = inst_wall_us();
+        nwrite_ll(ts, us);
+        pkt[4] |= INST_TYPE_STAMP;
+    }
+    int len = INST_HDR_SIZE + tag_len + 1 + text_len;
+    if (len > INST_MSG_MAX - stamp) len = INST_MSG_MAX - stamp;
+    inst_send_frags(pkt, len, true, ts, stamp);
+}
+
+// instrument_listen_ex 时 g_inst_cb 的占位（非 NULL 以开启交付，实际由 inst_cb_call 调用 g_inst_cb_ex）
+static void inst_cb_ex_stub(uint16_t rid, uint8_t chn, const char* tag, char* txt, int len) {
+    (void)rid; (void)chn; (void)tag; (void)txt; (void)len;
 }
 
 ret_t
@@ -1190,8 +4238,12 @@ instrument_listen(instrument_cb cb, cstr_t id) {
     if (g_inst_thread == 0 && !inst_start_thread())
         return E_EXTERNAL(P_sock_errno());
 
-    inst_free_senders();
+    g_inst_senders_reset = true;                    // 由接收线程清空 sender 表
+    if (cb != inst_cb_ex_stub) g_inst_cb_ex = NULL;
     g_inst_cb      = cb;
+    inst_shm_listen();                              // 同主机发送方的共享内存通道
+    inst_interest_update(inst_now_ms());
+    if (cb) inst_interest_send(false);              // 立即广播订阅，开启了 instrument_interest 的发送方开始发送
     if (id) {
         g_inst_id_set = true;
         size_t n = strlen(id);
@@ -1206,6 +4258,25 @@ instrument_listen(instrument_cb cb, cstr_t id) {
     return E_NONE;
 }
 
+ret_t
+instrument_listen_ex(instrument_ex_cb cb, cstr_t id) {
+
+    if (!cb) return E_INVALID;
+    if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())
+        return E_EXTERNAL(P_sock_errno());
+#ifdef SO_TIMESTAMPNS
+    int opt = 1;                                    // 内核接收时间戳，随 recvmmsg 辅助数据返回
+    setsockopt(g_inst_sock, SOL_SOCKET, SO_TIMESTAMPNS, (const char*)&opt, sizeof(opt));
+#endif
+    g_inst_cb_ex = cb;
+    return instrument_listen(inst_cb_ex_stub, id);
+}
+
+void
+instrument_timestamp(bool enable) {
+    P_set(&g_inst_stamp, enable ? 1 : 0);
+}
+
 // ---- 同步等待机制 ----
 
 // 发送 type=2 WAIT 包：header(7) + waiting_len(1) + waiting + from_len(1) + from
@@ -1231,8 +4302,7 @@ static void inst_send_wait(const char *port, const char *from) {
     *p++ = from_len;
     if (from_len)    { memcpy(p, from, from_len); p += from_len; }
 
-    sendto(g_inst_sock, (const char*)pkt, (int)(p - pkt), 0,
-           (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+    inst_sendto(pkt, (int)(p - pkt), true);
 }
 
 // 发送 type=3 CONTINUE 包：header(7) + to_len(1) + to + by_len(1) + by
@@ -1257,8 +4327,42 @@ static void inst_send_continue(const char *to, const char *by) {
     *p++ = by_len;
     if (by_len) { memcpy(p, by, by_len); p += by_len; }
 
-    sendto(g_inst_sock, (const char*)pkt, (int)(p - pkt), 0,
-           (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+    inst_sendto(pkt, (int)(p - pkt), true);
+}
+
+// 等待接收线程置位 *done，最多 ms 毫秒；返回 *done
+static bool inst_sig_wait(volatile bool* done, uint64_t ms) {
+    P_clock start, now;
+    P_clock_now(&start);
+    P_mutex_lock(&g_inst_sig.mutex);
+    while (!*done) {
+        P_clock_now(&now);
+        uint64_t spent = (uint64_t)clock_ms_diff(now, start);
+        if (spent >= ms) break;
+        uint64_t left = ms - spent;
+        if (left > 1000) left = 1000;               // 长等待分段，避免超时换算溢出
+        P_clock tm = { (time_t)(left / 1000), (long)(left % 1000) * 1000000 };
+        P_wait_timeout(&g_inst_sig.cond, &g_inst_sig.mutex, &tm);
+    }
+    bool ret = *done;
+    P_mutex_unlock(&g_inst_sig.mutex);
+    return ret;
+}
+
+// 接收线程：置位 *done 并唤醒等待方（需持有 g_inst_sig.mutex）
+static void inst_sig_done(volatile bool* done) {
+    *done = true;
+    P_cond_all(&g_inst_sig.cond);
+}
+
+// 本次等待的时长：不超过重发间隔和剩余超时；已超时返回 0
+static uint64_t inst_sig_slice(const P_clock* start, uint32_t timeout_ms, uint64_t interval_ms) {
+    if (!timeout_ms) return interval_ms;
+    P_clock now;
+    P_clock_now(&now);
+    uint64_t elapsed_ms = (uint64_t)clock_ms_diff(now, *start);
+    if (elapsed_ms >= timeout_ms) return 0;
+    return timeout_ms - elapsed_ms < interval_ms ? timeout_ms - elapsed_ms : interval_ms;
 }
 
 ret_t instrument_wait(cstr_t port, cstr_t from, uint32_t timeout_ms) {
@@ -1269,6 +4373,7 @@ ret_t instrument_wait(cstr_t port, cstr_t from, uint32_t timeout_ms) {
         return E_EXTERNAL(P_sock_errno());
 
     // 设置等待状态
+    P_mutex_lock(&g_inst_sig.mutex);
     g_inst_wait_done = false;
     if (from && from[0]) {
         size_t n = strlen(from);
@@ -1278,12 +4383,13 @@ ret_t instrument_wait(cstr_t port, cstr_t from, uint32_t timeout_ms) {
     } else {
         g_inst_wait_from[0] = '\0';
     }
+    P_mutex_unlock(&g_inst_sig.mutex);
 
     // 通过 cb 通知本地：chn=INSTRUMENT_CTRL, tag=NULL, text="waiting for <from>"
     if (g_inst_cb) {
         char msg[64];
         int len = snprintf(msg, sizeof(msg), "waiting for %s", from && from[0] ? from : "any");
-        g_inst_cb(g_inst_rid, g_inst_ctrl, NULL, msg, len);
+        inst_cb_call(g_inst_rid, g_inst_ctrl, NULL, msg, len, 0, inst_wall_us());
     }
 
     // 进入 wait：将累计负值转换为冻结正值
@@ -1297,163 +4403,1026 @@ ret_t instrument_wait(cstr_t port, cstr_t from, uint32_t timeout_ms) {
     uint64_t resend_interval = 500;                 // 每 500ms 重发一次 WAIT
     ret_t ret = E_TIMEOUT;
 
-    for (;;) {
-        inst_send_wait(port, from);
+    for (;;) {
+        uint64_t slice = inst_sig_slice(&_clk_start, timeout_ms, resend_interval);
+        if (!slice) break;
+        inst_send_wait(port, from);
+
+        // 等待一个重发间隔（或剩余超时），收到 continue 时接收线程立即唤醒
+        if (inst_sig_wait(&g_inst_wait_done, slice)) { ret = E_NONE; break; }
+    }
+
+    // 退出 wait：将冻结正值恢复为累计负值
+    // frozen_tick_us - current_clock_us = 负值（累计增大）
+    P_clock_now(&_clk_now);
+    instrument_tick = instrument_tick - (int64_t)(clock_us(_clk_now));
+    return ret;
+}
+
+ret_t instrument_continue(cstr_t to, cstr_t from) {
+
+    if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())
+        return E_EXTERNAL(P_sock_errno());
+
+    inst_send_continue(to, from);
+    return E_NONE;
+}
+
+// 查找 req_id 对应的未完成请求（需持有 g_inst_sig.mutex）
+// req_id 为 0 表示旧版响应方（RESP 不带 req_id），匹配最早发出的未完成请求
+static inst_req_t* inst_req_find(uint16_t req_id) {
+    if (req_id) {
+        inst_req_t* r = &g_inst_reqs[req_id & (INST_REQ_MAX - 1)];
+        return r->id == req_id && !r->done ? r : NULL;
+    }
+    inst_req_t* oldest = NULL;
+    for (int i = 0; g_inst_reqs_n && i < INST_REQ_MAX; ++i) {
+        inst_req_t* r = &g_inst_reqs[i];
+        if (r->id && !r->done && (!oldest || r->sent_ms < oldest->sent_ms)) oldest = r;
+    }
+    return oldest;
+}
+
+// 完成请求（需持有 g_inst_sig.mutex）：无回调的请求唤醒等待方，由 instrument_req_wait 释放槽位
+// 有回调的请求立即释放槽位，返回 true 表示调用方需在解锁后调用 cb
+static bool inst_req_complete(inst_req_t* r, ret_t ret) {
+    free(r->pkt);
+    r->pkt = NULL;
+    r->ret = ret;
+    P_set(&g_inst_reqs_n, g_inst_reqs_n - 1);
+    if (!r->cb) {
+        inst_sig_done(&r->done);
+        return false;
+    }
+    r->id = 0;
+    return true;
+}
+
+// 接收线程：重发到期的 REQ，超时的请求以 E_TIMEOUT 完成
+static void inst_reqs_tick(uint64_t now_ms) {
+    if (!P_get(&g_inst_reqs_n)) return;
+    for (int i = 0; i < INST_REQ_MAX; ++i) {
+        P_mutex_lock(&g_inst_sig.mutex);
+        inst_req_t* r = &g_inst_reqs[i];
+        if (!r->id || r->done) { P_mutex_unlock(&g_inst_sig.mutex); continue; }
+        if (r->deadline_ms && now_ms >= r->deadline_ms) {
+            uint16_t h = r->id;
+            instrument_req_cb cb = r->cb; void* ctx = r->ctx;
+            bool call = inst_req_complete(r, E_TIMEOUT);
+            P_mutex_unlock(&g_inst_sig.mutex);
+            if (call) cb(ctx, h, E_TIMEOUT, NULL, 0);
+            continue;
+        }
+        if (now_ms - r->sent_ms >= INST_REQ_RESEND_MS) {
+            r->sent_ms = now_ms;
+            inst_send_ctrl(r->pkt, r->pkt_len);
+        }
+        P_mutex_unlock(&g_inst_sig.mutex);
+    }
+}
+
+int instrument_req_async(cstr_t id, uint32_t timeout_ms, cstr_t msg,
+                         char *buffer, size_t bufsz, instrument_req_cb cb, void* ctx) {
+
+    if (!inst_ensure_thread())
+        return E_EXTERNAL(P_sock_errno());
+
+    // 构建 REQ 包（一次构建，重复发送）
+    // 格式: header(7, seq=req_id) + id_len(1) + id + msg_len(1) + msg + content
+    uint8_t id_len = id ? (uint8_t)strlen(id) : 0;
+    uint8_t msg_len = msg ? (uint8_t)strlen(msg) : 0;
+    if (id_len > INST_PORT_MAX) id_len = INST_PORT_MAX;
+    if (msg_len > INST_PORT_MAX) msg_len = INST_PORT_MAX;
+
+    // 超过单包容量的请求分片发送
+    int content_len = buffer ? (int)strlen(buffer) : 0;
+    int max_content = INST_MSG_MAX - INST_HDR_SIZE - 2 - id_len - msg_len;
+    if (content_len > max_content) content_len = max_content;
+
+    uint8_t *pkt = (uint8_t*)malloc(INST_HDR_SIZE + 2 + id_len + msg_len + content_len);
+    if (!pkt) return E_OUT_OF_MEMORY;
+    nwrite_s(pkt, g_inst_rid);
+    pkt[4] = 4;                                      // type=4 REQ 包
+    pkt[5] = g_inst_ctrl;
+    pkt[6] = 0;                                      // tag_len=0
+
+    uint8_t *p = pkt + INST_HDR_SIZE;
+    *p++ = id_len;
+    if (id_len) { memcpy(p, id, id_len); p += id_len; }
+    *p++ = msg_len;
+    if (msg_len) { memcpy(p, msg, msg_len); p += msg_len; }
+    if (content_len > 0) { memcpy(p, buffer, content_len); p += content_len; }
+
+    // 分配 req_id：跳过 0 和仍被占用的槽位
+    // + 已完成但未 wait 的请求不计入 g_inst_reqs_n 却仍占槽位，因此按槽位探测一轮，全部占用则失败
+    P_mutex_lock(&g_inst_sig.mutex);
+    inst_req_t* r = NULL;
+    uint16_t req_id = 0;
+    for (int i = 0; g_inst_reqs_n < INST_REQ_MAX && i <= INST_REQ_MAX; ++i) {
+        req_id = ++g_inst_req_next;
+        r = &g_inst_reqs[req_id & (INST_REQ_MAX - 1)];
+        if (req_id && !r->id) break;
+        r = NULL;
+    }
+    if (!r) {
+        P_mutex_unlock(&g_inst_sig.mutex);
+        free(pkt);
+        return E_OUT_OF_CAPACITY;
+    }
+    nwrite_s(pkt + 2, req_id);                      // seq 字段携带 req_id
+
+    uint64_t now = inst_now_ms();
+    r->id = req_id;
+    r->done = false;
+    r->ret = E_TIMEOUT;
+    r->buf = buffer;
+    r->bufsz = bufsz;
+    r->cb = cb;
+    r->ctx = ctx;
+    r->pkt = pkt;
+    r->pkt_len = (int)(p - pkt);
+    r->sent_ms = now;
+    r->deadline_ms = timeout_ms ? now + timeout_ms : 0;
+    P_set(&g_inst_reqs_n, g_inst_reqs_n + 1);
+    inst_send_ctrl(pkt, r->pkt_len);
+    P_mutex_unlock(&g_inst_sig.mutex);
+    return req_id;
+}
+
+// 等待请求完成并释放槽位；cancel 为 true 时超时也撤销请求，否则超时后请求继续有效
+static ret_t inst_req_wait(int handle, uint64_t ms, bool cancel) {
+    inst_req_t* r = &g_inst_reqs[handle & (INST_REQ_MAX - 1)];
+    inst_sig_wait(&r->done, ms);
+
+    P_mutex_lock(&g_inst_sig.mutex);
+    ret_t ret = r->ret;
+    if (!r->done) {
+        if (!cancel) { P_mutex_unlock(&g_inst_sig.mutex); return E_TIMEOUT; }
+        free(r->pkt);
+        r->pkt = NULL;
+        P_set(&g_inst_reqs_n, g_inst_reqs_n - 1);
+        ret = E_TIMEOUT;
+    }
+    r->id = 0;
+    P_mutex_unlock(&g_inst_sig.mutex);
+    return ret;
+}
+
+ret_t instrument_req_wait(int handle, uint32_t timeout_ms) {
+
+    if (handle <= 0 || handle > 0xFFFF) return E_INVALID;
+    inst_req_t* r = &g_inst_reqs[handle & (INST_REQ_MAX - 1)];
+    P_mutex_lock(&g_inst_sig.mutex);
+    bool valid = r->id == handle && !r->cb;
+    P_mutex_unlock(&g_inst_sig.mutex);
+    if (!valid) return E_INVALID;
+
+    // timeout_ms 为 0 时等到请求完成（请求自身的超时由接收线程处理）
+    return inst_req_wait(handle, timeout_ms ? timeout_ms : UINT64_MAX, false);
+}
+
+ret_t instrument_req(cstr_t id, uint32_t timeout_ms,
+                     cstr_t msg, char *buffer, size_t bufsz) {
+
+    int h = instrument_req_async(id, timeout_ms, msg, buffer, bufsz, NULL, NULL);
+    if (h < 0) return h;
+    return inst_req_wait(h, timeout_ms ? timeout_ms : UINT64_MAX, true);
+}
+
+uint16_t instrument_req_id(void) {
+    return g_inst_req_cur_id;
+}
+
+ret_t instrument_resp_id(uint16_t rid, uint16_t req_id, cstr_t reply) {
+
+    if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())
+        return E_EXTERNAL(P_sock_errno());
+
+    // 格式: header(7, seq=req_id) + target_rid(2) + reply；超过单包容量时分片发送
+    int reply_len = reply ? (int)strlen(reply) : 0;
+    int avail = INST_MSG_MAX - INST_HDR_SIZE - 2;    // target_rid(2)
+    if (reply_len > avail) reply_len = avail;
+
+    uint8_t stack[INST_UDP_MAX], *pkt = stack;
+    if (INST_HDR_SIZE + 2 + reply_len > INST_UDP_MAX &&
+        !(pkt = (uint8_t*)malloc(INST_HDR_SIZE + 2 + reply_len))) return E_OUT_OF_MEMORY;
+    nwrite_s(pkt, g_inst_rid);
+    nwrite_s(pkt + 2, req_id);                      // seq 字段携带 req_id
+    pkt[4] = 5;                                      // type=5 RESP 包
+    pkt[5] = g_inst_ctrl;
+    pkt[6] = 0;                                      // tag_len=0
+
+    uint8_t *p = pkt + INST_HDR_SIZE;
+    nwrite_s(p, rid); p += 2;                        // target_rid
+    if (reply_len > 0) { memcpy(p, reply, reply_len); p += reply_len; }
+
+    inst_send_ctrl(pkt, (int)(p - pkt));
+    if (pkt != stack) free(pkt);
+    return E_NONE;
+}
+
+ret_t instrument_resp(uint16_t rid, cstr_t reply) {
+    // 在 REQ 回调中应答时自动带上该请求的 req_id
+    return instrument_resp_id(rid, rid == g_inst_req_cur_rid ? g_inst_req_cur_id : 0, reply);
+}
+
+// ---- 订阅（发送兴趣）----
+
+// 监听方每 INST_INTEREST_MS 广播 type=10 订阅包：header(7, seq=0, chn=flags, tag_len=0) + 通道 bitset(32)
+// flags bit0 为查询：收到的监听方立即广播一次订阅（发送方开启 instrument_interest 时发出，bitset 为空）
+// 开启 instrument_interest 的发送方按通道记录订阅的过期时间，合并到 g_inst_gate，instrument_slot 入口只读一次
+static struct {
+    volatile bool               on;                 // 发送方：按订阅过滤
+    uint32_t                    sub[8];             // 监听方：订阅的通道（默认全部）
+    uint64_t                    sent_ms;            // 监听方：上次广播订阅的时间
+    uint64_t                    aged_ms;            // 发送方：上次按过期时间重算 g_inst_gate 的时间
+    uint64_t                    exp[256];           // 发送方：各通道订阅的过期时间（由接收线程写）
+} g_inst_interest = { false, { ~0u, ~0u, ~0u, ~0u, ~0u, ~0u, ~0u, ~0u }, 0, 0, { 0 } };
+
+static void inst_interest_send(bool query) {
+    if (g_inst_sock == P_INVALID_SOCKET) return;
+
+    uint8_t pkt[INST_INTEREST_SIZE];
+    nwrite_s(pkt, g_inst_rid);                      // rid
+    nwrite_s(pkt + 2, 0);                           // seq（订阅包不占序列号）
+    pkt[4] = 10;                                    // type=10 订阅包
+    pkt[5] = query ? 1 : 0;                         // flags
+    pkt[6] = 0;
+    for (int w = 0; w < 8; ++w) {
+        uint32_t bits = g_inst_cb ? g_inst_interest.sub[w] : 0;
+        nwrite_l(pkt + INST_HDR_SIZE + w * 4, bits);
+    }
+    g_inst_interest.sent_ms = inst_now_ms();
+    sendto(g_inst_sock, (const char*)pkt, INST_INTEREST_SIZE, 0,
+           (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+}
+
+// 重新计算 g_inst_gate：未开启过滤或本进程有本地回调时，所有通道都需要格式化
+static void inst_interest_update(uint64_t now_ms) {
+    bool all = !P_get(&g_inst_interest.on) || g_inst_cb;
+    for (int w = 0; w < 8; ++w) {
+        uint32_t bits = ~0u;
+        if (!all) {
+            bits = 0;
+            for (int b = 0; b < 32; ++b)
+                if (g_inst_interest.exp[w * 32 + b] > now_ms) bits |= 1u << b;
+        }
+        if (P_get(&g_inst_gate[w]) != bits) P_set(&g_inst_gate[w], bits);
+    }
+    g_inst_interest.aged_ms = now_ms;
+}
+
+// 处理收到的订阅包（接收线程）
+static void inst_interest_recv(const uint8_t* pkt, uint64_t now_ms) {
+    if (P_get(&g_inst_interest.on)) {
+        for (int w = 0; w < 8; ++w) {
+            uint32_t bits = nget_l(pkt + INST_HDR_SIZE + w * 4);
+            for (int b = 0; bits; ++b, bits >>= 1)
+                if (bits & 1) g_inst_interest.exp[w * 32 + b] = now_ms + INST_INTEREST_TTL;
+        }
+        inst_interest_update(now_ms);
+    }
+    // 查询：立即应答（多个发送方同时查询时至少间隔 10ms）
+    if ((pkt[5] & 1) && g_inst_cb && now_ms - g_inst_interest.sent_ms >= 10) inst_interest_send(false);
+}
+
+// 接收线程周期处理：监听方定期广播订阅，发送方让过期的订阅失效
+static void inst_interest_tick(uint64_t now_ms) {
+    if (g_inst_cb && now_ms - g_inst_interest.sent_ms >= INST_INTEREST_MS) inst_interest_send(false);
+    if (P_get(&g_inst_interest.on) && now_ms - g_inst_interest.aged_ms >= 100) inst_interest_update(now_ms);
+}
+
+ret_t
+instrument_interest(bool enable) {
+
+    if (enable && !inst_ensure_thread()) return E_EXTERNAL(P_sock_errno());
+    g_inst_interest.on = enable;
+    inst_interest_update(inst_now_ms());
+    if (enable) inst_interest_send(true);           // 请求已有的监听方立即广播订阅
+    return E_NONE;
+}
+
+void
+instrument_subscribe(int chn, ...) {
+
+    uint32_t sub[8] = {0};
+
+    // 第一个参数为 0 表示订阅全部通道
+    if (chn == 0) memset(sub, 0xFF, sizeof(sub));
+    else {
+        sub[(uint8_t)chn / 32] |= 1u << ((uint8_t)chn % 32);
+        va_list args;
+        va_start(args, chn);
+        uint8_t c;
+        while ((c = (uint8_t)va_arg(args, int)) != 0) sub[c / 32] |= 1u << (c % 32);
+        va_end(args);
+    }
+    memcpy(g_inst_interest.sub, sub, sizeof(sub));
+    if (g_inst_cb) inst_interest_send(false);
+}
+
+// ---- 指标 ----
+
+// 预注册的命名指标：热路径只在本线程的分片内累加，冲刷时合并各分片，以 type=9 包发送增量
+// 包格式：header(7, chn=0, tag_len=0) + N * [kind(1) + id(2) + 数据]
+//   counter:   delta(8)
+//   gauge:     value(8)
+//   histogram: count(8) + sum(8) + n(1) + n * [bucket(1) + count(8)]（只发送非空桶）
+//   定义记录:  kind|INST_METRIC_DEF + id(2) + name_len(1) + name（首次有数据前及每 INST_METRIC_DEF_MS 发送）
+// type=9 包占用 seq，与数据包一样经过接收端滑动窗口（可靠模式下可 NACK 重传）
+typedef struct {
+    char                        name[INSTRUMENT_METRIC_NAME];
+    uint8_t                     kind;
+    bool                        defined;            // 本周期内已发送定义记录
+    uint16_t                    off;                // 在分片中的单元偏移
+} inst_metric_def_t;
+
+typedef struct {
+    P_mutex_t                   mutex;
+    int64_t*                    cells;              // INST_METRIC_CELLS 个累计单元（首次使用时分配）
+} inst_metric_shard_t;
+
+static struct {
+    P_mutex_t                   mutex;              // 注册与冲刷
+    volatile int                init;
+    uint32_t                    n;                  // 已注册的指标数（id 即下标）
+    uint32_t                    cells;              // 已分配的单元数
+    uint32_t                    stamp;              // gauge 写入序号，合并分片时取最新的值
+    uint64_t                    def_ms;             // 上次重发定义的时间
+    int64_t*                    agg;                // 冲刷时的合并结果
+    inst_metric_def_t           defs[INST_METRIC_MAX];
+    uint8_t                     pkt[INST_UDP_MAX];
+    volatile uint32_t           interval_ms;        // 冲刷周期
+    volatile bool               running;
+    thd_t                       thread;
+} g_inst_metric;
+
+static inst_metric_shard_t      g_inst_metric_shards[INST_METRIC_SHARDS];
+static uint32_t                 g_inst_metric_next = 0;             // 下一个分配的分片
+static TLS int                  g_inst_metric_idx = -1;             // 本线程使用的分片
+
+// 监听方登记表：按 (rid, id) 开放寻址，由 g_inst_mreg_mutex 保护（回调中可调用 instrument_metrics_read）
+static instrument_metric_t**    g_inst_mreg = NULL;
+static uint32_t                 g_inst_mreg_cap = 0;                // 容量（2 的幂）
+static uint32_t                 g_inst_mreg_n = 0;
+
+static bool inst_metric_init(void) {
+    if (P_get_acq(&g_inst_metric.init)) return true;
+    static volatile int lock = 0;
+    P_spin_lock(&lock);
+    if (!g_inst_metric.init && (g_inst_metric.agg = (int64_t*)calloc(INST_METRIC_CELLS, sizeof(int64_t)))) {
+        P_mutex_init(&g_inst_metric.mutex);
+        for (int i = 0; i < INST_METRIC_SHARDS; ++i) P_mutex_init(&g_inst_metric_shards[i].mutex);
+        P_set_rel(&g_inst_metric.init, 1);
+    }
+    P_spin_unlock(&lock);
+    return g_inst_metric.init != 0;
+}
+
+// 锁定本线程的分片并返回指标的累计单元；id 无效或类型不符时返回 NULL
+static int64_t* inst_metric_lock(int id, uint8_t kind, inst_metric_shard_t** shard) {
+    if (id < 0 || (uint32_t)id >= P_get_acq(&g_inst_metric.n) || g_inst_metric.defs[id].kind != kind) return NULL;
+    if (g_inst_metric_idx < 0) g_inst_metric_idx = (int)(P_get_and_inc(&g_inst_metric_next, 1) % INST_METRIC_SHARDS);
+    inst_metric_shard_t* s = &g_inst_metric_shards[g_inst_metric_idx];
+    P_mutex_lock(&s->mutex);
+    if (!s->cells && !(s->cells = (int64_t*)calloc(INST_METRIC_CELLS, sizeof(int64_t)))) {
+        P_mutex_unlock(&s->mutex);
+        return NULL;
+    }
+    *shard = s;
+    return s->cells + g_inst_metric.defs[id].off;
+}
+
+// 直方图桶：0 为 <= 0 的样本，i 为 [2^(i-1), 2^i)，末桶不封顶
+static inline int inst_metric_bucket(int64_t v) {
+    int b = 0;
+    for (uint64_t u = v > 0 ? (uint64_t)v : 0; u && b < INSTRUMENT_METRIC_BUCKETS - 1; u >>= 1) ++b;
+    return b;
+}
+
+// LOCAL 模式下不对外发送（分片照常合并清零）
+static void inst_metrics_send(uint8_t* pkt, int len) {
+    if (g_inst_mode == INST_MODE_LOCAL) return;
+    nwrite_s(pkt, g_inst_rid);                      // rid
+    uint16_t seq = inst_seq_next();
+    nwrite_s(pkt + 2, seq);                         // seq
+    pkt[4] = 9;                                     // type=9 指标包
+    pkt[5] = 0;
+    pkt[6] = 0;
+    inst_sendv(&pkt, &len, 1, false);
+}
+
+// 合并各分片并发送增量（以及需要（重）发的定义记录）
+static void inst_metrics_flush(void) {
+    if (!P_get_acq(&g_inst_metric.init) || g_inst_sock == P_INVALID_SOCKET) return;
+    P_mutex_lock(&g_inst_metric.mutex);
+
+    // 只合并快照时已注册的指标；之后注册的指标单元在 cells 之后，不会被清零
+    uint32_t n = g_inst_metric.n, cells = g_inst_metric.cells;
+    int64_t* agg = g_inst_metric.agg;
+    memset(agg, 0, cells * sizeof(int64_t));
+    for (int k = 0; k < INST_METRIC_SHARDS; ++k) {
+        inst_metric_shard_t* s = &g_inst_metric_shards[k];
+        if (!P_get(&s->cells)) continue;
+        P_mutex_lock(&s->mutex);
+        for (uint32_t i = 0; i < n; ++i) {
+            inst_metric_def_t* d = &g_inst_metric.defs[i];
+            int64_t *a = agg + d->off, *c = s->cells + d->off;
+            if (d->kind == INSTRUMENT_GAUGE) {
+                if (c[1] && (!a[1] || (int32_t)((uint32_t)c[1] - (uint32_t)a[1]) > 0)) { a[0] = c[0]; a[1] = c[1]; }
+                continue;
+            }
+            int m = d->kind == INSTRUMENT_COUNTER ? 1 : INST_METRIC_HIST_CELLS;
+            for (int j = 0; j < m; ++j) a[j] += c[j];
+        }
+        memset(s->cells, 0, cells * sizeof(int64_t));
+        P_mutex_unlock(&s->mutex);
+    }
+
+    uint64_t now = inst_now_ms();
+    if (now - g_inst_metric.def_ms >= INST_METRIC_DEF_MS) {
+        g_inst_metric.def_ms = now;
+        for (uint32_t i = 0; i < n; ++i) g_inst_metric.defs[i].defined = false;
+    }
 
-        // 等待一个重发间隔或直到收到 continue
-        P_clock _clk_wait;
-        P_clock_now(&_clk_wait);
-        while (!g_inst_wait_done) {
-            P_clock_now(&_clk_now);
-            if ((uint64_t)clock_ms_diff(_clk_now, _clk_wait) >= resend_interval) break;
-            P_usleep(10000);                        // 10ms 轮询
+    uint8_t* pkt = g_inst_metric.pkt;
+    int len = INST_HDR_SIZE;
+    for (uint32_t i = 0; i < n; ++i) {
+        inst_metric_def_t* d = &g_inst_metric.defs[i];
+        int64_t* a = agg + d->off;
+        bool hist = d->kind == INSTRUMENT_HISTOGRAM;
+        bool has = d->kind == INSTRUMENT_GAUGE ? a[1] != 0 : a[0] != 0;    // gauge: 写入序号；其余: delta/count
+        int name_len = (int)strlen(d->name);
+        int need = (d->defined ? 0 : 4 + name_len) + (has ? 3 + (hist ? 17 + INSTRUMENT_METRIC_BUCKETS * 9 : 8) : 0);
+        if (!need) continue;
+        if (len + need > INST_UDP_MAX) { inst_metrics_send(pkt, len); len = INST_HDR_SIZE; }
+
+        uint8_t* p = pkt + len;
+        uint16_t id = (uint16_t)i;
+        if (!d->defined) {
+            *p++ = d->kind | INST_METRIC_DEF;
+            nwrite_s(p, id); p += 2;
+            *p++ = (uint8_t)name_len;
+            memcpy(p, d->name, name_len); p += name_len;
+            d->defined = true;
         }
+        if (has) {
+            *p++ = d->kind;
+            nwrite_s(p, id); p += 2;
+            if (hist) { uint64_t cnt = (uint64_t)a[0]; nwrite_ll(p, cnt); p += 8; }
+            uint64_t v = (uint64_t)a[hist ? 1 : 0];                         // counter: delta；gauge: value；histogram: sum
+            nwrite_ll(p, v); p += 8;
+            if (hist) {
+                uint8_t* nb = p++;
+                *nb = 0;
+                for (int b = 0; b < INSTRUMENT_METRIC_BUCKETS; ++b) {
+                    uint64_t bc = (uint64_t)a[2 + b];
+                    if (!bc) continue;
+                    *p++ = (uint8_t)b;
+                    nwrite_ll(p, bc); p += 8;
+                    ++*nb;
+                }
+            }
+        }
+        len = (int)(p - pkt);
+    }
+    if (len > INST_HDR_SIZE) inst_metrics_send(pkt, len);
+    P_mutex_unlock(&g_inst_metric.mutex);
+}
 
-        if (g_inst_wait_done) { ret = E_NONE; break; }
+// 冲刷线程：按 interval_ms 周期冲刷（最长 100ms 检查一次退出标志）
+static int32_t inst_metrics_proc(void* ctx) {
+    (void)ctx;
+    uint64_t last = inst_now_ms();
+    while (P_get(&g_inst_metric.running)) {
+        uint32_t ms = P_get(&g_inst_metric.interval_ms);
+        P_usleep((ms < 100 ? ms : 100) * 1000);
+        uint64_t now = inst_now_ms();
+        if (now - last >= ms) { last = now; inst_metrics_flush(); }
+    }
+    return 0;
+}
 
-        P_clock_now(&_clk_now);
-        uint64_t elapsed_ms = clock_ms_diff(_clk_now, _clk_start);
-        if (timeout_ms > 0 && elapsed_ms >= timeout_ms) break;
+static void inst_metrics_stop(void) {
+    if (g_inst_metric.thread) {
+        g_inst_metric.running = false;
+        P_join(g_inst_metric.thread, NULL);
+        g_inst_metric.thread = 0;
     }
+    inst_metrics_flush();
+}
 
-    // 退出 wait：将冻结正值恢复为累计负值
-    // frozen_tick_us - current_clock_us = 负值（累计增大）
-    P_clock_now(&_clk_now);
-    instrument_tick = instrument_tick - (int64_t)(clock_us(_clk_now));
+int
+instrument_metric(cstr_t name, instrument_metric_e kind) {
+
+    if (!name || !*name || (unsigned)kind > INSTRUMENT_HISTOGRAM) return E_INVALID;
+    size_t name_len = strlen(name);
+    if (name_len >= INSTRUMENT_METRIC_NAME) return E_INVALID;
+    if (!inst_metric_init()) return E_OUT_OF_MEMORY;
+
+    P_mutex_lock(&g_inst_metric.mutex);
+    int ret = E_OUT_OF_CAPACITY;
+    uint32_t n = g_inst_metric.n;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (strcmp(g_inst_metric.defs[i].name, name)) continue;
+        ret = g_inst_metric.defs[i].kind == kind ? (int)i : E_CONFLICT;
+        goto out;
+    }
+    uint32_t need = kind == INSTRUMENT_COUNTER ? 1 : kind == INSTRUMENT_GAUGE ? 2 : INST_METRIC_HIST_CELLS;
+    if (n < INST_METRIC_MAX && g_inst_metric.cells + need <= INST_METRIC_CELLS) {
+        inst_metric_def_t* d = &g_inst_metric.defs[n];
+        memcpy(d->name, name, name_len + 1);
+        d->kind = (uint8_t)kind;
+        d->defined = false;
+        d->off = (uint16_t)g_inst_metric.cells;
+        g_inst_metric.cells += need;
+        P_set_rel(&g_inst_metric.n, n + 1);         // defs[n] 写完后再对热路径可见
+        ret = (int)n;
+    }
+out:
+    P_mutex_unlock(&g_inst_metric.mutex);
+
+    // 发送操作：只需初始化 socket，不启动接收线程
+    if (ret >= 0 && g_inst_sock == P_INVALID_SOCKET) inst_init_sock();
     return ret;
 }
 
-ret_t instrument_continue(cstr_t to, cstr_t from) {
+void
+instrument_count(int id, int64_t delta) {
+    inst_metric_shard_t* s;
+    int64_t* c = inst_metric_lock(id, INSTRUMENT_COUNTER, &s);
+    if (!c) return;
+    c[0] += delta;
+    P_mutex_unlock(&s->mutex);
+}
 
-    if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())
-        return E_EXTERNAL(P_sock_errno());
+void
+instrument_gauge(int id, int64_t value) {
+    inst_metric_shard_t* s;
+    int64_t* c = inst_metric_lock(id, INSTRUMENT_GAUGE, &s);
+    if (!c) return;
+    uint32_t stamp = (uint32_t)P_get_and_inc(&g_inst_metric.stamp, 1) + 1;
+    c[0] = value;
+    c[1] = stamp ? stamp : 1;                       // 0 表示本周期未写入
+    P_mutex_unlock(&s->mutex);
+}
 
-    inst_send_continue(to, from);
-    return E_NONE;
+void
+instrument_observe(int id, int64_t value) {
+    inst_metric_shard_t* s;
+    int64_t* c = inst_metric_lock(id, INSTRUMENT_HISTOGRAM, &s);
+    if (!c) return;
+    c[0]++;
+    c[1] += value;
+    c[2 + inst_metric_bucket(value)]++;
+    P_mutex_unlock(&s->mutex);
 }
 
-ret_t instrument_req(cstr_t id, uint32_t timeout_ms,
-                     cstr_t msg, char *buffer, size_t bufsz) {
+ret_t
+instrument_metrics(uint32_t interval_ms) {
 
+    if (!inst_metric_init()) return E_OUT_OF_MEMORY;
     if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())
         return E_EXTERNAL(P_sock_errno());
-    if (g_inst_thread == 0 && !inst_start_thread())
-        return E_EXTERNAL(P_sock_errno());
 
-    // 构建 REQ 包（一次构建，重复发送）
-    // 格式: header(7) + id_len(1) + id + msg_len(1) + msg + content
-    uint8_t id_len = id ? (uint8_t)strlen(id) : 0;
-    uint8_t msg_len = msg ? (uint8_t)strlen(msg) : 0;
-    if (id_len > INST_PORT_MAX) id_len = INST_PORT_MAX;
-    if (msg_len > INST_PORT_MAX) msg_len = INST_PORT_MAX;
+    P_set(&g_inst_metric.interval_ms, interval_ms);
+    if (!interval_ms) {
+        inst_metrics_stop();
+        return E_NONE;
+    }
+    if (!g_inst_metric.thread) {
+        g_inst_metric.running = true;
+        if (P_thread(&g_inst_metric.thread, inst_metrics_proc, NULL, P_THD_BACKGROUND, 0) != E_NONE) {
+            g_inst_metric.running = false;
+            g_inst_metric.thread = 0;
+            return E_NO_SUPPORT;
+        }
+    }
+    return E_NONE;
+}
 
-    int content_len = buffer ? (int)strlen(buffer) : 0;
-    int max_content = INST_PAYLOAD_MAX - 2 - id_len - msg_len;
-    if (content_len > max_content) content_len = max_content;
+static inline uint32_t inst_mreg_hash(uint16_t rid, uint16_t id) {
+    return ((uint32_t)rid << 16 | id) * 0x9E3779B1u >> 16;
+}
 
-    uint8_t pkt[INST_UDP_MAX];
-    nwrite_s(pkt, g_inst_rid);
-    nwrite_s(pkt + 2, 0);                           // seq（不占序列号）
-    pkt[4] = 4;                                      // type=4 REQ 包
-    pkt[5] = g_inst_ctrl;
-    pkt[6] = 0;                                      // tag_len=0
+// 以 cap 重建登记表，丢弃 rid 为 drop 的条目（drop < 0 时保留全部）
+static bool inst_mreg_rebuild(uint32_t cap, int drop) {
+    instrument_metric_t** tab = (instrument_metric_t**)calloc(cap, sizeof(instrument_metric_t*));
+    if (!tab) return false;
+    g_inst_mreg_n = 0;
+    for (uint32_t i = 0; i < g_inst_mreg_cap; ++i) {
+        instrument_metric_t* m = g_inst_mreg[i];
+        if (!m) continue;
+        if (m->rid == drop) { free(m); continue; }
+        uint32_t j = inst_mreg_hash(m->rid, m->id) & (cap - 1);
+        while (tab[j]) j = (j + 1) & (cap - 1);
+        tab[j] = m;
+        g_inst_mreg_n++;
+    }
+    free(g_inst_mreg);
+    g_inst_mreg = tab;
+    g_inst_mreg_cap = cap;
+    return true;
+}
 
-    uint8_t *p = pkt + INST_HDR_SIZE;
-    *p++ = id_len;
-    if (id_len) { memcpy(p, id, id_len); p += id_len; }
-    *p++ = msg_len;
-    if (msg_len) { memcpy(p, msg, msg_len); p += msg_len; }
-    if (content_len > 0) { memcpy(p, buffer, content_len); p += content_len; }
-    int pkt_len = (int)(p - pkt);
+// sender 被移除时丢弃其指标（rid 随进程重启随机生成，不会复用）
+static void inst_mreg_drop(uint16_t rid) {
+    P_mutex_lock(&g_inst_mreg_mutex);
+    for (uint32_t i = 0; i < g_inst_mreg_cap; ++i) {
+        if (g_inst_mreg[i] && g_inst_mreg[i]->rid == rid) {
+            inst_mreg_rebuild(g_inst_mreg_cap, rid);
+            break;
+        }
+    }
+    P_mutex_unlock(&g_inst_mreg_mutex);
+}
 
-    // 设置等待状态
-    g_inst_req_done = false;
-    g_inst_req_buf = buffer;
-    g_inst_req_bufsz = bufsz;
+static void inst_mreg_clear(void) {
+    if (!g_inst_mreg) return;                       // 登记表非空时接收线程已启动过（锁已初始化）
+    P_mutex_lock(&g_inst_mreg_mutex);
+    for (uint32_t i = 0; i < g_inst_mreg_cap; ++i) free(g_inst_mreg[i]);
+    free(g_inst_mreg);
+    g_inst_mreg = NULL;
+    g_inst_mreg_cap = g_inst_mreg_n = 0;
+    P_mutex_unlock(&g_inst_mreg_mutex);
+}
 
-    P_clock _clk_start, _clk_now;
-    P_clock_now(&_clk_start);
-    uint64_t resend_interval = 500;                 // 每 500ms 重发一次 REQ
-    ret_t ret = E_TIMEOUT;
+// 查找或创建登记表条目；kind 与已有条目不符时重新计数
+static instrument_metric_t* inst_mreg_find(uint16_t rid, uint16_t id, uint8_t kind) {
+    if (g_inst_mreg_cap) {
+        uint32_t mask = g_inst_mreg_cap - 1;
+        for (uint32_t i = inst_mreg_hash(rid, id) & mask; g_inst_mreg[i]; i = (i + 1) & mask) {
+            instrument_metric_t* m = g_inst_mreg[i];
+            if (m->rid != rid || m->id != id) continue;
+            if (m->kind != kind) {
+                memset(m, 0, sizeof(*m));
+                m->rid = rid; m->id = id; m->kind = kind;
+            }
+            return m;
+        }
+    }
 
-    for (;;) {
-        sendto(g_inst_sock, (const char*)pkt, pkt_len, 0,
-               (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+    // 负载超过 1/2 时扩容
+    if ((g_inst_mreg_n + 1) * 2 > g_inst_mreg_cap &&
+        !inst_mreg_rebuild(g_inst_mreg_cap ? g_inst_mreg_cap * 2 : 64, -1)) return NULL;
+
+    instrument_metric_t* m = (instrument_metric_t*)calloc(1, sizeof(instrument_metric_t));
+    if (!m) return NULL;
+    m->rid = rid; m->id = id; m->kind = kind;
+    uint32_t mask = g_inst_mreg_cap - 1, i = inst_mreg_hash(rid, id) & mask;
+    while (g_inst_mreg[i]) i = (i + 1) & mask;
+    g_inst_mreg[i] = m;
+    g_inst_mreg_n++;
+    return m;
+}
 
-        P_clock _clk_wait;
-        P_clock_now(&_clk_wait);
-        while (!g_inst_req_done) {
-            P_clock_now(&_clk_now);
-            if ((uint64_t)clock_ms_diff(_clk_now, _clk_wait) >= resend_interval) break;
-            P_usleep(10000);                        // 10ms 轮询
+// 解码 type=9 指标包的记录区到登记表（需持有 g_inst_mreg_mutex）
+static void inst_metrics_decode(uint16_t rid, const uint8_t* p, const uint8_t* end) {
+    uint64_t now = inst_now_ms();
+    while (end - p >= 3) {
+        bool def = (p[0] & INST_METRIC_DEF) != 0;
+        uint8_t kind = p[0] & ~INST_METRIC_DEF;
+        uint16_t id = nget_s(p + 1);
+        p += 3;
+        if (kind > INSTRUMENT_HISTOGRAM) return;                            // 未知记录，无法确定长度
+        int need = def ? 1 : kind == INSTRUMENT_HISTOGRAM ? 17 : 8;
+        if (end - p < need || (def && end - p < 1 + p[0])) return;         // 数据不完整
+        instrument_metric_t* m = inst_mreg_find(rid, id, kind);
+        if (!m) return;                                                     // OOM
+
+        if (def) {
+            int name_len = p[0] < INSTRUMENT_METRIC_NAME ? p[0] : INSTRUMENT_METRIC_NAME - 1;
+            memcpy(m->name, p + 1, name_len);
+            m->name[name_len] = '\0';
+            p += 1 + p[0];
+            continue;
         }
 
-        if (g_inst_req_done) { ret = E_NONE; break; }
-
-        P_clock_now(&_clk_now);
-        uint64_t elapsed_ms = clock_ms_diff(_clk_now, _clk_start);
-        if (timeout_ms > 0 && elapsed_ms >= timeout_ms) break;
+        m->updated_ms = now;
+        if (kind == INSTRUMENT_HISTOGRAM) { m->count += nget_ll(p); p += 8; }
+        int64_t v = (int64_t)nget_ll(p); p += 8;
+        if (kind == INSTRUMENT_GAUGE) m->value = v;
+        else m->value += v;
+        if (kind == INSTRUMENT_HISTOGRAM) {
+            int nb = *p++;
+            if (end - p < nb * 9) return;
+            for (; nb > 0; --nb, p += 9)
+                if (p[0] < INSTRUMENT_METRIC_BUCKETS) m->buckets[p[0]] += nget_ll(p + 1);
+        }
     }
+}
 
-    g_inst_req_buf = NULL;
-    return ret;
+size_t
+instrument_metrics_read(instrument_metric_t* out, size_t max) {
+    if (!g_inst_thread) return 0;                   // 未监听（g_inst_mreg_mutex 未初始化）
+    size_t n = 0;
+    P_mutex_lock(&g_inst_mreg_mutex);
+    for (uint32_t i = 0; i < g_inst_mreg_cap; ++i) {
+        if (!g_inst_mreg[i]) continue;
+        if (out && n < max) out[n] = *g_inst_mreg[i];
+        n++;
+    }
+    P_mutex_unlock(&g_inst_mreg_mutex);
+    return n;
 }
 
-ret_t instrument_resp(uint16_t rid, cstr_t reply) {
+// ---- 线程监听处理过程 ----
 
-    if (g_inst_sock == P_INVALID_SOCKET && !inst_init_sock())
-        return E_EXTERNAL(P_sock_errno());
+// 从 slab 池分配一个窗口槽位
+static inst_slot_t* inst_slot_alloc(void) {
+    if (!g_inst_slot_free) {
+        inst_slab_t* slab = (inst_slab_t*)malloc(sizeof(inst_slab_t));
+        if (!slab) return NULL;
+        slab->next = g_inst_slabs;
+        g_inst_slabs = slab;
+        for (int i = 0; i < INST_SLAB_SLOTS; ++i) {
+            slab->slots[i].next = g_inst_slot_free;
+            g_inst_slot_free = &slab->slots[i];
+        }
+    }
+    inst_slot_t* slot = g_inst_slot_free;
+    g_inst_slot_free = slot->next;
+    return slot;
+}
 
-    // 格式: header(7) + target_rid(2) + reply
-    int reply_len = reply ? (int)strlen(reply) : 0;
-    int avail = INST_PAYLOAD_MAX - 2;                // target_rid(2)
-    if (reply_len > avail) reply_len = avail;
+static void inst_slot_free(inst_sender_t* s, int idx) {
+    s->win[idx]->next = g_inst_slot_free;
+    g_inst_slot_free = s->win[idx];
+    s->win[idx] = NULL;
+    s->held--;
+}
 
-    uint8_t pkt[INST_UDP_MAX];
-    nwrite_s(pkt, g_inst_rid);
-    nwrite_s(pkt + 2, 0);                           // seq（不占序列号）
-    pkt[4] = 5;                                      // type=5 RESP 包
-    pkt[5] = g_inst_ctrl;
-    pkt[6] = 0;                                      // tag_len=0
+// 老化使用真实时钟（P_tick_ms 在 instrument_wait 期间会冻结）
+static inline uint32_t inst_rid_hash(uint16_t rid) {
+    return (uint32_t)rid * 0x9E3779B1u >> 16;
+}
 
-    uint8_t *p = pkt + INST_HDR_SIZE;
-    nwrite_s(p, rid); p += 2;                        // target_rid
-    if (reply_len > 0) { memcpy(p, reply, reply_len); p += reply_len; }
+static bool inst_senders_grow(void) {
+    uint32_t cap = g_inst_senders_cap ? g_inst_senders_cap * 2 : 64;
+    inst_sender_t** tab = (inst_sender_t**)calloc(cap, sizeof(inst_sender_t*));
+    if (!tab) return false;
+    for (uint32_t i = 0; i < g_inst_senders_cap; ++i) {
+        inst_sender_t* s = g_inst_senders[i];
+        if (!s) continue;
+        uint32_t j = inst_rid_hash(s->rid) & (cap - 1);
+        while (tab[j]) j = (j + 1) & (cap - 1);
+        tab[j] = s;
+    }
+    free(g_inst_senders);
+    g_inst_senders = tab;
+    g_inst_senders_cap = cap;
+    return true;
+}
 
-    sendto(g_inst_sock, (const char*)pkt, (int)(p - pkt), 0,
-           (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
-    return E_NONE;
+// 删除表中位置 i 的 sender（线性探测的后移删除，不留墓碑）
+static void inst_senders_remove(uint32_t i) {
+    inst_sender_t* s = g_inst_senders[i];
+    for (int k = 0; s->held && k < INST_WINDOW_SIZE; ++k)
+        if (s->win[k]) inst_slot_free(s, k);
+    if (s->gap) g_inst_gaps--;
+    inst_mreg_drop(s->rid);
+    free(s);
+    g_inst_senders[i] = NULL;
+    g_inst_senders_n--;
+
+    uint32_t mask = g_inst_senders_cap - 1;
+    for (uint32_t j = (i + 1) & mask; g_inst_senders[j]; j = (j + 1) & mask) {
+        uint32_t h = inst_rid_hash(g_inst_senders[j]->rid) & mask;
+        // h 不在 (i, j] 区间内时，j 处的条目可以前移到空位 i
+        if ((j > i && (h <= i || h > j)) || (j < i && (h <= i && h > j))) {
+            g_inst_senders[i] = g_inst_senders[j];
+            g_inst_senders[j] = NULL;
+            i = j;
+        }
+    }
 }
 
-// ---- 线程监听处理过程 ----
+// 老化：移除超过 ttl 未收到包的 sender（随机 rid 在进程重启后不会复用）
+static void inst_senders_age(uint64_t now_ms) {
+    if (!g_inst_sender_ttl || now_ms - g_inst_senders_aged < 1000) return;
+    g_inst_senders_aged = now_ms;
+    for (uint32_t i = 0; i < g_inst_senders_cap; ) {
+        inst_sender_t* s = g_inst_senders[i];
+        if (s && now_ms - s->last_ms >= g_inst_sender_ttl) {
+            inst_senders_remove(i);                 // 后移的条目需要在同一位置重新检查
+            continue;
+        }
+        ++i;
+    }
+}
 
-// 查找或创建 sender 条目（单向链表，动态分配）
-static inst_sender_t* inst_find_sender(uint16_t rid) {
+// 查找或创建 sender 条目
+static inst_sender_t* inst_find_sender(uint16_t rid, uint64_t now_ms) {
 
-    for (inst_sender_t *s = g_inst_senders; s; s = s->next) {
-        if (s->rid == rid) return s;
+    if (g_inst_senders_cap) {
+        uint32_t mask = g_inst_senders_cap - 1;
+        for (uint32_t i = inst_rid_hash(rid) & mask; g_inst_senders[i]; i = (i + 1) & mask) {
+            if (g_inst_senders[i]->rid == rid) {
+                g_inst_senders[i]->last_ms = now_ms;
+                return g_inst_senders[i];
+            }
+        }
     }
 
+    // 负载超过 1/2 时扩容
+    if ((g_inst_senders_n + 1) * 2 > g_inst_senders_cap && !inst_senders_grow()) return NULL;
+
     // 创建新条目（calloc 自动清零 win/next_seq/synced）
     inst_sender_t *s = (inst_sender_t*)calloc(1, sizeof(inst_sender_t));
     if (!s) return NULL;
-    s->rid  = rid;
-    s->next = g_inst_senders;
-    g_inst_senders = s;
+    s->rid     = rid;
+    s->last_ms = now_ms;
+    uint32_t mask = g_inst_senders_cap - 1, i = inst_rid_hash(rid) & mask;
+    while (g_inst_senders[i]) i = (i + 1) & mask;
+    g_inst_senders[i] = s;
+    g_inst_senders_n++;
     return s;
 }
 
+// 速率桶推进到 now_ms 所在的桶，清零中间经过的桶
+static void inst_stat_roll(inst_stat_t* st, uint64_t now_ms) {
+    uint64_t epoch = now_ms / INST_STAT_BUCKET_MS;
+    if (epoch == st->rate_epoch) return;
+    uint64_t k = epoch - st->rate_epoch;
+    if (k > INST_STAT_BUCKETS) k = INST_STAT_BUCKETS;
+    for (uint64_t i = 1; i <= k; ++i) {
+        int idx = (int)((st->rate_epoch + i) % INST_STAT_BUCKETS);
+        st->rate_pkts[idx] = st->rate_bytes[idx] = 0;
+    }
+    st->rate_epoch = epoch;
+}
+
+// 记录收到一个数据包
+static void inst_stat_rx(inst_stat_t* st, int n, uint64_t now_ms) {
+    inst_stat_roll(st, now_ms);
+    int idx = (int)(st->rate_epoch % INST_STAT_BUCKETS);
+    st->rate_pkts[idx]++;
+    st->rate_bytes[idx] += (uint32_t)n;
+    st->received++;
+    st->bytes += (uint64_t)n;
+}
+
+// 同时累加 sender 与聚合统计
+#define inst_stat_add(s, field, v)  ((s)->stat.field += (v), g_inst_stat.field += (v))
+
+// 发布统计快照（需持有 g_inst_rx_mutex）；扩容失败时只发布已有容量内的 sender
+static void inst_stats_publish(void) {
+    P_mutex_lock(&g_inst_stat_pub.mutex);
+    if (g_inst_senders_n > g_inst_stat_pub.cap) {
+        inst_stat_pub_t* tab = (inst_stat_pub_t*)realloc(g_inst_stat_pub.senders, g_inst_senders_cap * sizeof(inst_stat_pub_t));
+        if (tab) { g_inst_stat_pub.senders = tab; g_inst_stat_pub.cap = g_inst_senders_cap; }
+    }
+    g_inst_stat_pub.total = g_inst_stat;
+    g_inst_stat_pub.window = 0;
+    g_inst_stat_pub.updated_ms = 0;
+    g_inst_stat_pub.n = 0;
+    for (uint32_t i = 0; i < g_inst_senders_cap; ++i) {
+        inst_sender_t* s = g_inst_senders[i];
+        if (!s) continue;
+        g_inst_stat_pub.window += s->held;
+        if (s->last_ms > g_inst_stat_pub.updated_ms) g_inst_stat_pub.updated_ms = s->last_ms;
+        if (g_inst_stat_pub.n >= g_inst_stat_pub.cap) continue;
+        inst_stat_pub_t* o = &g_inst_stat_pub.senders[g_inst_stat_pub.n++];
+        o->rid     = s->rid;
+        o->held    = s->held;
+        o->last_ms = s->last_ms;
+        o->stat    = s->stat;
+    }
+    P_mutex_unlock(&g_inst_stat_pub.mutex);
+}
+
+// 交付 next_seq 起连续已缓存的包
+static void inst_sender_flush(inst_sender_t* s) {
+    for (;;) {
+        int idx = s->next_seq & INST_WINDOW_MASK;
+        if (!s->win[idx]) break;
+        if (g_inst_cb) inst_deliver(s->rid, s->win[idx]->data, s->win[idx]->len, s->win[idx]->rx_us);
+        inst_slot_free(s, idx);
+        s->next_seq++;
+    }
+}
+
+// 更新可靠模式的空洞状态：next_seq 推进时重新计时
+static void inst_sender_gap(inst_sender_t* s, uint64_t now_ms) {
+    bool gap = s->reliable && (int16_t)(s->max_seq - s->next_seq) >= 0;
+    if (gap != s->gap) {
+        s->gap = gap;
+        g_inst_gaps += gap ? 1 : (uint32_t)-1;
+        if (gap) s->nack_ms = 0;
+    } else if (!gap || s->gap_seq == s->next_seq) return;
+    s->gap_seq = s->next_seq;
+    s->gap_ms = now_ms;
+}
+
+// 发送 type=7 NACK 包：header(7) + target_rid(2) + base_seq(2) + bitmap(8)，bit i 表示 base_seq+i 缺失
+static void inst_send_nack(inst_sender_t* s, uint64_t now_ms) {
+    uint8_t pkt[INST_NACK_SIZE];
+    memset(pkt, 0, sizeof(pkt));
+    nwrite_s(pkt, g_inst_rid);                      // rid
+    pkt[4] = 7;                                     // type=7 NACK（不占 seq）
+    nwrite_s(pkt + INST_HDR_SIZE, s->rid);          // target_rid
+    nwrite_s(pkt + INST_HDR_SIZE + 2, s->next_seq); // base_seq
+    uint8_t* bits = pkt + INST_HDR_SIZE + 4;
+    int span = (uint16_t)(s->max_seq - s->next_seq) + 1, missing = 0;
+    for (int i = 0; i < span && i < INST_WINDOW_SIZE; ++i) {
+        if (s->win[(s->next_seq + i) & INST_WINDOW_MASK]) continue;
+        bits[i >> 3] |= (uint8_t)(1u << (i & 7));
+        missing++;
+    }
+    s->nack_ms = now_ms;
+    if (!missing) return;
+    sendto(g_inst_sock, (const char*)pkt, sizeof(pkt), 0,
+           (struct sockaddr*)&g_inst_dest, sizeof(g_inst_dest));
+}
+
+// 可靠模式的定时处理：周期重发 NACK；next_seq 阻塞超过 INST_NACK_GIVEUP_MS 则跳过缺失的包（与窗口溢出时一致）
+static void inst_senders_nack(uint64_t now_ms) {
+    if (!g_inst_gaps) return;
+    for (uint32_t i = 0; i < g_inst_senders_cap; ++i) {
+        inst_sender_t* s = g_inst_senders[i];
+        if (!s || !s->gap) continue;
+        if (now_ms - s->gap_ms >= INST_NACK_GIVEUP_MS) {
+            int dropped = 0;
+            while (!s->win[s->next_seq & INST_WINDOW_MASK] && (int16_t)(s->max_seq - s->next_seq) >= 0) {
+                s->next_seq++;
+                dropped++;
+            }
+            inst_stat_add(s, dropped, (uint64_t)dropped);
+            log_printf(LOG_SLOT_WARN, "INSTRUMENT", "[%d] GIVEUP rid=%u: %d packets not retransmitted\n",
+                       g_inst_rid, s->rid, dropped);
+            inst_sender_flush(s);
+            inst_sender_gap(s, now_ms);
+        }
+        else if (now_ms - s->nack_ms >= INST_NACK_MS) inst_send_nack(s, now_ms);    // 不刷新 last_ms：静默的发送端仍按 TTL 老化
+    }
+}
+
+void
+instrument_sender_ttl(uint32_t ttl_ms) {
+    g_inst_sender_ttl = ttl_ms;
+}
+
+// 导出统计：计数字段直接拷贝，速率按最近 1 秒（当前桶只经过了一部分）折算
+static void inst_stat_out(inst_stat_t* st, instrument_stat_t* out, uint64_t now_ms) {
+    inst_stat_roll(st, now_ms);
+    uint64_t pkts = 0, bytes = 0;
+    for (int i = 0; i < INST_STAT_BUCKETS; ++i) { pkts += st->rate_pkts[i]; bytes += st->rate_bytes[i]; }
+    uint64_t span = (INST_STAT_BUCKETS - 1) * INST_STAT_BUCKET_MS + now_ms % INST_STAT_BUCKET_MS + 1;
+    out->received   = st->received;
+    out->bytes      = st->bytes;
+    out->in_order   = st->in_order;
+    out->reordered  = st->reordered;
+    out->dropped    = st->dropped;
+    out->duplicated = st->duplicated;
+    out->window_max = st->window_max;
+    out->rate_pkts  = pkts * 1000 / span;
+    out->rate_bytes = bytes * 1000 / span;
+}
+
+void
+instrument_stats(instrument_stat_t* total) {
+    memset(total, 0, sizeof(*total));
+    total->sent   = P_get(&g_inst_seq) + P_get(&g_inst_shm_sent);
+    total->rcvbuf = (uint32_t)g_inst_rcvbuf;
+    if (!g_inst_thread) return;                     // 未监听（快照锁未初始化）
+    uint64_t now = inst_now_ms();
+    P_mutex_lock(&g_inst_stat_pub.mutex);
+    inst_stat_out(&g_inst_stat_pub.total, total, now);
+    total->window     = g_inst_stat_pub.window;
+    total->updated_ms = g_inst_stat_pub.updated_ms;
+    P_mutex_unlock(&g_inst_stat_pub.mutex);
+    total->overflows = P_get(&g_inst_rx_ovfl);
+}
+
+size_t
+instrument_stats_read(instrument_stat_t* out, size_t max) {
+    if (!g_inst_thread) return 0;
+    uint64_t now = inst_now_ms();
+    P_mutex_lock(&g_inst_stat_pub.mutex);
+    size_t n = g_inst_stat_pub.n;
+    for (size_t i = 0; out && i < n && i < max; ++i) {
+        inst_stat_pub_t* s = &g_inst_stat_pub.senders[i];
+        instrument_stat_t* o = &out[i];
+        memset(o, 0, sizeof(*o));
+        inst_stat_out(&s->stat, o, now);
+        o->rid        = s->rid;
+        o->window     = s->held;
+        o->updated_ms = s->last_ms;
+    }
+    P_mutex_unlock(&g_inst_stat_pub.mutex);
+    return n;
+}
+
 // 处理 type=1 选项包
 static void inst_handle_bits(uint8_t *payload, int len) {
-    if (len < 3) return;                            // offset(2) + byte(1)
+    if (len < 3) return;                            // offset(2) + byte(1) [+ stamp(8)]
 
     uint16_t byte_idx = nget_s(payload);
     uint8_t  byte_val = payload[2];
-
-    inst_bits_reserve(byte_idx);
-    if (byte_idx < g_inst_bits_len) {
-        g_inst_bits[byte_idx] = byte_val;
-    }
+    uint64_t stamp    = len >= INST_SNAP_REC ? nget_ll(payload + 3) : 0;
+    P_mutex_lock(&g_inst_opt_mutex);
+    inst_bits_apply(byte_idx, byte_val, stamp);
+    P_mutex_unlock(&g_inst_opt_mutex);
 }
 
 // 解析并交付一个数据包到回调
@@ -1461,10 +5430,116 @@ static void inst_handle_bits(uint8_t *payload, int len) {
 // len: 包长度
 // 协议: header(7) = rid(2)+seq(2)+type(1)+chn(1)+tag_len(1)
 //       payload   = tag + \0 + text
-static void inst_deliver(uint16_t rid, uint8_t *pkt, int len) {
+// 大消息到达时按需增大接收缓冲区（只增不减，上限 INST_RCVBUF_MAX）
+static void inst_tune_rcvbuf(int need) {
+    if (need <= g_inst_rcvbuf || g_inst_rcvbuf >= INST_RCVBUF_MAX) return;
+    int size = g_inst_rcvbuf;
+    while (size < need && size < INST_RCVBUF_MAX) size *= 2;
+#if P_LINUX && defined(SO_RCVBUFFORCE)
+    // 有 CAP_NET_ADMIN 时可突破 net.core.rmem_max
+    if (setsockopt(g_inst_sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0)
+#endif
+    P_sock_rcvbuf(g_inst_sock, size);
+    g_inst_rcvbuf = size;
+}
+
+// 追加一个 type=8 分片（需持有 g_inst_rx_mutex），返回重组完成的槽位（调用方处理后 inst_frag_free），否则 NULL
+// 同一消息的分片按序到达：数据分片由窗口保证顺序，控制分片乱序时丢弃，等待 REQ 重发
+static inst_frag_t* inst_frag_put(uint16_t rid, const uint8_t* pkt, int n) {
+    if (n < INST_FRAG_HDR) return NULL;
+    uint16_t id  = nget_s(pkt + INST_HDR_SIZE);
+    uint16_t idx = nget_s(pkt + INST_HDR_SIZE + 2);
+    uint16_t cnt = nget_s(pkt + INST_HDR_SIZE + 4);
+    if (idx >= cnt || (int64_t)cnt * INST_FRAG_CHUNK > INST_MSG_MAX + INST_FRAG_CHUNK) return NULL;
+
+    // 查找消息；新消息优先占用空槽，否则淘汰最久未更新的
+    inst_frag_t *f = NULL, *victim = NULL;
+    for (int i = 0; i < INST_FRAG_SLOTS; ++i) {
+        inst_frag_t* e = &g_inst_frags[i];
+        if (e->cnt && e->rid == rid && e->id == id) { f = e; break; }
+        if (!victim || (victim->cnt && (!e->cnt || e->ms < victim->ms))) victim = e;
+    }
+    if (idx == 0) {                                 // 首片：开始（或重新开始）重组
+        if (!f) f = victim;
+        inst_frag_free(f);
+        f->rid = rid;
+        f->id  = id;
+        f->cnt = cnt;
+        f->next = 0;
+        inst_tune_rcvbuf(cnt * INST_UDP_MAX * 2);
+    }
+    else if (!f) return NULL;                       // 首片已丢失或消息已超时
+    if (idx != f->next || cnt != f->cnt) { inst_frag_free(f); return NULL; }
+
+    int dn = n - INST_FRAG_HDR;
+    if (f->len + dn + 1 > f->cap) {
+        int cap = f->cap ? f->cap : 64 * 1024;
+        while (cap < f->len + dn + 1) cap *= 2;
+        uint8_t* buf = (uint8_t*)realloc(f->buf, cap);
+        if (!buf) { inst_frag_free(f); return NULL; }
+        f->buf = buf;
+        f->cap = cap;
+    }
+    memcpy(f->buf + f->len, pkt + INST_FRAG_HDR, dn);
+    f->len += dn;
+    f->ms = inst_now_ms();
+    return ++f->next == f->cnt ? f : NULL;
+}
+
+// 释放超时未完成的重组（需持有 g_inst_rx_mutex）
+static void inst_frags_age(uint64_t now_ms) {
+    for (int i = 0; i < INST_FRAG_SLOTS; ++i)
+        if (g_inst_frags[i].cnt && now_ms - g_inst_frags[i].ms >= INST_FRAG_TIMEOUT_MS)
+            inst_frag_free(&g_inst_frags[i]);
+}
+
+static void inst_deliver(uint16_t rid, uint8_t *pkt, int len, uint64_t rx_us) {
     assert(g_inst_cb);
     if (len < INST_HDR_SIZE + 2) return;  // 至少 header + tag(1) + \0
 
+    // type=8 数据分片：按 seq 顺序到达，最后一片到达时整条消息交付
+    if ((pkt[4] & INST_TYPE_MASK) == 8) {
+        inst_frag_t* f = inst_frag_put(rid, pkt, len);
+        if (f && f->len >= INST_HDR_SIZE && (f->buf[4] & INST_TYPE_MASK) != 8) inst_deliver(rid, f->buf, f->len, rx_us);
+        if (f) inst_frag_free(f);
+        return;
+    }
+
+    // 发送时间戳：从包末尾取出（之后的位置可作为 \0 余量）
+    uint64_t send_us = 0;
+    if (pkt[4] & INST_TYPE_STAMP) {
+        if (len < INST_HDR_SIZE + INST_STAMP_SIZE) return;
+        len -= INST_STAMP_SIZE;
+        send_us = nget_ll(pkt + len);
+    }
+
+    // type=9 指标包：解码到登记表，不经过回调
+    if ((pkt[4] & INST_TYPE_MASK) == 9) {
+        P_mutex_lock(&g_inst_mreg_mutex);
+        inst_metrics_decode(rid, pkt + INST_HDR_SIZE, pkt + len);
+        P_mutex_unlock(&g_inst_mreg_mutex);
+        return;
+    }
+
+    // type=6 批量包：按顺序逐条交付
+    if ((pkt[4] & INST_TYPE_MASK) == 6) {
+        uint8_t *p = pkt + INST_HDR_SIZE, *end = pkt + len;
+        while (end - p > INST_BATCH_REC_HDR) {
+            uint8_t  chn      = p[0];
+            uint8_t  tag_len  = p[1];
+            int      text_len = nget_s(p + 2);
+            char    *tag      = (char*)p + INST_BATCH_REC_HDR;
+            char    *text     = tag + tag_len + 1;
+            if ((uint8_t*)text + text_len > end) break; // 数据不完整
+            char save = text[text_len];             // 安全：末条记录之后有 +1 余量
+            text[text_len] = '\0';
+            inst_cb_call(rid, chn, tag, text, text_len, send_us, rx_us);
+            text[text_len] = save;
+            p = (uint8_t*)text + text_len;
+        }
+        return;
+    }
+
     uint8_t chn     = pkt[5];                       // header 中的 chn
     uint8_t tag_len = pkt[6];                       // header 中的 tag_len
     
@@ -1478,199 +5553,358 @@ static void inst_deliver(uint16_t rid, uint8_t *pkt, int len) {
     char *text = tag + tag_len + 1;                 // 跳过 \0
     text[text_len] = '\0';                          // 安全：inst_slot_t.data 有 +1 余量
 
-    g_inst_cb(rid, chn, tag, text, text_len);
+    inst_cb_call(rid, chn, tag, text, text_len, send_us, rx_us);
 }
 
-// 接收线程：循环 recvfrom，按 seq 顺序交付到回调
-static int32_t inst_thread_proc(void *ctx) {
-    (void)ctx;
-    uint8_t buf[INST_UDP_MAX + 1];
+// 处理一个收到的数据包，rx_us 为到达时间（墙钟 us）
+static void inst_handle_pkt(uint8_t *buf, int n, uint64_t rx_us) {
+    if (n < INST_HDR_SIZE + 2) return;              // 超时/错误/包太小
 
-    while (g_inst_running) {
-        int n = (int)recvfrom(g_inst_sock, (char*)buf, INST_UDP_MAX, 0, NULL, NULL);
-        if (n < INST_HDR_SIZE + 2) continue;        // 超时/错误/包太小
+    uint16_t rid = nget_s(buf);
+    if (rid == g_inst_rid) return;              // 过滤自己的包
 
-        uint16_t rid = nget_s(buf);
-        if (rid == g_inst_rid) continue;            // 过滤自己的包
+    uint16_t seq = nget_s(buf + 2);
+    uint8_t type = buf[4] & INST_TYPE_MASK;
 
-        uint16_t seq = nget_s(buf + 2);
-        uint8_t type = buf[4];
+    // type=1 选项包：直接处理，不走顺序交付
+    if (type == 1) {
+        inst_handle_bits(buf + INST_HDR_SIZE, n - INST_HDR_SIZE);
+        log_printf(LOG_SLOT_DEBUG, "INSTRUMENT", "[%d] OPTIONS sync rid=%u: byte_idx=%u byte_val=0x%02X\n", 
+                   g_inst_rid, rid, nget_s(buf + INST_HDR_SIZE), buf[INST_HDR_SIZE + 2]);
+        return;
+    }
 
-        // type=1 选项包：直接处理，不走顺序交付
-        if (type == 1) {
-            inst_handle_bits(buf + INST_HDR_SIZE, n - INST_HDR_SIZE);
-            log_printf(LOG_SLOT_DEBUG, "INSTRUMENT", "[%d] OPTIONS sync rid=%u: byte_idx=%u byte_val=0x%02X\n", 
-                       g_inst_rid, rid, nget_s(buf + INST_HDR_SIZE), buf[INST_HDR_SIZE + 2]);
-            continue;
+    // type=11 选项快照：逐条按版本戳应用
+    if (type == 11) {
+        P_mutex_lock(&g_inst_opt_mutex);
+        for (uint8_t *p = buf + INST_HDR_SIZE; p + INST_SNAP_REC <= buf + n; p += INST_SNAP_REC)
+            inst_bits_apply(nget_s(p), p[2], nget_ll(p + 3));
+        P_mutex_unlock(&g_inst_opt_mutex);
+        return;
+    }
+
+    // type=12 快照请求：有选项状态的节点应答（多个请求至少间隔 100ms）
+    if (type == 12) {
+        uint64_t now = inst_now_ms();
+        P_mutex_lock(&g_inst_opt_mutex);
+        if (g_inst_bits_stamped && now - g_inst_snap_ms >= 100) inst_send_snapshot();
+        P_mutex_unlock(&g_inst_opt_mutex);
+        return;
+    }
+
+    // type=2 WAIT 包：通过 cb 通知本地（chn=INSTRUMENT_CTRL, tag=NULL）
+    if (type == 2) {
+        uint8_t *p = buf + INST_HDR_SIZE;
+        int remain = n - INST_HDR_SIZE;
+        if (remain < 1) return;
+        uint8_t port_len = *p++; remain--;
+        if (remain < port_len) return;
+        char port_name[INST_PORT_MAX + 1];
+        if (port_len > INST_PORT_MAX) port_len = INST_PORT_MAX;
+        memcpy(port_name, p, port_len);
+        port_name[port_len] = '\0';
+        p += port_len; remain -= port_len;
+        // from_len + from（可选，此处不需要解析）
+        if (g_inst_cb) {
+            inst_cb_call(rid, g_inst_ctrl, NULL, port_name, port_len, 0, rx_us);
         }
+        return;
+    }
 
-        // type=2 WAIT 包：通过 cb 通知本地（chn=INSTRUMENT_CTRL, tag=NULL）
-        if (type == 2) {
-            uint8_t *p = buf + INST_HDR_SIZE;
-            int remain = n - INST_HDR_SIZE;
-            if (remain < 1) continue;
-            uint8_t port_len = *p++; remain--;
-            if (remain < port_len) continue;
-            char port_name[INST_PORT_MAX + 1];
-            if (port_len > INST_PORT_MAX) port_len = INST_PORT_MAX;
-            memcpy(port_name, p, port_len);
-            port_name[port_len] = '\0';
-            p += port_len; remain -= port_len;
-            // from_len + from（可选，此处不需要解析）
-            if (g_inst_cb) {
-                g_inst_cb(rid, g_inst_ctrl, NULL, port_name, port_len);
-            }
-            continue;
+    // type=3 CONTINUE 包：检查是否是发给自己的
+    if (type == 3) {
+        uint8_t *p = buf + INST_HDR_SIZE;
+        int remain = n - INST_HDR_SIZE;
+        if (remain < 1) return;
+        uint8_t to_len = *p++; remain--;
+        if (remain < to_len) return;
+        // 不需要匹配 to（waiting 方自己在等待，收到即可）
+        p += to_len; remain -= to_len;
+        // 解析 by
+        if (remain < 1) return;
+        uint8_t by_len = *p++; remain--;
+        if (remain < by_len) by_len = (uint8_t)remain;
+        char by_name[INST_PORT_MAX + 1];
+        if (by_len > INST_PORT_MAX) by_len = INST_PORT_MAX;
+        memcpy(by_name, p, by_len);
+        by_name[by_len] = '\0';
+
+        // 不匹配期望的 from，忽略
+        P_mutex_lock(&g_inst_sig.mutex);
+        bool match = !g_inst_wait_from[0] || strcmp(g_inst_wait_from, by_name) == 0;
+        if (match) inst_sig_done(&g_inst_wait_done);
+        P_mutex_unlock(&g_inst_sig.mutex);
+        if (!match) {
+            log_printf(LOG_SLOT_DEBUG, "INSTRUMENT", "[%d] CONTINUE by rid=%u ignored: expected from '%s', but got '%s'\n",
+                    g_inst_rid, rid, g_inst_wait_from, by_name);
+        } else {
+            log_printf(LOG_SLOT_DEBUG, "INSTRUMENT", "[%d] CONTINUE by rid=%u accepted: '%s'/'%s'\n",
+                    g_inst_rid, rid, by_name, g_inst_wait_from[0] ? g_inst_wait_from : "any");
         }
+        return;
+    }
 
-        // type=3 CONTINUE 包：检查是否是发给自己的
-        if (type == 3) {
-            uint8_t *p = buf + INST_HDR_SIZE;
-            int remain = n - INST_HDR_SIZE;
-            if (remain < 1) continue;
-            uint8_t to_len = *p++; remain--;
-            if (remain < to_len) continue;
-            // 不需要匹配 to（waiting 方自己在等待，收到即可）
-            p += to_len; remain -= to_len;
-            // 解析 by
-            if (remain < 1) continue;
-            uint8_t by_len = *p++; remain--;
-            if (remain < by_len) by_len = (uint8_t)remain;
-            char by_name[INST_PORT_MAX + 1];
-            if (by_len > INST_PORT_MAX) by_len = INST_PORT_MAX;
-            memcpy(by_name, p, by_len);
-            by_name[by_len] = '\0';
-
-            // 不匹配期望的 from，忽略
-            if (g_inst_wait_from[0] && strcmp(g_inst_wait_from, by_name) != 0) {
-                log_printf(LOG_SLOT_DEBUG, "INSTRUMENT", "[%d] CONTINUE by rid=%u ignored: expected from '%s', but got '%s'\n",
-                        g_inst_rid, rid, g_inst_wait_from, by_name);
-            } else { g_inst_wait_done = true;
-                log_printf(LOG_SLOT_DEBUG, "INSTRUMENT", "[%d] CONTINUE by rid=%u accepted: '%s'/'%s'\n",
-                        g_inst_rid, rid, by_name, g_inst_wait_from[0] ? g_inst_wait_from : "any");
-            }
-            continue;
+    // type=4 REQ 包：解析 id、msg、content，匹配 g_inst_id 后通过 cb 通知
+    if (type == 4) {
+        uint8_t *p = buf + INST_HDR_SIZE;
+        int remain = n - INST_HDR_SIZE;
+        if (remain < 1) return;
+        uint8_t id_len = *p++; remain--;
+        if (remain < id_len) return;
+        if (id_len > INST_PORT_MAX) id_len = INST_PORT_MAX;
+        char id_name[INST_PORT_MAX + 1];
+        memcpy(id_name, p, id_len);
+        id_name[id_len] = '\0';
+        p += id_len; remain -= id_len;
+
+        // 匹配目标 id：未设置则不接受，空串接受所有，否则精确匹配
+        if (!g_inst_id_set) return;
+        if (g_inst_id[0] && strcmp(g_inst_id, id_name) != 0) return;
+
+        if (remain < 1) return;
+        uint8_t msg_len = *p++; remain--;
+        if (remain < msg_len) return;
+        if (msg_len > INST_PORT_MAX) msg_len = INST_PORT_MAX;
+        char msg_tag[INST_PORT_MAX + 1];
+        memcpy(msg_tag, p, msg_len);
+        msg_tag[msg_len] = '\0';
+        p += msg_len; remain -= msg_len;
+
+        int content_len = remain > 0 ? remain : 0;
+
+        if (g_inst_cb && msg_len > 0) {
+            // txt = content（请求内容），tag = msg；回调中 instrument_resp 自动带上 req_id
+            char stack[INST_UDP_MAX + 1], *cb_buf = stack;
+            if (content_len >= (int)sizeof(stack) && !(cb_buf = (char*)malloc(content_len + 1))) return;
+            if (content_len > 0) memcpy(cb_buf, p, content_len);
+            cb_buf[content_len] = '\0';
+            g_inst_req_cur_rid = rid;
+            g_inst_req_cur_id  = seq;
+            inst_cb_call(rid, g_inst_ctrl, msg_tag, cb_buf, content_len, 0, rx_us);
+            g_inst_req_cur_rid = g_inst_req_cur_id = 0;
+            if (cb_buf != stack) free(cb_buf);
         }
+        return;
+    }
 
-        // type=4 REQ 包：解析 id、msg、content，匹配 g_inst_id 后通过 cb 通知
-        if (type == 4) {
-            uint8_t *p = buf + INST_HDR_SIZE;
-            int remain = n - INST_HDR_SIZE;
-            if (remain < 1) continue;
-            uint8_t id_len = *p++; remain--;
-            if (remain < id_len) continue;
-            if (id_len > INST_PORT_MAX) id_len = INST_PORT_MAX;
-            char id_name[INST_PORT_MAX + 1];
-            memcpy(id_name, p, id_len);
-            id_name[id_len] = '\0';
-            p += id_len; remain -= id_len;
-
-            // 匹配目标 id：未设置则不接受，空串接受所有，否则精确匹配
-            if (!g_inst_id_set) continue;
-            if (g_inst_id[0] && strcmp(g_inst_id, id_name) != 0) continue;
-
-            if (remain < 1) continue;
-            uint8_t msg_len = *p++; remain--;
-            if (remain < msg_len) continue;
-            if (msg_len > INST_PORT_MAX) msg_len = INST_PORT_MAX;
-            char msg_tag[INST_PORT_MAX + 1];
-            memcpy(msg_tag, p, msg_len);
-            msg_tag[msg_len] = '\0';
-            p += msg_len; remain -= msg_len;
-
-            int content_len = remain > 0 ? remain : 0;
-
-            if (g_inst_cb && msg_len > 0) {
-                // txt = content（请求内容），tag = msg
-                char cb_buf[INST_UDP_MAX + 1];
-                if (content_len > 0) memcpy(cb_buf, p, content_len);
-                cb_buf[content_len] = '\0';
-                g_inst_cb(rid, g_inst_ctrl, msg_tag, cb_buf, content_len);
-            }
-            continue;
+    // type=5 RESP 包：检查目标 rid，按 req_id（seq 字段）找到请求，写入请求方 buffer
+    if (type == 5) {
+        uint8_t *p = buf + INST_HDR_SIZE;
+        int remain = n - INST_HDR_SIZE;
+        if (remain < 2) return;                  // target_rid(2)
+        uint16_t target_rid = nget_s(p); p += 2; remain -= 2;
+        if (target_rid != g_inst_rid) return;
+
+        P_mutex_lock(&g_inst_sig.mutex);
+        inst_req_t* r = inst_req_find(seq);
+        if (!r) { P_mutex_unlock(&g_inst_sig.mutex); return; }     // 重复或迟到的 resp
+        int nr = 0;
+        if (r->buf && r->bufsz > 0) {
+            nr = remain < (int)r->bufsz - 1 ? remain : (int)r->bufsz - 1;
+            memcpy(r->buf, p, nr);
+            r->buf[nr] = '\0';
         }
+        uint16_t h = r->id;
+        instrument_req_cb cb = r->cb; void* ctx = r->ctx; char* rbuf = r->buf;
+        bool call = inst_req_complete(r, E_NONE);
+        P_mutex_unlock(&g_inst_sig.mutex);
+        if (call) cb(ctx, h, E_NONE, rbuf, nr);
+        log_printf(LOG_SLOT_DEBUG, "INSTRUMENT", "[%d] RESP from rid=%u: %d bytes\n",
+                g_inst_rid, rid, remain);
+        return;
+    }
 
-        // type=5 RESP 包：检查目标 rid，写入请求方 buffer
-        if (type == 5) {
-            uint8_t *p = buf + INST_HDR_SIZE;
-            int remain = n - INST_HDR_SIZE;
-            if (remain < 2) continue;                // target_rid(2)
-            uint16_t target_rid = nget_s(p); p += 2; remain -= 2;
-            if (target_rid != g_inst_rid) continue;
+    // type=7 NACK 包：对端请求重传本节点的数据包
+    if (type == 7) {
+        if (n >= INST_NACK_SIZE && nget_s(buf + INST_HDR_SIZE) == g_inst_rid)
+            inst_rtx_resend(nget_s(buf + INST_HDR_SIZE + 2), buf + INST_HDR_SIZE + 4);
+        return;
+    }
 
-            if (g_inst_req_buf && g_inst_req_bufsz > 0) {
-                size_t sz = g_inst_req_bufsz;
-                size_t nr = (size_t)remain < sz - 1 ? (size_t)remain : sz - 1;
-                memcpy(g_inst_req_buf, p, nr);
-                g_inst_req_buf[nr] = '\0';
-            }
-            g_inst_req_done = true;
-            log_printf(LOG_SLOT_DEBUG, "INSTRUMENT", "[%d] RESP from rid=%u: %d bytes\n",
-                    g_inst_rid, rid, remain);
-            continue;
-        }
+    // type=10 订阅包：更新发送兴趣，应答查询
+    if (type == 10) {
+        if (n >= INST_INTEREST_SIZE) inst_interest_recv(buf, inst_now_ms());
+        return;
+    }
+
+    // type=8 控制包分片（内层类型非 0，不占 seq）：重组后按普通控制包处理
+    if (type == 8 && n > INST_HDR_SIZE && buf[5] != 0) {
+        inst_frag_t* f = inst_frag_put(rid, buf, n);
+        if (!f) return;
+        if (f->len > INST_HDR_SIZE + 2 && (f->buf[4] & INST_TYPE_MASK) != 8 && nget_s(f->buf) == rid)
+            inst_handle_pkt(f->buf, f->len, rx_us);
+        inst_frag_free(f);
+        return;
+    }
 
-        // type!=0 未知类型，丢弃
-        if (type != 0) continue;
+    // 其余非数据包（type!=0 且非 type=6 批量包、type=8 数据分片、type=9 指标包）为未知类型，丢弃
+    if (type != 0 && type != 6 && type != 8 && type != 9) return;
 
-        // 回环检测：INSTRUMENT 内部日志已是 ACK，不再生成 INSTRUMENT 诊断日志
-        uint8_t pkt_tag_len = buf[6];
-        bool is_echo = (pkt_tag_len == 10 && memcmp(buf + INST_HDR_SIZE, "INSTRUMENT", 10) == 0);
+    // 回环检测：INSTRUMENT 内部日志已是 ACK，不再生成 INSTRUMENT 诊断日志（批量包检查首条记录）
+    uint8_t *pkt_tag = buf + INST_HDR_SIZE;
+    uint8_t pkt_tag_len = buf[6];
+    if (type == 6) { pkt_tag_len = buf[INST_HDR_SIZE + 1]; pkt_tag += INST_BATCH_REC_HDR; }
+    bool is_echo = (pkt_tag_len == 10 && pkt_tag + 10 <= buf + n && memcmp(pkt_tag, "INSTRUMENT", 10) == 0);
 
-        // 获取该 rid 的序号追踪器
-        inst_sender_t *sender = inst_find_sender(rid);
-        if (!sender) continue;                      // OOM
+    // 获取该 rid 的序号追踪器
+    inst_sender_t *sender = inst_find_sender(rid, inst_now_ms());
+    if (!sender) return;                        // OOM
 
-        // 首包同步
-        if (!sender->synced) {
-            sender->synced = true;
-            sender->next_seq = seq;
+    // 首包同步
+    if (!sender->synced) {
+        sender->synced = true;
+        sender->next_seq = sender->max_seq = seq;
+    }
+    sender->reliable = (buf[4] & INST_TYPE_RELIABLE) != 0;
+    inst_stat_rx(&sender->stat, n, sender->last_ms);
+    inst_stat_rx(&g_inst_stat, n, sender->last_ms);
+
+    int16_t diff = (int16_t)(seq - sender->next_seq);
+    if (diff < 0) { inst_stat_add(sender, duplicated, 1); return; }     // 旧包/重复
+    if ((int16_t)(seq - sender->max_seq) > 0) sender->max_seq = seq;
+
+    // 超出窗口 → 滑动推进：交付已缓存的有效包，跳过空槽
+    if (diff >= INST_WINDOW_SIZE) {
+        uint16_t advance_to = (uint16_t)(seq - INST_WINDOW_SIZE + 1);
+        int delivered = 0, dropped = 0;
+        while (sender->next_seq != advance_to) {
+            int idx = sender->next_seq & INST_WINDOW_MASK;
+            if (sender->win[idx]) {
+                if (g_inst_cb) inst_deliver(rid, sender->win[idx]->data, sender->win[idx]->len, sender->win[idx]->rx_us);
+                inst_slot_free(sender, idx);
+                delivered++;
+            } else dropped++;
+            sender->next_seq++;
+        }
+        inst_stat_add(sender, dropped, (uint64_t)dropped);
+        if (!is_echo) {
+            log_printf(LOG_SLOT_WARN, "INSTRUMENT", "[%d] SLIDE rid=%u: seq %u→%u (delivered=%d dropped=%d)\n",
+                        g_inst_rid, rid, (uint16_t)(advance_to - delivered - dropped), seq, delivered, dropped);
         }
+        diff = (int16_t)(seq - sender->next_seq);
+    }
 
-        int16_t diff = (int16_t)(seq - sender->next_seq);
-        if (diff < 0) continue;                     // 旧包/重复
+    // 按序到达：直接交付，然后 flush 连续已缓存的包
+    if (diff == 0) {
+        inst_stat_add(sender, in_order, 1);
+        if (g_inst_cb && n > INST_HDR_SIZE) inst_deliver(rid, buf, n, rx_us);
+        sender->next_seq++;
+        inst_sender_flush(sender);
+        inst_sender_gap(sender, sender->last_ms);
+    } else {
+        // 0 < diff < WINDOW_SIZE：缓存到窗口槽位，等待前序包到达
+        int idx = seq & INST_WINDOW_MASK;
+        if (!sender->win[idx]) {
+            if (!(sender->win[idx] = inst_slot_alloc())) return;    // OOM：按丢包处理
+            sender->held++;
+            inst_stat_add(sender, reordered, 1);
+            if (sender->held > sender->stat.window_max) sender->stat.window_max = sender->held;
+            if (sender->held > g_inst_stat.window_max) g_inst_stat.window_max = sender->held;
+        }
+        else inst_stat_add(sender, duplicated, 1);
+        memcpy(sender->win[idx]->data, buf, n);
+        sender->win[idx]->len = n;
+        sender->win[idx]->rx_us = rx_us;
+
+        // 可靠模式：立即请求重传缺失的包（之后由接收线程按 INST_NACK_MS 周期重发 NACK）
+        inst_sender_gap(sender, sender->last_ms);
+        if (sender->gap && sender->last_ms - sender->nack_ms >= INST_NACK_MS) inst_send_nack(sender, sender->last_ms);
+    }
+    if (!is_echo) {
+        log_printf(LOG_SLOT_VERBOSE, "INSTRUMENT", "[%d] RECV rid=%u: seq=%u (next=%u)\n",
+                    g_inst_rid, rid, seq, sender->next_seq);
+    }
+}
 
-        // 超出窗口 → 滑动推进：交付已缓存的有效包，跳过空槽
-        if (diff >= INST_WINDOW_SIZE) {
-            uint16_t advance_to = (uint16_t)(seq - INST_WINDOW_SIZE + 1);
-            int delivered = 0, dropped = 0;
-            while (sender->next_seq != advance_to) {
-                int idx = sender->next_seq & INST_WINDOW_MASK;
-                if (sender->win[idx].len > 0) {
-                    if (g_inst_cb) inst_deliver(rid, sender->win[idx].data, sender->win[idx].len);
-                    sender->win[idx].len = 0;
-                    delivered++;
-                } else dropped++;
-                sender->next_seq++;
-            }
-            if (!is_echo) {
-                log_printf(LOG_SLOT_WARN, "INSTRUMENT", "[%d] SLIDE rid=%u: seq %u→%u (delivered=%d dropped=%d)\n",
-                            g_inst_rid, rid, (uint16_t)(advance_to - delivered - dropped), seq, delivered, dropped);
-            }
-            diff = (int16_t)(seq - sender->next_seq);
+#if P_LINUX && defined(MSG_WAITFORONE)
+// 解析接收辅助数据，返回内核接收时间（墙钟 us，未开启 SO_TIMESTAMPNS 时为 0）
+// SO_RXQ_OVFL 为 socket 自创建以来因接收队列满被内核丢弃的包数（有丢包后才附带）
+static uint64_t inst_rx_cmsg(struct msghdr* mh) {
+    uint64_t rx_us = 0;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(mh); c; c = CMSG_NXTHDR(mh, c)) {
+        if (c->cmsg_level != SOL_SOCKET) continue;
+#ifdef SO_RXQ_OVFL
+        if (c->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+            P_set(&g_inst_rx_ovfl, drops);
+        }
+#endif
+#ifdef SCM_TIMESTAMPNS
+        if (c->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            rx_us = (uint64_t)clock_us(ts);
         }
+#endif
+    }
+    return rx_us;
+}
+#endif
 
-        // 按序到达：直接交付，然后 flush 连续已缓存的包
-        if (diff == 0) {
-            if (g_inst_cb && n > INST_HDR_SIZE) inst_deliver(rid, buf, n);
-            sender->next_seq++;
-            for (;;) {
-                int idx = sender->next_seq & INST_WINDOW_MASK;
-                if (sender->win[idx].len == 0) break;
-                if (g_inst_cb) inst_deliver(rid, sender->win[idx].data, sender->win[idx].len);
-                sender->win[idx].len = 0;
-                sender->next_seq++;
+// 接收线程：批量接收数据包（Linux 使用 recvmmsg，一次系统调用取多个包），按 seq 顺序交付到回调
+static int32_t inst_thread_proc(void *ctx) {
+    (void)ctx;
+
+#if P_LINUX && defined(MSG_WAITFORONE)
+    static uint8_t bufs[INST_RECV_BATCH][INST_UDP_MAX + 1];
+    static uint64_t ctrls[INST_RECV_BATCH][INST_RECV_CTRL / 8];         // 按 cmsghdr 对齐
+    struct mmsghdr msgs[INST_RECV_BATCH];
+    struct iovec iovs[INST_RECV_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < INST_RECV_BATCH; ++i) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len  = INST_UDP_MAX;
+        msgs[i].msg_hdr.msg_iov    = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = ctrls[i];
+    }
+    bool mmsg = true;
+#endif
+    uint8_t buf[INST_UDP_MAX + 1];
+
+    inst_send_snap_req();                           // 获取本节点启动前设置的选项
+
+    int timeout = 100;
+    while (g_inst_running) {
+        // sender 表由本线程独占；加锁是因为重组表、聚合统计与共享内存读取线程共用
+        // 有等待重传的空洞时缩短接收超时，以便按时重发 NACK / 放弃
+        uint64_t now = inst_now_ms();
+        P_mutex_lock(&g_inst_rx_mutex);
+        if (g_inst_senders_reset) { g_inst_senders_reset = false; inst_free_senders(); }
+        inst_senders_age(now);
+        inst_senders_nack(now);
+        inst_frags_age(now);
+        inst_bits_tick(now);
+        inst_stats_publish();                       // 上一批接收的统计
+        P_mutex_unlock(&g_inst_rx_mutex);
+        inst_reqs_tick(now);
+        inst_interest_tick(now);
+        int want = g_inst_gaps ? INST_NACK_MS : 100;
+        if (want != timeout) P_sock_rcvtimeo(g_inst_sock, timeout = want);
+#if P_LINUX && defined(MSG_WAITFORONE)
+        // MSG_WAITFORONE：阻塞到第一个包到达（受 SO_RCVTIMEO 限制），之后取走已排队的包立即返回
+        if (mmsg) {
+            for (int i = 0; i < INST_RECV_BATCH; ++i) msgs[i].msg_hdr.msg_controllen = INST_RECV_CTRL;
+            int cnt = recvmmsg(g_inst_sock, msgs, INST_RECV_BATCH, MSG_WAITFORONE, NULL);
+            if (cnt < 0 && errno == ENOSYS) { mmsg = false; continue; }
+            if (cnt <= 0) continue;
+            uint64_t now_us = inst_wall_us();
+            P_mutex_lock(&g_inst_rx_mutex);
+            for (int i = 0; i < cnt; ++i) {
+                uint64_t rx_us = inst_rx_cmsg(&msgs[i].msg_hdr);
+                inst_handle_pkt(bufs[i], (int)msgs[i].msg_len, rx_us ? rx_us : now_us);
             }
-        } else {
-            // 0 < diff < WINDOW_SIZE：缓存到窗口槽位，等待前序包到达
-            int idx = seq & INST_WINDOW_MASK;
-            memcpy(sender->win[idx].data, buf, n);
-            sender->win[idx].len = n;
-        }
-        if (!is_echo) {
-            log_printf(LOG_SLOT_VERBOSE, "INSTRUMENT", "[%d] RECV rid=%u: seq=%u (next=%u)\n",
-                        g_inst_rid, rid, seq, sender->next_seq);
+            P_mutex_unlock(&g_inst_rx_mutex);
+            continue;
         }
+#endif
+        int n = (int)recvfrom(g_inst_sock, (char*)buf, INST_UDP_MAX, 0, NULL, NULL);
+        if (n <= 0) continue;
+        uint64_t rx_us = inst_wall_us();
+        P_mutex_lock(&g_inst_rx_mutex);
+        inst_handle_pkt(buf, n, rx_us);
+        P_mutex_unlock(&g_inst_rx_mutex);
     }
     return 0;
 }
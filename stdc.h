@@ -8,6 +8,7 @@
 #pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
 #pragma ide diagnostic ignored "UnreachableCallsOfFunction"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
@@ -254,9 +255,98 @@ typedef void(*log_cb)(log_level_e level, const char* tag, char *txt, int len);
 #endif
 #endif
 
+/**
+ * @brief 设置日志文件输出（与控制台/回调同时输出）
+ * @param filename 日志文件路径，NULL 关闭文件输出
+ * @param sz_max 单个文件最大字节数，超过后轮转为 filename.1 ... filename.N；0 表示不限制
+ * @note 日志先写入用户态缓冲，在缓冲满、ERROR/FATAL 级别、距上次写入超过 1 秒（由后台定时线程检查，
+ *       无新日志时同样写出）、log_flush() 或进程退出时再以一次 write 调用写出
+ */
 void
 log_output(cstr_t filename, uint32_t sz_max);
 
+/**
+ * @brief 设置日志文件的按时间轮转及保留数量
+ * @param interval_s 轮转周期（秒，按墙上时钟对齐，如 86400 为按天），0 表示不按时间轮转
+ * @param keep 保留的历史文件数（默认 5），0 表示轮转时直接丢弃旧文件
+ */
+void
+log_rotate(uint32_t interval_s, uint8_t keep);
+
+/**
+ * @brief 设置二进制日志文件输出（替代 log_output 的文本文件）
+ * @param filename 日志文件路径，NULL 关闭（同 log_output(NULL, 0)）
+ * @param sz_max 单个文件最大字节数，轮转规则同 log_output
+ * @note 开启后 log_slot/print 不再格式化文本，只记录格式串 ID、时间戳和原始参数，
+ *       由 log_binary_decode 离线还原；FATAL、缓存模式输出及含 %n/%Lf/%ls/%.Ns 等的格式串仍以文本记录写入。
+ *       二进制模式下日志只写入文件（FATAL 除外），也不再镜像到 instrument
+ */
+void
+log_binary(cstr_t filename, uint32_t sz_max);
+
+/**
+ * @brief 解码二进制日志文件
+ * @param filename 由 log_binary 生成的文件（需在相同架构下解码）
+ * @param cb 逐条输出回调，txt 以 "YYYY-MM-DD HH:MM:SS.uuuuuu " 开头；NULL 或 (log_cb)-1 输出到 stdout
+ * @return E_NONE 成功，E_INVALID 文件损坏，E_NO_SUPPORT 字节序或类型尺寸不匹配
+ */
+ret_t
+log_binary_decode(cstr_t filename, log_cb cb);
+
+/**
+ * @brief 开启飞行记录器：日志写入固定大小的 mmap 环形文件，写入路径无系统调用
+ * @param filename 记录文件（会被截断重建），NULL 关闭
+ * @param size 文件大小（按 16KB 分块，至少 4 块）
+ * @param level 级别数值 >= level 的日志（如 LOG_SLOT_DEBUG 表示 DEBUG/VERBOSE）只写入记录器；
+ *              更严重的日志同时写入记录器和正常输出目标（超出 LOG_LEVEL 的仍只写入记录器）
+ * @return E_NONE 成功，E_NO_SUPPORT 平台不支持（Windows）
+ * @note 开启后所有级别的 print 调用点都会被启用，超出 LOG_LEVEL 的输出只写入记录器。
+ *       进程崩溃后内核保留已写入的页面，用 log_recorder_dump 还原
+ *       切换/关闭时不解除旧的映射（可能仍有线程在写入），每次切换保留 size 字节的地址空间；应在初始化等少数场合调用
+ */
+ret_t
+log_recorder(cstr_t filename, uint32_t size, log_level_e level);
+
+/**
+ * @brief 按全局顺序还原飞行记录器文件中的日志
+ * @param cb 逐条输出回调，txt 以时间戳开头；NULL 或 (log_cb)-1 输出到 stdout
+ */
+ret_t
+log_recorder_dump(cstr_t filename, log_cb cb);
+
+extern uint8_t log_recorder_level;              /* 飞行记录器级别，0 表示未开启（供 print 使用） */
+
+#define LOG_SLOT_REC_ONLY       0x80            /* 与级别组合传给 log_slot：仅写入飞行记录器（供 print 使用） */
+
+typedef enum {
+    LOG_PREFIX_NONE     = 0,
+    LOG_PREFIX_WALL     = 1,    // 本地时间 "YYYY-MM-DD HH:MM:SS.uuuuuu"（按秒缓存格式化结果）
+    LOG_PREFIX_MONO     = 2,    // 单调时钟 "秒.微秒"
+    LOG_PREFIX_TID      = 4,    // 内核线程 ID
+} log_prefix_e;
+
+/**
+ * @brief 设置日志行前缀（默认无前缀）
+ * @param flags log_prefix_e 组合，依次输出在 tag 之前
+ * @note 不影响 instrument 镜像及二进制日志（二进制记录自带时间戳）
+ */
+void
+log_prefix(int flags);
+
+typedef enum {
+    LOG_SYNC_NONE       = 0,    // 不主动 fsync（默认）
+    LOG_SYNC_INTERVAL   = 1,    // 距上次 fsync 超过 interval_ms 后同步（后台定时线程检查，精度约 100ms）
+    LOG_SYNC_ERROR      = 2,    // ERROR/FATAL 日志写出后立即同步
+} log_sync_e;
+
+/**
+ * @brief 设置日志文件的落盘（fsync）策略
+ * @param policy log_sync_e 组合
+ * @param interval_ms LOG_SYNC_INTERVAL 的同步周期
+ */
+void
+log_sync(int policy, uint32_t interval_ms);
+
 /**
  * @brief 日志输出
  *        该操作的主要场景是被 print() 自动调用。应用层应该首选 print()，而不是直接调用 log_slot()
@@ -273,6 +363,44 @@ log_output(cstr_t filename, uint32_t sz_max);
 void
 log_slot(log_level_e level, const char* tag, const char* fmt, va_list params, log_cb cb_log, bool pre_tag);
 
+/**
+ * 异步日志队列满时的处理策略
+ */
+typedef enum {
+    LOG_ASYNC_BLOCK = 0,                            /* 阻塞等待写线程消费（不丢日志） */
+    LOG_ASYNC_DROP_NEWEST,                          /* 丢弃当前（最新）日志 */
+    LOG_ASYNC_DROP_OLDEST,                          /* 丢弃队列中最旧的日志 */
+} log_async_e;
+
+/**
+ * @brief 开启/关闭异步日志模式
+ *        开启后 log_slot() 在调用线程中只完成格式化，并将结果拷贝到无锁队列，
+ *        由后台写线程（P_thread）批量输出到目标（stdout、系统日志、回调或文件）
+ * @param capacity 队列容量（日志条数，自动向上取整为 2 的幂），0 表示关闭异步模式
+ * @param policy 队列满时的处理策略
+ * @return E_NONE 成功，否则返回错误码
+ * @note  关闭异步模式时，会先输出队列中所有剩余日志
+ *        FATAL 级别日志会在入队后自动执行 log_flush()，进程退出时也会自动 flush
+ *        应在程序初始化阶段调用，不应与其他线程的日志输出并发调用
+ */
+ret_t
+log_async(uint32_t capacity, log_async_e policy);
+
+/**
+ * @brief 等待异步队列中当前已提交的所有日志输出完成（非异步模式下直接返回）
+ * @note  用于退出、崩溃处理等需要确保日志落地的场景
+ *        stdout 非终端时日志先暂存（最迟 100ms 后写出），与应用自身的 printf/stdio 输出混用且需保持先后顺序时，
+ *        在 stdio 输出之前调用本函数
+ */
+void
+log_flush(void);
+
+/**
+ * @brief 获取异步模式下由于队列满而丢弃的日志条数
+ */
+uint64_t
+log_dropped(void);
+
 //-----------------------------------------------------------------------------
 
 /**
@@ -285,6 +413,78 @@ log_slot(log_level_e level, const char* tag, const char* fmt, va_list params, lo
  */
 typedef void(*instrument_cb)(uint16_t rid, uint8_t chn, const char* tag, char *txt, int len);
 
+/**
+ * instrument 消息的时间信息（instrument_ex_cb 的 meta 参数）
+ */
+typedef struct {
+    uint64_t                    send_us;            /* 发送方墙钟时间（us），发送方未开启 instrument_timestamp 时为 0 */
+    uint64_t                    recv_us;            /* 接收时间（墙钟 us）：Linux 为内核 SO_TIMESTAMPNS，否则为接收线程取包时间 */
+} instrument_meta_t;
+
+/**
+ * @brief                       带时间信息的 instrument 消息回调（instrument_listen_ex）
+ * @param meta                  时间信息（非 NULL）；其余参数同 instrument_cb
+ */
+typedef void(*instrument_ex_cb)(uint16_t rid, uint8_t chn, const char* tag, char *txt, int len, const instrument_meta_t* meta);
+
+/**
+ * instrument 指标类型
+ */
+typedef enum {
+    INSTRUMENT_COUNTER = 0,                         /* 计数器：发送增量，监听方累加 */
+    INSTRUMENT_GAUGE,                               /* 仪表：发送最新值 */
+    INSTRUMENT_HISTOGRAM,                           /* 直方图：样本数、样本和及 log2 分桶 */
+} instrument_metric_e;
+
+#define INSTRUMENT_METRIC_NAME      64              /* 指标名称最大长度（含 '\0'） */
+#define INSTRUMENT_METRIC_BUCKETS   32              /* 直方图桶数：桶 0 为 <= 0 的样本，桶 i 为 [2^(i-1), 2^i)，末桶不封顶 */
+
+/**
+ * 监听方登记表中的一个指标（instrument_metrics_read 的输出）
+ */
+typedef struct {
+    uint16_t                    rid;                /* 发送方节点 ID */
+    uint16_t                    id;                 /* 发送方的指标 ID */
+    uint8_t                     kind;               /* instrument_metric_e */
+    char                        name[INSTRUMENT_METRIC_NAME];   /* 尚未收到定义时为空串 */
+    int64_t                     value;              /* counter: 累计值；gauge: 最新值；histogram: 样本和 */
+    uint64_t                    count;              /* histogram: 样本数 */
+    uint64_t                    buckets[INSTRUMENT_METRIC_BUCKETS];
+    uint64_t                    updated_ms;         /* 最近更新时间（单调时钟 ms） */
+} instrument_metric_t;
+
+/**
+ * 异步发送统计（instrument_async_stat 的输出）
+ */
+typedef struct {
+    uint32_t                    depth;              /* 普通环深度，0 表示未开启过 */
+    uint32_t                    pending;            /* 当前排队等待发送的包数 */
+    uint64_t                    sent;               /* 发送线程已发出的包数 */
+    uint32_t                    dropped;            /* 普通环满时丢弃的包数 */
+    uint32_t                    overflow;           /* 高优先级环满时改由调用线程直接发送的包数 */
+} instrument_async_stat_t;
+
+/**
+ * 接收统计（instrument_stats / instrument_stats_read 的输出）
+ */
+typedef struct {
+    uint16_t                    rid;                /* 发送方节点 ID（聚合统计为 0） */
+    uint64_t                    received;           /* 收到的数据包数（含重复） */
+    uint64_t                    bytes;              /* 收到的数据包字节数 */
+    uint64_t                    in_order;           /* 按序到达、直接交付的包数 */
+    uint64_t                    reordered;          /* 提前到达、缓存到窗口后交付的包数 */
+    uint64_t                    dropped;            /* 未能补齐而跳过的 seq 数（窗口滑过 / 放弃重传） */
+    uint64_t                    duplicated;         /* 重复或早于窗口的包数 */
+    uint32_t                    window;             /* 当前窗口中缓存的包数（聚合为各发送方之和） */
+    uint32_t                    window_max;         /* 窗口占用峰值（聚合为单个发送方的峰值） */
+    uint64_t                    rate_pkts;          /* 最近 1 秒接收速率（包/秒，100ms 粒度滑动） */
+    uint64_t                    rate_bytes;         /* 最近 1 秒接收速率（字节/秒） */
+    uint64_t                    updated_ms;         /* 最近收到包的时间（单调时钟 ms） */
+    uint32_t                    sent;               /* 仅聚合：本进程发送的数据包数（32 位回绕） */
+    uint32_t                    overflows;          /* 仅聚合：内核接收队列满丢弃的包数（Linux SO_RXQ_OVFL） */
+    uint32_t                    rcvbuf;             /* 仅聚合：当前接收缓冲区大小（字节） */
+} instrument_stat_t;
+
 #ifdef LOG_INSTRUMENT
 
 #ifndef INSTRUMENT_PORT
@@ -299,6 +499,10 @@ typedef void(*instrument_cb)(uint16_t rid, uint8_t chn, const char* tag, char *t
 #define INSTRUMENT_OPT_BASE     0
 #endif
 
+#ifndef INSTRUMENT_LOG_BASE
+#define INSTRUMENT_LOG_BASE     1024                /* 远程日志级别在选项 bitset 中的起始位（需 8 对齐，占 256 位） */
+#endif
+
 #define INST_PORT_MAX           32                                  // 端口/标识名称最大长度
 
 /**
@@ -354,9 +558,113 @@ void instrument_remote(void);
  * @param params                可变参数列表
  * @note                        以 UDP 广播方式发送到局域网
  *                              首次调用时自动初始化 socket，进程退出时自动关闭
+ *                              超过单包容量的文本分片发送（上限 16MB），接收方重组后一次交付
  */
 void instrument_slot(uint8_t chn, const char* tag, const char* fmt, va_list params);
 
+/**
+ * @brief                       开启/关闭批量发送
+ * @param deadline_us           记录在缓冲区中的最长停留时间（微秒），0 表示关闭（并立即发送已缓存的记录）
+ * @return                      E_NONE 成功，否则返回错误码
+ * @note                        开启后多条记录打包到一个 UDP 包（type=6）中发送，包满、超过 deadline
+ *                              或调用 instrument_flush 时发出；同一线程的记录保持顺序，本地回调不受影响
+ *                              后台冲刷线程按 deadline/2 周期检查，进程退出时自动发送剩余记录
+ */
+ret_t instrument_batch(uint32_t deadline_us);
+
+/**
+ * @brief                       立即发送所有批量缓冲区中的记录，以及已累计的指标增量；异步发送时等待队列发空
+ */
+void instrument_flush(void);
+
+/**
+ * @brief                       注册命名指标
+ * @param name                  指标名称（非空，最长 INSTRUMENT_METRIC_NAME - 1）
+ * @param kind                  指标类型
+ * @return                      指标 id（>= 0），同名同类型重复注册返回已有 id；
+ *                              E_CONFLICT 同名不同类型，E_OUT_OF_CAPACITY 超出容量（256 个指标 / 4096 个累计单元）
+ * @note                        应在初始化阶段注册，热路径通过 id 访问
+ */
+int instrument_metric(cstr_t name, instrument_metric_e kind);
+
+/**
+ * @brief                       累加计数器 / 设置仪表值 / 记录直方图样本
+ * @param id                    instrument_metric 返回的 id（类型不符或无效时忽略）
+ * @note                        只在本线程的分片内累加（分片按线程轮流分配，通常无竞争），由 instrument_metrics 的冲刷线程
+ *                              或 instrument_flush 合并各分片后以 type=9 二进制包发送增量；同一周期内 gauge 取最后写入的值
+ */
+void instrument_count(int id, int64_t delta);
+void instrument_gauge(int id, int64_t value);
+void instrument_observe(int id, int64_t value);
+
+/**
+ * @brief                       开启/关闭指标周期冲刷
+ * @param interval_ms           冲刷周期（毫秒），0 表示关闭（并立即发送已累计的增量）
+ * @return                      E_NONE 成功，否则返回错误码
+ * @note                        只发送本周期有变化的指标；名称定义随首次数据发送并每 5 秒重发，供后加入的监听方解析
+ *                              进程退出时自动发送剩余增量；本地模式下只清空不发送
+ */
+ret_t instrument_metrics(uint32_t interval_ms);
+
+/**
+ * @brief                       读取监听方登记表中的指标
+ * @param out                   输出数组（nullable，仅查询数量）
+ * @param max                   out 的容量
+ * @return                      登记表中的指标总数（可能大于 max，只拷贝前 max 个）
+ * @note                        需先 instrument_listen（非 NULL 回调）；按 (rid, id) 登记，counter/histogram 累计全部增量
+ *                              发送方被老化移除或重新 instrument_listen 时清除其指标；本进程发送的指标不进入登记表
+ */
+size_t instrument_metrics_read(instrument_metric_t* out/* nullable */, size_t max);
+
+/**
+ * @brief                       开启/关闭同主机共享内存传输（仅 Linux，HOST 模式）
+ * @param size                  本进程发送环形区大小（字节，最小 64KB），0 表示关闭并恢复 UDP 组播
+ * @return                      E_NONE 成功，E_NO_SUPPORT 平台不支持，E_OUT_OF_CAPACITY 登记表已满
+ * @note                        开启后数据包写入共享内存（/dev/shm/stdc_inst_<port>_<pid>），发送路径无系统调用
+ *                              （仅在有监听方休眠时 futex 唤醒一次）；同主机的 instrument_listen 自动读取，
+ *                              回调语义与 UDP 相同（同一 rid 按顺序交付）。选项、WAIT/REQ 等控制包仍走 UDP
+ *                              监听方落后超过环形区大小时丢弃被覆盖的记录
+ *                              环形区权限为 0600，只有同一用户的监听方能够读取
+ */
+ret_t instrument_shm(uint32_t size);
+
+/**
+ * @brief                       开启/关闭 NACK 重传（可靠模式）
+ * @param depth                 重传环深度（数据包个数，2 的幂），0 表示关闭
+ * @return                      E_NONE 成功，E_INVALID depth 不是 2 的幂，否则返回错误码
+ * @note                        开启后数据包带可靠标志并保留最近 depth 个副本；接收方发现空洞时发送 NACK（type=7），
+ *                              发送方重发仍在环中的包。空洞超过 200ms 未补齐时接收方跳过（与未开启时的丢包语义相同）
+ *                              内部启动接收线程处理 NACK；共享内存传输不丢包，不经过重传环
+ */
+ret_t instrument_reliable(uint32_t depth);
+
+/**
+ * @brief                       开启/关闭异步发送
+ * @param depth                 普通环深度（包个数，2 的幂），0 表示关闭
+ * @return                      E_NONE 成功，E_INVALID depth 不是 2 的幂，否则返回错误码
+ * @note                        开启后调用线程把准备好的包拷贝进有界无锁队列后立即返回，sendto / sendmmsg 由后台
+ *                              发送线程批量执行；队列满时丢弃并计数（接收方表现为丢包）。WAIT/CONTINUE/REQ/RESP
+ *                              及 instrument_priority 指定的通道走独立的高优先级队列，总是先于普通数据发送，满时直接发送
+ *                              队列内存在首次开启时分配（约 depth * 1.4KB），之后再次开启沿用原深度；关闭后已排队的包继续发出
+ *                              选项、订阅、NACK 等由后台线程发送的包及超长 REQ/RESP 的分片不经过队列（保持分片顺序）
+ */
+ret_t instrument_async(uint32_t depth);
+
+/**
+ * @brief                       设置数据通道的异步发送优先级
+ * @param chn                   消息通道
+ * @param high                  true=走高优先级队列，false=普通队列（默认）
+ * @note                        只影响本进程的发送顺序：高优先级数据与普通数据共用 seq，接收方仍按 seq 顺序交付，
+ *                              排在更早 seq 之后（包括等待空洞补齐或窗口滑过）
+ */
+void instrument_priority(uint8_t chn, bool high);
+
+/**
+ * @brief                       读取异步发送统计
+ * @param out                   输出
+ */
+void instrument_async_stat(instrument_async_stat_t* out);
+
 /**
  * @brief                       启动 instrument 监听
  * @param cb                    消息回调函数，按 seq 顺序交付
@@ -369,6 +677,72 @@ void instrument_slot(uint8_t chn, const char* tag, const char* fmt, va_list para
  */
 ret_t instrument_listen(instrument_cb cb, cstr_t id/* nullable */);
 
+/**
+ * @brief                       启动 instrument 监听（带时间信息的回调）
+ * @param cb                    消息回调函数，按 seq 顺序交付（非 NULL）
+ * @param id                    同 instrument_listen
+ * @return                      E_NONE 成功，否则返回错误码
+ * @note                        Linux 上开启 SO_TIMESTAMPNS，meta->recv_us 为内核收到包的时间，
+ *                              乱序缓存后交付的包仍为其到达时间；批量包内各记录的时间相同
+ *                              recv_us - send_us 即端到端延迟（跨主机时包含两端时钟偏差）
+ *                              之后调用 instrument_listen 恢复普通回调
+ */
+ret_t instrument_listen_ex(instrument_ex_cb cb, cstr_t id/* nullable */);
+
+/**
+ * @brief                       开启/关闭发送时间戳（发送方）
+ * @param enable                true=数据包与批量包末尾附带 8 字节发送时间（墙钟 us），type 带 0x80 标志
+ * @note                        单包可携带的文本减少 8 字节；批量包为发出时的时间
+ *                              未升级的监听方会把时间戳当作文本末尾的 8 个字节
+ */
+void instrument_timestamp(bool enable);
+
+/**
+ * @brief                       读取聚合接收统计
+ * @param total                 输出（rid 为 0）
+ * @note                        需先 instrument_listen；计数从接收线程启动起累计，发送方被老化移除后仍保留
+ *                              同主机共享内存交付的记录计入 received / bytes / in_order
+ *                              overflows 持续增长说明接收缓冲区不足（见 rcvbuf），dropped 还包括网络丢包
+ *                              读取的是接收线程每批处理后发布的快照，可在 instrument_cb 中调用（回调中看到的是上一批的统计）
+ */
+void instrument_stats(instrument_stat_t* total);
+
+/**
+ * @brief                       读取各发送方的接收统计
+ * @param out                   输出数组（nullable，仅查询数量）
+ * @param max                   out 的容量
+ * @return                      发送方总数（可能大于 max，只拷贝前 max 个）
+ * @note                        只包含 UDP 接收的发送方；发送方被老化移除或重新 instrument_listen 时清除
+ */
+size_t instrument_stats_read(instrument_stat_t* out/* nullable */, size_t max);
+
+/**
+ * @brief                       开启/关闭按订阅发送（发送方）
+ * @param enable                true=只格式化发送有监听方订阅的通道，false=全部发送（默认）
+ * @return                      E_NONE 成功，否则返回错误码
+ * @note                        监听方每秒广播订阅的通道（type=10），发送方保留 3.5 秒；无人订阅的通道在
+ *                              instrument_slot 入口（一次 relaxed 读）直接返回，不执行 vsnprintf
+ *                              开启时广播查询，已有监听方立即应答；应答到达前的记录被丢弃
+ *                              内部启动接收线程；本进程设置了本地回调（instrument_listen）时不过滤
+ */
+ret_t instrument_interest(bool enable);
+
+/**
+ * @brief                       设置本监听方订阅的通道（随订阅包广播）
+ * @param chn                   订阅的通道列表，以 0 结尾；第一个参数为 0 表示订阅全部通道（默认）
+ * @note                        缩小订阅后，发送方在已广播的订阅过期（3.5 秒）后才停止发送
+ * @example
+ *                              instrument_subscribe(LOG_SLOT_ERROR, LOG_SLOT_WARN, 0);
+ */
+void instrument_subscribe(int chn, ...);
+
+/**
+ * @brief                       设置接收端 sender 老化时间
+ * @param ttl_ms                超过该时间未收到包的发送方被移除（释放其序号状态和缓存的乱序包），0 表示不老化
+ * @note                        默认 60 秒；发送方 rid 随进程重启随机生成，不老化会持续累积
+ */
+void instrument_sender_ttl(uint32_t ttl_ms);
+
 /**
  * @brief                       启用/禁用指定的 instrument 选项
  * @param idx                   选项索引 (0-based)
@@ -376,19 +750,52 @@ ret_t instrument_listen(instrument_cb cb, cstr_t id/* nullable */);
  * @return                      E_NONE 成功，否则返回错误码
  * @note                        选项状态通过 UDP 广播同步到所有节点
  *                              可用于远程控制功能开关
+ *                              内部启动接收线程：每 5 秒广播一次全部选项的快照（补偿丢失的增量包），并应答新节点
+ *                              启动时的快照请求；每个选项字节带版本戳（墙钟 ms + rid），后设置者胜
  */
 ret_t instrument_set(uint16_t idx, bool enable);
 
 /**
  * @brief                       查询指定 instrument 选项是否启用
  * @param idx                   选项索引 (0-based)
- * @return                      true=已启用, false=未启用或索引越界
+ * @return                      true=已启用, false=未启用或接收线程启动失败
+ * @note                        首次调用启动接收线程，之后无锁读取 bitset
  */
 bool instrument_get(uint16_t idx);
 
 #define instrument_option(idx)       (instrument_get(INSTRUMENT_OPT_BASE + (idx)))
 #define instrument_enable(idx, en)   (instrument_set(INSTRUMENT_OPT_BASE + (idx), en))
 
+#define INSTRUMENT_OPT_WORDS    2048                /* 选项 bitset 容量（字），覆盖全部 uint16_t 索引 */
+
+extern uint32_t instrument_bits[INSTRUMENT_OPT_WORDS];  // 选项 bitset（位 idx 在 [idx / 32] 的第 idx % 32 位）
+extern uint32_t instrument_gen;                  // 选项变化计数（任一选项或远程日志级别变化时递增）
+
+/*
+ * instrument_peek(idx)         热路径的选项检查：一次 relaxed 读 + 位测试（定义在原子操作之后）
+ *                              不启动接收线程，需先调用一次 instrument_get（或 instrument_listen/instrument_log_follow）
+ * instrument_option_peek(idx)  同上，索引加 INSTRUMENT_OPT_BASE
+ * instrument_option_gen()      读取 instrument_gen：不变时可复用由选项推导出的缓存结果
+ */
+
+/**
+ * @brief                       设置指定模块（tag）的运行时日志级别，并同步到所有节点
+ * @param tag                   模块 tag（忽略两端的括号和空格，如 "net" 匹配 "[      net]"）
+ * @param level                 覆盖的日志级别，LOG_SLOT_NONE 表示恢复编译时的 LOG_LEVEL
+ * @return                      E_NONE 成功
+ * @note                        级别保存在选项 bitset 的 INSTRUMENT_LOG_BASE 区域（64 个 4 位槽，按 tag 哈希，
+ *                              不同 tag 可能共用一个槽）。变化时刷新各调用点缓存的级别，print 热路径不访问 bitset
+ *                              高于 LOG_LEVEL 的输出原本转发到 instrument_slot，提升级别后改为正常输出
+ */
+ret_t instrument_log_level(cstr_t tag, log_level_e level);
+
+/**
+ * @brief                       接收其他节点通过 instrument_log_level 下发的日志级别
+ * @return                      E_NONE 成功
+ * @note                        启动接收线程（与 instrument_get/instrument_listen 相同）
+ */
+ret_t instrument_log_follow(void);
+
 /**
  * @brief                       阻塞等待对端调用 instrument_continue
  * @param port                  本方名称（广播给对端，作为 WAIT 消息内容）
@@ -416,21 +823,67 @@ ret_t instrument_continue(cstr_t to, cstr_t from);
  * @param buffer                入参：请求内容；出参：响应内容
  * @param bufsz                 buffer 大小
  * @return                      E_NONE 收到响应，E_TIMEOUT 超时
- * @note                        同步阻塞，不支持并发（所有远程调用串行执行）
+ * @note                        同步阻塞；多个线程可同时发起请求（每个请求有独立的 req_id）
  *                              接收方通过 instrument_cb(rid, ctrl, msg, content, len) 收到请求
  *                              tag 非 NULL 是与 WAIT 的区别标识
  */
 ret_t instrument_req(cstr_t id, uint32_t timeout_ms, 
                      cstr_t msg, char *buffer, size_t bufsz);
 
+/**
+ * @brief                       异步请求完成回调（在接收线程中调用）
+ * @param ctx                   instrument_req_async 传入的上下文
+ * @param handle                请求句柄
+ * @param ret                   E_NONE 收到响应，E_TIMEOUT 超时
+ * @param reply                 响应内容（即请求方 buffer），超时为 NULL
+ * @param len                   响应长度
+ */
+typedef void (*instrument_req_cb)(void* ctx, int handle, ret_t ret, char *reply, int len);
+
+/**
+ * @brief                       发起异步请求，立即返回
+ * @param id, timeout_ms, msg, buffer, bufsz    同 instrument_req（buffer 在请求完成前须保持有效）
+ * @param cb                    完成回调；NULL 表示通过 instrument_req_wait 等待
+ * @param ctx                   回调上下文
+ * @return                      请求句柄（> 0），失败返回错误码（E_OUT_OF_CAPACITY 未完成或未 wait 的请求过多）
+ * @note                        同时最多 256 个未完成请求；重发和超时由接收线程处理（精度约 100ms）
+ *                              cb 为 NULL 时必须调用 instrument_req_wait 直到返回非 E_TIMEOUT 以释放句柄
+ */
+int instrument_req_async(cstr_t id, uint32_t timeout_ms, cstr_t msg,
+                         char *buffer, size_t bufsz, instrument_req_cb cb, void* ctx);
+
+/**
+ * @brief                       等待异步请求完成
+ * @param handle                instrument_req_async 返回的句柄（cb 为 NULL）
+ * @param timeout_ms            本次等待时长（毫秒），0 表示等到请求完成或请求自身超时
+ * @return                      E_NONE 收到响应（句柄释放），E_TIMEOUT 本次等待超时（句柄仍有效）
+ *                              或请求超时（句柄释放），E_INVALID 无效句柄
+ */
+ret_t instrument_req_wait(int handle, uint32_t timeout_ms);
+
 /**
  * @brief                       响应 instrument_req 请求
  * @param rid                   请求方的 rid（来自 instrument_cb 的 rid 参数）
  * @param reply                 响应文本（写入请求方的 buffer）
  * @return                      E_NONE 成功
+ * @note                        在 REQ 回调中调用时自动匹配该请求；回调返回后再应答请使用 instrument_resp_id
  */
 ret_t instrument_resp(uint16_t rid, cstr_t reply);
 
+/**
+ * @brief                       当前 REQ 回调对应的 req_id（回调之外返回 0）
+ */
+uint16_t instrument_req_id(void);
+
+/**
+ * @brief                       响应指定的请求（延迟应答）
+ * @param rid                   请求方的 rid
+ * @param req_id                回调中通过 instrument_req_id() 取得的 req_id
+ * @param reply                 响应文本
+ * @return                      E_NONE 成功
+ */
+ret_t instrument_resp_id(uint16_t rid, uint16_t req_id, cstr_t reply);
+
 
 extern int64_t instrument_tick;                  // <=0: 累计等待时长(us)取反; >0: wait中冻结的 tick_us
 
@@ -440,22 +893,139 @@ extern int64_t instrument_tick;                  // <=0: 累计等待时长(us)
 #define instrument_local(...)    ((void)0)
 #define instrument_remote()      ((void)0)
 #define instrument_slot(...)     ((void)0)
+#define instrument_batch(...)    ((ret_t)((volatile int){E_NONE}))
+#define instrument_flush()       ((void)0)
+#define instrument_metric(...)   ((volatile int){E_NO_SUPPORT})
+#define instrument_count(...)    ((void)0)
+#define instrument_gauge(...)    ((void)0)
+#define instrument_observe(...)  ((void)0)
+#define instrument_metrics(...)  ((ret_t)((volatile int){E_NONE}))
+#define instrument_metrics_read(...) ((volatile size_t){0})
+#define instrument_shm(...)      ((ret_t)((volatile int){E_NONE}))
+#define instrument_reliable(...) ((ret_t)((volatile int){E_NONE}))
+#define instrument_async(...)    ((ret_t)((volatile int){E_NONE}))
+#define instrument_priority(...) ((void)0)
+#define instrument_async_stat(out) memset(out, 0, sizeof(instrument_async_stat_t))
+#define instrument_stats(out)    memset(out, 0, sizeof(instrument_stat_t))
+#define instrument_stats_read(...) ((volatile size_t){0})
 #define instrument_loggable(...) ((void)0)
 #define instrument_listen(...)   ((ret_t)((volatile int){E_NONE}))
+#define instrument_listen_ex(...) ((ret_t)((volatile int){E_NONE}))
+#define instrument_timestamp(...) ((void)0)
+#define instrument_sender_ttl(...) ((void)0)
+#define instrument_interest(...) ((ret_t)((volatile int){E_NONE}))
+#define instrument_subscribe(...) ((void)0)
 #define instrument_set(...)      ((ret_t)((volatile int){E_NONE}))
 #define instrument_get(...)      ((volatile bool){false})
 #define instrument_enable(...)   ((ret_t)((volatile int){E_NONE}))
 #define instrument_option(...)   ((volatile bool){false})
+#define instrument_peek(...)     ((volatile bool){false})
+#define instrument_option_peek(...) ((volatile bool){false})
+#define instrument_option_gen()  ((volatile uint32_t){0})
+#define instrument_log_level(...) ((ret_t)((volatile int){E_NONE}))
+#define instrument_log_follow(...) ((ret_t)((volatile int){E_NONE}))
 #define instrument_wait(...)     ((ret_t)((volatile int){E_NONE}))
 #define instrument_continue(...) ((ret_t)((volatile int){E_NONE}))
 #define instrument_req(...)      ((ret_t)((volatile int){E_NONE}))
 #define instrument_resp(...)     ((ret_t)((volatile int){E_NONE}))
+#define instrument_req_async(...) ((volatile int){E_NO_SUPPORT})
+#define instrument_req_wait(...) ((ret_t)((volatile int){E_NONE}))
+#define instrument_req_id()      ((volatile uint16_t){0})
+#define instrument_resp_id(...)  ((ret_t)((volatile int){E_NONE}))
 #define instrument_tick          ((volatile int64_t){0})
 #endif
 
+//-----------------------------------------------------------------------------
+// 日志调用点（print/printf 的每个调用位置对应一个静态描述符）
+
+typedef enum {
+    LOG_SITE_AUTO = 0,                              /* 按 LOG_LEVEL 决定（默认） */
+    LOG_SITE_ON,                                    /* 强制输出（忽略 LOG_LEVEL） */
+    LOG_SITE_OFF,                                   /* 关闭，宏不再对参数求值 */
+} log_site_e;
+
+typedef struct log_site {
+    const char*                 file;               /* __FILE__ */
+    const char*                 fmt;                /* 格式串（首次执行时记录，不含级别前缀） */
+    const char*                 tag;                /* 模块 tag（首次执行时记录） */
+    struct log_site*            next;               /* 运行时注册链表 */
+    int32_t                     line;
+    volatile uint8_t            enabled;            /* print 宏在求值参数之前检查 */
+    uint8_t                     level;              /* 级别（chn），首次执行时解析 */
+    uint8_t                     mode;               /* log_site_e */
+    uint8_t                     state;              /* LOG_SITE_S_* */
+    uint32_t                    tat;                /* 限流：令牌桶理论到达时间 (us) */
+    uint32_t                    hits;               /* 限流：采样计数 */
+    uint32_t                    dropped;            /* 限流：尚未汇总的被抑制行数 */
+    uint32_t                    report;             /* 限流：上次汇总时间 (us) */
+    log_cb                      cb_log;             /* 限流：汇总行的输出目标（首次抑制时记录） */
+    bool                        pre_tag;
+} log_site_t;
+
+#define LOG_SITE_S_RESOLVED     1
+#define LOG_SITE_S_AUTO_ON      2
+#define LOG_SITE_LEVEL(site)    (((site)->state >> 4) ? ((site)->state >> 4) : LOG_LEVEL)  /* 高 4 位为运行时覆盖的级别 */
+
+/**
+ * @brief 首次执行时登记调用点（由 print 宏内部调用）
+ * @param auto_on AUTO 模式下是否输出（由调用方所在模块的 LOG_LEVEL 决定）
+ */
+void
+log_site_resolve(log_site_t* site, uint8_t level, const char* fmt, const char* tag, bool auto_on);
+
+/**
+ * @brief 设置匹配调用点的输出模式
+ * @param pattern 通配符（支持 * 和 ?），匹配 "文件名:行号"、文件名或 tag；NULL 匹配全部
+ * @param mode log_site_e
+ * @return 当前已登记且匹配的调用点数
+ * @note 规则会保留，之后首次执行的调用点同样生效（后设置的规则优先）；LOG_SITE_AUTO 同时清除同名规则
+ */
+int
+log_site_set(const char* pattern, log_site_e mode);
+
+/**
+ * @brief 遍历调用点
+ * @param cb 返回 false 停止遍历
+ * @return 遍历的调用点数
+ * @note ELF 平台可遍历所有编入程序的调用点（未执行过的 fmt/tag 为 NULL），其他平台仅遍历执行过的调用点
+ */
+int
+log_sites(bool (*cb)(const log_site_t* site, void* ctx), void* ctx);
+
+/**
+ * @brief 设置指定级别的调用点限流与采样（每个 print 调用点独立计数）
+ * @param level 日志级别（LOG_SLOT_FATAL ~ LOG_SLOT_VERBOSE）
+ * @param rate 每个调用点每秒最多输出的行数（令牌桶速率），0 不限速
+ * @param burst 令牌桶容量（允许的突发行数），0 取 rate
+ * @param sample 每 N 次调用只输出 1 次（先于限速判断），0 或 1 不采样
+ * @note 被抑制的调用不会格式化参数，也不写入任何输出目标；调用点之后放行时，
+ *       若距上次汇总超过 1 秒，先输出一行 "suppressed N similar messages (文件:行号)"，
+ *       调用点不再放行时由后台定时线程输出该汇总。
+ *       rate、burst、sample 均为 0 时关闭该级别的限流
+ */
+void
+log_limit(log_level_e level, uint32_t rate, uint32_t burst, uint32_t sample);
+
+/**
+ * @brief 限流判断（由 print 宏内部调用，仅在 log_limit_mask 对应位开启时）
+ * @return false 表示本次调用被抑制
+ */
+bool
+log_site_admit(log_site_t* site, uint8_t level, const char* tag, log_cb cb_log, bool pre_tag);
+
+extern uint8_t log_limit_mask;                  /* 位 n 表示级别 n 开启了限流/采样（供 print 使用） */
+
+#if defined(__ELF__) && (defined(__GNUC__) || defined(__clang__))
+#define LOG_SITE_SECTION        __attribute__((section("stdc_log_sites"), used))
+#define LOG_SITE_REG(site)      static log_site_t* const _log_site_p_ LOG_SITE_SECTION = &site;
+#else
+#define LOG_SITE_REG(site)
+#endif
+
 //-----------------------------------------------------------------------------
 
-static inline void print(const char* fmt, ...) {
+// 模块 tag（每个编译单元一份，只初始化一次）
+static inline const char* log_mod_tag(void) {
 
     // +3: "[]\0"
 #   if LOG_TAG_MAX > 0
@@ -501,6 +1071,25 @@ static inline void print(const char* fmt, ...) {
         else sprintf(s_tag, LOG_TAG_L "%s%.*s" LOG_TAG_R, ROOT_TAG, 128 + 1 - n, (char*)MOD_TAG);
 #       endif
     }
+    return s_tag;
+}
+
+#ifdef LOG_INSTRUMENT
+#define LOG_SITE_AUTO_ON(chn)   true                /* 超出 LOG_LEVEL 的输出转发 instrument_slot，由其运行时决定 */
+#else
+#define LOG_SITE_AUTO_ON(chn)   ((chn) <= LOG_LEVEL)
+#endif
+
+// 首次执行时登记调用点，之后仅返回是否启用
+#define LOG_SITE_CHECK(site, chn, fmt, on) \
+    (((site)->state & LOG_SITE_S_RESOLVED) ? (site)->enabled : (log_site_resolve(site, chn, fmt, s_tag, on), (site)->enabled))
+
+// print(":") 缓存模式（每线程、每编译单元）：缓存期间的片段不受调用点已缓存的 enabled 状态限制
+static TLS bool log_caching = false;
+
+static inline void log_print(log_site_t* site, const char* fmt, ...) {
+
+    const char* s_tag = log_mod_tag();
 
 #ifndef NDEBUG
     // DEBUG 模式下，fmt 为空作为一种标识，即将文件名和行号作为 tag 输出，同时将 ... 中的第一个参数作为 fmt
@@ -522,9 +1111,8 @@ static inline void print(const char* fmt, ...) {
     uint8_t chn = (uint8_t)LOG_DEF;
 #endif
 
-    static TLS bool s_begin = false;
-
     if (*fmt == ':') {
+        if (!LOG_SITE_CHECK(site, LOG_SLOT_NONE, fmt, true)) { va_end(args); return; }
         // 如果以双 ':' 开头，则在调整状态下，直接输出到标准输出
         if (*++fmt == ':') {
 #ifndef NDEBUG
@@ -539,8 +1127,8 @@ static inline void print(const char* fmt, ...) {
         // + 注意，换成模式不支持 print(":", fmt, ...) 形式的调用
         //   因为 print(":") 被视为只开启缓存模式，但不输出任何内容
 
-        if (s_begin) log_slot(LOG_SLOT_NONE, NULL, NULL, args, (log_cb)LOG_CALLBACK, LOG_TAG_P); // 如果之前已经开启缓存，则清空缓存，从头开始
-        else { s_begin = true;
+        if (log_caching) log_slot(LOG_SLOT_NONE, NULL, NULL, args, (log_cb)LOG_CALLBACK, LOG_TAG_P); // 如果之前已经开启缓存，则清空缓存，从头开始
+        else { log_caching = true;
             if (*fmt == ' ') ++fmt;                     // 忽略 1 个且只忽略 1 个空格（即允许多个空格作为缩进）
             log_slot(LOG_SLOT_NONE, NULL, fmt, args, (log_cb)LOG_CALLBACK, LOG_TAG_P);
         }
@@ -549,7 +1137,7 @@ static inline void print(const char* fmt, ...) {
     }
 
     if (fmt[1] == ':') {
-        s_begin = false;                                // 只要指定 chn 标识，就会关闭缓存模式
+        log_caching = false;                            // 只要指定 chn 标识，就会关闭缓存模式
         const char *q="FEWIDV", *p = strchr(q, *fmt);
         if (p) { chn = (uint8_t)(p - q) + 1;
             fmt+=2; if (*fmt == ' ') ++fmt;             // 忽略 1 个且只忽略 1 个空格（即允许多个空格作为缩进）
@@ -560,16 +1148,30 @@ static inline void print(const char* fmt, ...) {
             chn = (uint8_t)(*fmt);
             fmt+=2; if (*fmt == ' ') ++fmt;
             if (!*fmt) fmt = va_arg(args, const char*); // 支持 print("E:", fmt, ...) 形式的调用
-            instrument_slot(chn, tag, fmt, args);       // 如果指定的 chn 不合法，则视为 instrument 输出
+            if (LOG_SITE_CHECK(site, chn, fmt, true))
+                instrument_slot(chn, tag, fmt, args);   // 如果指定的 chn 不合法，则视为 instrument 输出
+#else
+            (void)LOG_SITE_CHECK(site, (uint8_t)(*fmt), fmt, false);
 #endif
             va_end (args);
             return;
         }
     }
 
-    if (s_begin) log_slot(LOG_SLOT_NONE, NULL, fmt, args, (log_cb)LOG_CALLBACK, LOG_TAG_P);
-    else if (chn <= LOG_LEVEL)
+    // 缓存模式的片段不依赖调用点的启用状态（调用点可能在缓存模式之外首次执行而被关闭），仅遵从显式的 LOG_SITE_OFF
+    if (!LOG_SITE_CHECK(site, chn, fmt, LOG_SITE_AUTO_ON(chn)) && !(log_caching && site->mode != LOG_SITE_OFF)) {
+        va_end(args); return;
+    }
+
+    // 限流/采样：在格式化之前判断，被抑制的调用不产生任何开销
+    if (!log_caching && chn <= LOG_SLOT_VERBOSE && ((log_limit_mask >> chn) & 1) &&
+        !log_site_admit(site, chn, tag, (log_cb)LOG_CALLBACK, LOG_TAG_P)) { va_end(args); return; }
+
+    if (log_caching) log_slot(LOG_SLOT_NONE, NULL, fmt, args, (log_cb)LOG_CALLBACK, LOG_TAG_P);
+    else if (chn <= LOG_SITE_LEVEL(site) || site->mode == LOG_SITE_ON)
         log_slot(chn, tag, fmt, args, (log_cb)LOG_CALLBACK, LOG_TAG_P);
+    else if (log_recorder_level)                    // 超出正常输出级别：只写入飞行记录器
+        log_slot((log_level_e)(chn | LOG_SLOT_REC_ONLY), tag, fmt, args, (log_cb)LOG_CALLBACK, LOG_TAG_P);
 #ifdef LOG_INSTRUMENT
     else instrument_slot(chn, tag, fmt, args);
 #endif
@@ -577,6 +1179,16 @@ static inline void print(const char* fmt, ...) {
     va_end (args);
 }
 
+/**
+ * @brief 日志输出（级别由 fmt 前缀 "F:E:W:I:D:V:" 指定）
+ * @note 每个调用位置对应一个静态 log_site_t，关闭的调用点不会对参数求值
+ */
+#define print(...) do { \
+    static log_site_t _log_site_ = { .file = __FILE__, .line = __LINE__, .enabled = 1, .mode = LOG_SITE_AUTO }; \
+    LOG_SITE_REG(_log_site_) \
+    if (_log_site_.enabled || (log_caching && _log_site_.mode != LOG_SITE_OFF)) log_print(&_log_site_, __VA_ARGS__); \
+} while (0)
+
 #ifndef NDEBUG
 #define printf(...)     print(NULL, __FILE_NAME__, __LINE__, __VA_ARGS__)
 #define instrument      print
@@ -2135,6 +2747,16 @@ static inline bool P_test_and_set_impl(volatile LONG* pVar, LONG* pTestVar, LONG
 #error "Unsupported platform"
 #endif
 
+#ifdef LOG_INSTRUMENT
+static inline bool instrument_peek(uint16_t idx) {
+    return (P_get(&instrument_bits[idx / 32]) >> (idx % 32)) & 1;
+}
+static inline uint32_t instrument_option_gen(void) {
+    return P_get(&instrument_gen);
+}
+#define instrument_option_peek(idx)  (instrument_peek(INSTRUMENT_OPT_BASE + (idx)))
+#endif
+
 //-----------------------------------------------------------------------------
 
 #if P_WIN
@@ -2200,6 +2822,13 @@ static inline int P_wait_timeout(P_cond_t* pCond, P_mutex_t* pMutex, const P_clo
 }
 #endif
 
+// 自旋锁（lock 初值为 0，无需初始化）：只用于极短、且无法事先初始化互斥锁的临界区，如互斥锁自身的一次性初始化
+static inline void P_spin_lock(volatile int* lock) {
+    int expected = 0;
+    while (!P_test_and_set_acq(lock, &expected, 1)) { expected = 0; P_usleep(1); }
+}
+#define P_spin_unlock(lock)                     P_set_rel(lock, 0)
+
 ///////////////////////////////////////////////////////////////////////////////
 // 多线程
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,89 @@
+/**
+ * instrument 接收丢包率基准：固定发送负载下统计监听方实际收到的记录比例
+ * 编译: make bench，运行: test/bench_inst_recv [每秒记录数] [秒数] [发送线程数]
+ * 对比逐包 recvfrom：make clean && make bench CC="gcc -DINST_RECV_BATCH=1"
+ * 监听方为 fork 出的子进程（仅 POSIX），同一主机上不要同时运行其他 instrument 程序
+ */
+
+#include "stdc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define RECORD  "% bench record ........................................................................"
+
+static volatile long    g_recs;
+static long             g_rate, g_secs;
+static int              g_threads;
+
+static void on_rec(uint16_t rid, uint8_t chn, const char* tag, char* txt, int len) {
+    (void)rid; (void)tag; (void)txt; (void)len;
+    if (chn == 'B') P_get_and_inc(&g_recs, 1);
+}
+
+static void send_rec(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    instrument_slot('B', "bench", fmt, ap);
+    va_end(ap);
+}
+
+// 每个发送线程按 1ms 节拍发送固定条数，保持恒定的提供负载
+static int32_t sender(void* ctx) {
+    (void)ctx;
+    long per_ms = g_rate / 1000 / g_threads, total = 0;
+    if (per_ms < 1) per_ms = 1;
+    uint64_t start = P_tick_us();
+    for (long ms = 0; ms < g_secs * 1000; ++ms) {
+        for (long i = 0; i < per_ms; ++i) send_rec(RECORD);
+        total += per_ms;
+        int64_t wait = (int64_t)(start + (uint64_t)(ms + 1) * 1000) - (int64_t)P_tick_us();
+        if (wait > 0) P_usleep((uint32_t)wait);
+    }
+    return (int32_t)total;
+}
+
+int main(int argc, char** argv) {
+    g_rate    = argc > 1 ? atol(argv[1]) : 100000;
+    g_secs    = argc > 2 ? atol(argv[2]) : 3;
+    g_threads = argc > 3 ? atoi(argv[3]) : 4;
+    if (g_rate <= 0 || g_secs <= 0 || g_threads <= 0 || g_threads > 64) return 1;
+
+    int fds[2];
+    if (pipe(fds) < 0) return 1;
+    pid_t pid = fork();
+    if (pid < 0) return 1;
+
+    if (pid == 0) {                                 // 监听方：发送结束后再等 1 秒收尾
+        close(fds[0]);
+        if (instrument_listen(on_rec, NULL) != E_NONE) _exit(1);
+        if (write(fds[1], "r", 1) != 1) _exit(1);   // 通知发送方已就绪
+        P_usleep((uint32_t)(g_secs + 1) * 1000000);
+        instrument_stat_t st; instrument_stats(&st);
+        long out[3] = { g_recs, (long)st.dropped, (long)st.overflows };
+        if (write(fds[1], out, sizeof(out)) != (ssize_t)sizeof(out)) _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    char ready;
+    if (read(fds[0], &ready, 1) != 1) return 1;
+    P_usleep(200000);                               // 等待接收线程开始接收
+    instrument_remote();
+
+    thd_t thds[64];
+    for (int i = 0; i < g_threads; ++i) P_thread(&thds[i], sender, NULL, P_THD_NORMAL, 0);
+    long offered = 0;
+    for (int i = 0; i < g_threads; ++i) { int32_t n = 0; P_join(thds[i], &n); offered += n; }
+    instrument_flush();
+
+    long out[3] = { 0 };
+    if (read(fds[0], out, sizeof(out)) != (ssize_t)sizeof(out)) return 1;
+    waitpid(pid, NULL, 0);
+
+    fprintf(stderr, "offered %ld records (%ld/s x %lds, %d threads)\n", offered, g_rate, g_secs, g_threads);
+    fprintf(stderr, "received %ld, lost %.2f%% (window dropped %ld, kernel overflows %ld)\n",
+            out[0], offered ? 100.0 * (double)(offered - out[0]) / (double)offered : 0.0, out[1], out[2]);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * log_prefix 开销基准：比较无前缀与各前缀组合下每行日志的格式化耗时
+ * 编译: make bench，运行: test/bench_log_prefix [行数]
+ * 输出通过空回调丢弃，关闭 instrument 网络镜像，只计算 log_slot 的格式化与前缀拼接
+ */
+
+#include "stdc.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void sink(log_level_e level, const char* tag, char* txt, int len) {
+    (void)level; (void)tag; (void)txt; (void)len;
+}
+
+static void emit(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_slot(LOG_SLOT_INFO, "[ bench]", fmt, ap, sink, true);
+    va_end(ap);
+}
+
+static double run(int flags, long n) {
+    log_prefix(flags);
+    for (long i = 0; i < n / 10; ++i) emit("warmup %ld\n", i);
+    uint64_t t0 = P_tick_us();
+    for (long i = 0; i < n; ++i) emit("request %ld done in %d us\n", i, (int)(i & 1023));
+    uint64_t t1 = P_tick_us();
+    return (double)(t1 - t0) * 1000.0 / (double)n;
+}
+
+int main(int argc, char** argv) {
+    long n = argc > 1 ? atol(argv[1]) : 2000000;
+    instrument_local(0);                            // 调试构建默认镜像到 instrument，避免计入 sendto
+    static const struct { int flags; const char* name; } cases[] = {
+        { LOG_PREFIX_NONE,                  "none" },
+        { LOG_PREFIX_TID,                   "tid" },
+        { LOG_PREFIX_MONO,                  "mono" },
+        { LOG_PREFIX_WALL,                  "wall" },
+        { LOG_PREFIX_WALL | LOG_PREFIX_TID, "wall+tid" },
+    };
+
+    // 各组合轮流运行多轮取最小值，减少调度与频率波动的影响
+    enum { CASES = sizeof(cases) / sizeof(cases[0]), ROUNDS = 5 };
+    double best[CASES];
+    for (int r = 0; r < ROUNDS; ++r)
+        for (int i = 0; i < CASES; ++i) {
+            double ns = run(cases[i].flags, n / ROUNDS);
+            if (!r || ns < best[i]) best[i] = ns;
+        }
+
+    fprintf(stderr, "%-10s %10s %10s\n", "prefix", "ns/line", "delta");
+    for (int i = 0; i < CASES; ++i)
+        fprintf(stderr, "%-10s %10.1f %+10.1f\n", cases[i].name, best[i], best[i] - best[0]);
+    log_prefix(LOG_PREFIX_NONE);
+    return 0;
+}